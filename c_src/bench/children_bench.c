@@ -0,0 +1,151 @@
+/**
+* children_bench
+* @description
+*   Puts N children through the pm_child_table_t the daemon tracks them in
+*   and through a uthash table of calloced nodes (how they used to be
+*   kept): adding them, finding every one, walking them all, and churning
+*   through short-lived ones that come and go
+* @usage
+*   ./bench/children_bench [children]
+**/
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "process_manager.h"
+
+#define ROUNDS 10
+
+typedef struct _hashed_child_ {
+  pid_t pid;
+  pid_t kill_pid;
+  time_t deadline;
+  int status;
+  int transId;
+  UT_hash_handle hh;
+} hashed_child;
+
+static double now_usec()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+/* Pids the way the kernel hands them out, mostly in order with gaps */
+static void make_pids(pid_t *pids, int n)
+{
+  int i;
+  pid_t pid = 300;
+  for (i = 0; i < n; i++) pids[i] = (pid += 1 + rand() % 4);
+}
+
+static void report(const char *what, const char *op, double usec, int n)
+{
+  printf("%-7s %-7s %10.1f nsec per child\n", what, op, usec * 1000 / n);
+}
+
+static void bench_table(pid_t *pids, int n)
+{
+  pm_child_table_t t;
+  double start, add = 0, find = 0, walk = 0, churn = 0;
+  long sum = 0;
+  int i, r;
+
+  for (r = 0; r < ROUNDS; r++) {
+    pm_children_init(&t);
+    start = now_usec();
+    for (i = 0; i < n; i++) pm_children_add(&t, pids[i], i);
+    add += now_usec() - start;
+
+    start = now_usec();
+    for (i = 0; i < n; i++) sum += pm_children_find(&t, pids[i]);
+    find += now_usec() - start;
+
+    start = now_usec();
+    for (i = 0; i < t.count; i++) sum += t.status[i] + t.transId[i];
+    walk += now_usec() - start;
+
+    // Every child exits and a new one takes its place
+    start = now_usec();
+    for (i = 0; i < n; i++) {
+      pm_children_remove(&t, pids[i]);
+      pm_children_add(&t, pids[i] + 1000000, i);
+    }
+    churn += now_usec() - start;
+    pm_children_free(&t);
+  }
+  report("table", "add", add / ROUNDS, n);
+  report("table", "find", find / ROUNDS, n);
+  report("table", "walk", walk / ROUNDS, n);
+  report("table", "churn", churn / ROUNDS, n);
+  if (sum == 42) printf("\n");
+}
+
+static void bench_uthash(pid_t *pids, int n)
+{
+  hashed_child *children, *c, *tmp;
+  double start, add = 0, find = 0, walk = 0, churn = 0;
+  long sum = 0;
+  int i, r;
+
+  for (r = 0; r < ROUNDS; r++) {
+    children = NULL;
+    start = now_usec();
+    for (i = 0; i < n; i++) {
+      c = (hashed_child *) calloc(1, sizeof(hashed_child));
+      c->pid = pids[i];
+      c->transId = i;
+      HASH_ADD_INT(children, pid, c);
+    }
+    add += now_usec() - start;
+
+    start = now_usec();
+    for (i = 0; i < n; i++) {
+      HASH_FIND_INT(children, &pids[i], c);
+      sum += c->transId;
+    }
+    find += now_usec() - start;
+
+    start = now_usec();
+    for (c = children; c != NULL; c = c->hh.next) sum += c->status + c->transId;
+    walk += now_usec() - start;
+
+    start = now_usec();
+    for (i = 0; i < n; i++) {
+      HASH_FIND_INT(children, &pids[i], c);
+      HASH_DEL(children, c);
+      free(c);
+      c = (hashed_child *) calloc(1, sizeof(hashed_child));
+      c->pid = pids[i] + 1000000;
+      c->transId = i;
+      HASH_ADD_INT(children, pid, c);
+    }
+    churn += now_usec() - start;
+
+    for (c = children; c != NULL; c = tmp) {
+      tmp = c->hh.next;
+      HASH_DEL(children, c);
+      free(c);
+    }
+  }
+  report("uthash", "add", add / ROUNDS, n);
+  report("uthash", "find", find / ROUNDS, n);
+  report("uthash", "walk", walk / ROUNDS, n);
+  report("uthash", "churn", churn / ROUNDS, n);
+  if (sum == 42) printf("\n");
+}
+
+int main(int argc, char const *argv[])
+{
+  int n = argc > 1 ? atoi(argv[1]) : 100000;
+  pid_t *pids = (pid_t *) calloc(n, sizeof(pid_t));
+
+  srand(42);
+  make_pids(pids, n);
+  printf("%d children\n", n);
+  bench_uthash(pids, n);
+  bench_table(pids, n);
+  free(pids);
+  return 0;
+}
@@ -0,0 +1,101 @@
+/**
+* reap_bench
+* @description
+*   Measures what one pm_check_children call costs with N running children,
+*   both on an idle tick (nobody exited) and when a handful of them exited,
+*   in the sweep and the drain reaping modes
+* @usage
+*   ./bench/reap_bench [max_children]
+**/
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "process_manager.h"
+
+#define EXITS_PER_ROUND 10
+#define ROUNDS          5
+
+extern pm_child_table_t running_children;
+static int reported = 0;
+
+static void count_exit(process_struct *ps) { reported++; }
+
+static double now_usec()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+static pid_t spawn_sleeper()
+{
+  pid_t pid = fork();
+  if (pid == 0) {
+    for (;;) pause();
+  }
+  if (pid > 0) pm_children_add(&running_children, pid, 0);
+  return pid;
+}
+
+/* Kill a few random children and wait (without reaping) until they are zombies */
+static void kill_some(pid_t *pids, int n, int count)
+{
+  siginfo_t info;
+  int i, victim;
+  for (i = 0; i < count && i < n; i++) {
+    victim = rand() % n;
+    kill(pids[victim], SIGKILL);
+    waitid(P_PID, pids[victim], &info, WEXITED | WNOWAIT);
+    // Keep the number of running children steady
+    pids[victim] = spawn_sleeper();
+  }
+}
+
+static void bench(enum ReapModeT mode, int children)
+{
+  pid_t *pids = (pid_t *) calloc(children, sizeof(pid_t));
+  double idle = 0, busy = 0, start;
+  int i, n = 0;
+
+  pm_set_reap_mode(mode);
+  for (i = 0; i < children; i++)
+    if ((pids[n] = spawn_sleeper()) > 0) n++;
+
+  for (i = 0; i < ROUNDS; i++) {
+    start = now_usec();
+    pm_check_children(count_exit, 0);
+    idle += now_usec() - start;
+
+    kill_some(pids, n, EXITS_PER_ROUND);
+    start = now_usec();
+    pm_check_children(count_exit, 0);
+    busy += now_usec() - start;
+  }
+
+  printf("%-6s %8d children: %10.1f usec idle tick, %10.1f usec per %d exits\n",
+    mode == PM_REAP_SWEEP ? "sweep" : "drain", n, idle / ROUNDS, busy / ROUNDS, EXITS_PER_ROUND);
+
+  while (pm_children_count(&running_children) > 0) {
+    pid_t pid = running_children.pid[0];
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    pm_children_remove_at(&running_children, 0);
+  }
+  free(pids);
+}
+
+int main(int argc, char const *argv[])
+{
+  int max = argc > 1 ? atoi(argv[1]) : 10000;
+  int children;
+
+  srand(42);
+  for (children = 10; children <= max; children *= 10) {
+    bench(PM_REAP_SWEEP, children);
+    bench(PM_REAP_DRAIN, children);
+  }
+  return 0;
+}
@@ -0,0 +1,60 @@
+/**
+* spawn_bench
+* @description
+*   Spawns /bin/true through pm_execute over and over with the posix_spawn
+*   and the fork paths, while holding a large, touched heap to stand in for
+*   a daemon that has grown
+* @usage
+*   ./bench/spawn_bench [spawns] [heap_mb]
+**/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "process_manager.h"
+
+static double now_usec()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+static void bench(enum SpawnModeT mode, int spawns, int heap_mb)
+{
+  double start, elapsed;
+  int i;
+
+  pm_set_spawn_mode(mode);
+  start = now_usec();
+  for (i = 0; i < spawns; i++) {
+    pid_t pid = pm_execute(0, "/bin/true", NULL, 0, NULL, NULL, NULL, NULL);
+    if (pid > 0) waitpid(pid, NULL, 0);
+  }
+  elapsed = now_usec() - start;
+
+  printf("%-11s %6d MB heap: %8.0f spawns/sec (%6.1f usec per spawn)\n",
+    mode == PM_SPAWN_FORK ? "fork" : "posix_spawn", heap_mb, spawns / (elapsed / 1e6), elapsed / spawns);
+}
+
+int main(int argc, char const *argv[])
+{
+  int spawns = argc > 1 ? atoi(argv[1]) : 200;
+  int max_mb = argc > 2 ? atoi(argv[2]) : 1024;
+  int heap_mb = 0;
+  char *heap = NULL;
+
+  setenv("SHELL", "/bin/sh", 0);
+  for (heap_mb = 0; heap_mb <= max_mb; heap_mb = heap_mb ? heap_mb * 4 : 16) {
+    // Touch every page so it is mapped and has to be copied by fork
+    if ((heap = (char *) realloc(heap, (size_t)heap_mb * 1024 * 1024 + 1)) == NULL) break;
+    memset(heap, 1, (size_t)heap_mb * 1024 * 1024 + 1);
+
+    bench(PM_SPAWN_AUTO, spawns, heap_mb);
+    bench(PM_SPAWN_FORK, spawns, heap_mb);
+  }
+  free(heap);
+  return 0;
+}
@@ -2,23 +2,23 @@
 #include <stdio.h>
 #include <string.h>
 #include <signal.h>
-#include <sys/time.h>             // For timeval struct
 #include <sys/wait.h>             // For waitpid
-#include <setjmp.h>
 
 #include "process_manager.h"
 #include "pm_helpers.h"
+#include "pm_loop.h"
 #include "ei_decode.h"
 #include "print_helpers.h"
 
 #define BUF_SIZE 128
+/* Bytes of queued replies past which child output stops being forwarded, and where it starts again */
+#define REPLY_HIGH_WATER  (256 * 1024)
+#define REPLY_LOW_WATER   (64 * 1024)
 
 /**
 * Globals ewww
 **/
-extern process_struct*  running_children;
-extern process_struct*  exited_children;
-struct sigaction        mainact;
+extern pm_child_table_t running_children;
 extern int              terminated;         // indicates that we got a SIGINT / SIGTERM event
 int                     run_as_user;
 pid_t                   process_pid;
@@ -26,6 +26,11 @@ extern int              dbg;
 int                     read_handle = 0;
 int                     write_handle = 1;
 extern char*            outputFile;
+off_t                   rotate_size = PM_OUTPUT_ROTATE_SIZE;
+int                     rotate_count = PM_OUTPUT_ROTATE_COUNT;
+int                     coalesce_ms = 5;
+int                     spawn_threads = PM_SPAWN_THREADS;
+const char*             journal = NULL;
 
 int setup()
 {
@@ -67,29 +72,97 @@ int parse_the_command_line(int argc, const char** argv)
       fcntl(write_handle, F_SETFL, fcntl(write_handle, F_GETFL) | O_NONBLOCK);
     } else if (!strncmp(argv[1], "--redirect_output", 17) || !strncmp(argv[1], "-o", 2)) {
       outputFile = strdup(argv[2]); argc--; argv++;
+    } else if (!strncmp(argv[1], "--reap_mode", 11)) {
+      // drain (the default) waits on any pid, sweep pokes at every running child
+      arg = argv[2]; argc--; argv++;
+      pm_set_reap_mode(!strcmp(arg, "sweep") ? PM_REAP_SWEEP : PM_REAP_DRAIN);
+    } else if (!strncmp(argv[1], "--spawn_mode", 12)) {
+      // auto (the default) uses posix_spawn when it can, fork always forks
+      arg = argv[2]; argc--; argv++;
+      pm_set_spawn_mode(!strcmp(arg, "fork") ? PM_SPAWN_FORK : PM_SPAWN_AUTO);
+    } else if (!strncmp(argv[1], "--rotate_size", 13)) {
+      // Bytes a pipe:/path output target grows to before it's rotated
+      arg = argv[2]; argc--; argv++; char * pEnd;
+      rotate_size = strtoll(arg, &pEnd, 10);
+      pm_output_set_rotation(rotate_size, rotate_count);
+    } else if (!strncmp(argv[1], "--rotate_count", 14)) {
+      arg = argv[2]; argc--; argv++; char * pEnd;
+      rotate_count = strtol(arg, &pEnd, 10);
+      pm_output_set_rotation(rotate_size, rotate_count);
+    } else if (!strncmp(argv[1], "--coalesce_ms", 13)) {
+      // How long "erlang" output may be held back to go out in bigger frames
+      arg = argv[2]; argc--; argv++; char * pEnd;
+      coalesce_ms = strtol(arg, &pEnd, 10);
+    } else if (!strncmp(argv[1], "--spawn_threads", 15)) {
+      // Workers that fork/exec for us, 0 spawns right on the loop
+      arg = argv[2]; argc--; argv++; char * pEnd;
+      spawn_threads = strtol(arg, &pEnd, 10);
+    } else if (!strncmp(argv[1], "--cgroup_root", 13)) {
+      // Delegated cgroup v2 directory the leaves of limited commands go under
+      arg = argv[2]; argc--; argv++;
+      if (pm_cgroup_set_root(arg)) {
+        fprintf(stderr, "--cgroup_root %s: %s\n", arg, strerror(errno));
+        return -1;
+      }
+    } else if (!strncmp(argv[1], "--journal", 9)) {
+      // Where running children are journaled, and adopted back from when we're started again
+      journal = argv[2]; argc--; argv++;
+    } else if (!strncmp(argv[1], "--subreaper", 11)) {
+      // What our children leave behind is reparented to (and reaped by) us, not init
+      if (pm_set_subreaper(1)) {
+        fprintf(stderr, "--subreaper: %s\n", strerror(errno));
+        return -1;
+      }
+    } else if (!strncmp(argv[1], "--packet", 8)) {
+      // Length header size, has to match the {packet, N} Erlang opened the port with
+      arg = argv[2]; argc--; argv++; char * pEnd;
+      if (ei_set_packet(strtol(arg, &pEnd, 10))) {
+        fprintf(stderr, "--packet takes 2 or 4\n");
+        return -1;
+      }
     }
     argc--; argv++;
   }
   return 0;
 }
 
+void child_changed_status(process_struct *ps);
+void pipeline_finished(process_t *process, process_return_t *ret, void *data);
+void stop_finished(pid_t pid, int status, void *data);
+void child_restarted(pid_t old_pid, pid_t new_pid, int status);
+void child_adopted(pid_t pid, const char *app);
+
+/**
+* Every signal we care about shows up here as an event off of the loop,
+* never from inside a signal handler
+**/
 void erl_d_gotsignal(int signal)
 {
   debug(dbg, 1, "erlang daemon got a signal: %d\n", signal);
-  if (signal == SIGTERM || signal == SIGINT || signal == SIGPIPE)
-    terminated = 1;
+  switch (signal) {
+    case SIGCHLD:
+      pm_check_children(child_changed_status, terminated);
+    break;
+    case SIGTERM:
+    case SIGINT:
+    case SIGPIPE:
+      terminated = 1;
+    break;
+    default:
+    break;
+  }
 }
 
-void setup_erl_daemon_signal_handlers()
+int setup_erl_daemon_signal_handlers()
 {
-  mainact.sa_handler = erl_d_gotsignal;
-  sigemptyset(&mainact.sa_mask);
-  sigaddset(&mainact.sa_mask, SIGCHLD);
-  mainact.sa_flags = 0;
-  sigaction(SIGINT,  &mainact, NULL);
-  sigaction(SIGTERM, &mainact, NULL);
-  sigaction(SIGHUP,  &mainact, NULL);
-  sigaction(SIGPIPE, &mainact, NULL);
+  sigset_t sigset;
+  sigemptyset(&sigset);
+  sigaddset(&sigset, SIGCHLD);
+  sigaddset(&sigset, SIGINT);
+  sigaddset(&sigset, SIGTERM);
+  sigaddset(&sigset, SIGHUP);
+  sigaddset(&sigset, SIGPIPE);
+  return pm_loop_watch_signals(&sigset, erl_d_gotsignal);
 }
 
 int terminate_all()
@@ -98,133 +171,376 @@ int terminate_all()
 }
 
 /**
-* decode_and_run_erlang
+* A request from Erlang, either a single action or a batch of them.
+* Every action gets its own slot in results, and the reply goes out once the
+* last of them is in: the result itself for a single action, or
+* {ok, [Result]} in the order the batch was sent for a batch
+**/
+typedef struct _request_slot_t_ {
+  struct _request_t_ *request;
+  int index;
+} request_slot_t;
+
+typedef struct _request_t_ {
+  int transId;
+  int is_batch;
+  int size;
+  int pending;                // actions still running, plus one held while the request is decoded
+  ei_x_buff *results;
+  request_slot_t *slots;
+  pm_arena_t *arena;          // every process decoded out of the request
+} request_t;
+
+request_t* request_new(int transId, int is_batch, int size)
+{
+  request_t *req = (request_t *) calloc(1, sizeof(request_t));
+  int i;
+  if (req == NULL) return NULL;
+  req->transId = transId;
+  req->is_batch = is_batch;
+  req->size = size;
+  req->pending = 1;
+  req->results = (ei_x_buff *) calloc(size ? size : 1, sizeof(ei_x_buff));
+  req->slots = (request_slot_t *) calloc(size ? size : 1, sizeof(request_slot_t));
+  req->arena = pm_arena_new();
+  if (req->results == NULL || req->slots == NULL || req->arena == NULL) {
+    free(req->results); free(req->slots); pm_arena_free(req->arena); free(req);
+    return NULL;
+  }
+  for (i = 0; i < size; i++) {
+    req->slots[i].request = req;
+    req->slots[i].index = i;
+    ei_x_new(&req->results[i]);
+  }
+  return req;
+}
+
+/**
+* request_done
 * @description
-*   Take a raw buffer and turn it into a process_t object
-*   Run the action specified by the decoding and run the status
-* @params
-*   unsigned char* buf - Buffer
-*   int len - Length of the buffer
-* @return
-*   int status - 0 status means success or -1 for failure
+*   One action (or the decoding) of the request is through, reply once
+*   nothing is left
 **/
-int decode_and_run_erlang(unsigned char *buf, int len)
+void request_done(request_t *req)
 {
-  process_t *process = NULL;
-  process_return_t *ret = NULL;
+  int i;
+  if (--req->pending > 0) return;
+  if (req->is_batch)
+    ei_send_results(write_handle, req->transId, req->results, req->size);
+  else
+    ei_send_result(write_handle, req->transId, &req->results[0]);
+  for (i = 0; i < req->size; i++) ei_x_free(&req->results[i]);
+  // Every process of the request is through, they all go at once
+  pm_arena_free(req->arena);
+  free(req->results);
+  free(req->slots);
+  free(req);
+}
+
+/**
+* run_action
+* @description
+*   Run one decoded action, its result goes into slot index of req.
+*   Runs and execs finish later, off of the loop
+**/
+void run_action(enum BabysitterActionT action, process_t *process, request_t *req, int index)
+{
+  ei_x_buff *result = &req->results[index];
   int err = 0;
-  enum BabysitterActionT action = ei_decode_command_call_into_process((char *)buf, &process);
   
   switch (action) {
     case BS_RUN:
-      ret = pm_run_and_spawn_process(process);
-      ei_return_process_status(write_handle, process->transId, ret);
+    case BS_EXEC:
+      // The pipeline owns the process now, the result comes in when it finishes
+      req->pending++;
+      if (pm_start_pipeline(process, action == BS_RUN, pipeline_finished, &req->slots[index]) < 0) {
+        req->pending--;
+        ei_encode_error(result, "out of memory");
+        break;
+      }
+      process = NULL;
     break;
     case BS_STATUS:
-      ei_pid_status(write_handle, process->transId, process->pid, pm_check_pid_status(process->pid));
+      ei_encode_pid_status(result, "ok", process->pid, pm_check_pid_status(process->pid));
     break;
     case BS_KILL:
-      if ((err = pm_kill_process(process)) < 0) ei_error(write_handle, process->transId, "%d", (int)err);
-      ei_pid_status_term(write_handle, process->transId, process->pid, kill(process->pid, 0));
+      // Replies {ok, Pid, Signal} as soon as the signal is out, the child may well still be
+      // running. Its exit comes later as {0, {exit_status, Pid, Status}}
+      if (pm_kill_process(process) < 0)
+        ei_encode_error(result, strerror(errno));
+      else
+        ei_encode_pid_status(result, "ok", process->pid, process->signal);
     break;
-    case BS_EXEC: {
-      ret = pm_run_process(process);
-      ei_return_process_status(write_handle, process->transId, ret);
-    }
+    case BS_STOP:
+      // The reply waits until the child is gone
+      req->pending++;
+      if ((err = pm_stop_process(process, stop_finished, &req->slots[index])) < 0) {
+        req->pending--;
+        ei_encode_error(result, err == -2 ? "already stopping" : "not running");
+      }
+    break;
+    case BS_LIST:
+      ei_encode_pid_list(result, running_children.pid, pm_children_count(&running_children));
     break;
-    case BS_LIST: {
-      int transId = process->transId;
-      int size = HASH_COUNT(running_children);
-      ei_send_pid_list(write_handle, transId, running_children, size);
+    case BS_STATS: {
+      // Sampled all at once, they go out in the one reply
+      pm_stats_t *stats = (pm_stats_t *) pm_arena_alloc(req->arena, (process->pids_c + 1) * sizeof(pm_stats_t));
+      int i;
+      if (stats == NULL) {
+        ei_encode_error(result, "out of memory");
+        break;
+      }
+      for (i = 0; i < process->pids_c; i++) pm_process_stats(process->pids[i], &stats[i]);
+      pm_stats_count_descendants(stats, process->pids_c);
+      ei_encode_stats(result, stats, process->pids_c);
     }
     break;
     default:
+      ei_encode_error(result, "badarg");
     break;
-  }  
+  }
+  
+  if (process) pm_free_process(process);
+}
+
+/**
+* decode_and_run_erlang
+* @description
+*   Take a raw buffer and turn it into process_t objects
+*   Run the action specified by the decoding, or every action of a
+*   {batch, [Action]} request in order, and reply once they're through
+* @params
+*   unsigned char* buf - Buffer
+*   int len - Length of the buffer
+* @return
+*   int status - 0 status means success or -1 for failure
+**/
+int decode_and_run_erlang(unsigned char *buf, int len)
+{
+  process_t *process = NULL;
+  request_t *req = NULL;
+  enum BabysitterActionT action;
+  long transId = 0;
+  int index = 0, size, i;
   
-  if (ret) pm_free_process_return(ret);
+  if (ei_decode_request_header((char *)buf, &index, &transId) < 0) return -1;
   
-  pm_free_process(process);
+  if ((size = ei_decode_batch_header((char *)buf, &index)) < 0) {
+    if ((req = request_new(transId, 0, 1)) == NULL) return -1;
+    action = ei_decode_action((char *)buf, &index, transId, req->arena, &process);
+    run_action(action, process, req, 0);
+  } else {
+    if ((req = request_new(transId, 1, size)) == NULL) return -1;
+    for (i = 0; i < size; i++) {
+      int start = index;
+      process = NULL;
+      action = ei_decode_action((char *)buf, &index, transId, req->arena, &process);
+      if ((int)action < 0) {
+        // Skip over whatever we couldn't make sense of, the rest still runs
+        index = start;
+        if (ei_skip_term((char *)buf, &index)) {
+          if (process) pm_free_process(process);
+          // Nothing after this can be trusted either
+          for (; i < size; i++) ei_encode_error(&req->results[i], "badarg");
+          break;
+        }
+      }
+      run_action(action, process, req, i);
+    }
+  }
+  
+  // Let go of the hold, replies right away unless a run or exec is still going
+  request_done(req);
   return 0;
 }
 
+/**
+* stop_finished
+* @description
+*   A child a stop request was waiting on has been reaped
+**/
+void stop_finished(pid_t pid, int status, void *data)
+{
+  request_slot_t *slot = (request_slot_t *)data;
+  ei_encode_pid_status(&slot->request->results[slot->index], "exit_status", pid, status);
+  request_done(slot->request);
+}
+
+/**
+* pipeline_finished
+* @description
+*   Called once the before hook, command and after hook of a run or an
+*   exec request are through (or one of them failed)
+**/
+void pipeline_finished(process_t *process, process_return_t *ret, void *data)
+{
+  request_slot_t *slot = (request_slot_t *)data;
+  ei_encode_process_status(&slot->request->results[slot->index], ret);
+  pm_free_process_return(ret);
+  pm_free_process(process);
+  request_done(slot->request);
+}
+
 void child_changed_status(process_struct *ps)
 {
+  // Whatever it wrote goes out before the news that it's gone
+  pm_output_flush_pid(ps->pid);
   // A child was affected (in the following ways)
-  ei_pid_status_term(write_handle, ps->transId, ps->pid, ps->status);
+  // Exits aren't replies to anything, they go out as {0, {exit_status, Pid, Status}}
+  ei_pid_status_term(write_handle, 0, ps->pid, ps->status);
+}
+
+/**
+* child_restarted
+* @description
+*   A supervised child exited with status and came back as new_pid,
+*   goes out as {0, {restarted, OldPid, NewPid, Status}}
+**/
+void child_restarted(pid_t old_pid, pid_t new_pid, int status)
+{
+  pm_output_flush_pid(old_pid);
+  ei_send_restarted(write_handle, old_pid, new_pid, status);
+}
+
+/**
+* child_adopted
+* @description
+*   A daemon before us left pid running, it's ours now. Goes out as
+*   {0, {adopted, Pid, App}}
+**/
+void child_adopted(pid_t pid, const char *app)
+{
+  ei_send_adopted(write_handle, pid, app);
+}
+
+/**
+* Replies queue up while the loop runs and go out together afterwards.
+* While the port can't take them all the loop watches it for writability,
+* and output forwarding is held off until the queue drains
+**/
+static int watching_write_handle = 0;
+static int output_paused = 0;
+
+void erlang_writable(int fd, int events, void *data);
+
+void flush_replies()
+{
+  int queued = ei_reply_flush(write_handle);
+  
+  if (queued < 0) {
+    // Erlang went away
+    terminated = 1;
+    return;
+  }
+  if (queued > 0 && !watching_write_handle) {
+    watching_write_handle = !pm_loop_add(write_handle, PM_LOOP_WRITE, erlang_writable, NULL);
+  } else if (queued == 0 && watching_write_handle) {
+    pm_loop_remove(write_handle);
+    watching_write_handle = 0;
+  }
+  if (output_paused && queued < REPLY_LOW_WATER) {
+    output_paused = 0;
+    pm_output_resume_forwarding();
+  }
+}
+
+void erlang_writable(int fd, int events, void *data)
+{
+  flush_replies();
+}
+
+/**
+* forward_output
+* @description
+*   Sends output of a child with an "erlang" target up the port. Once the
+*   reply queue backs up past REPLY_HIGH_WATER, nothing more is queued and
+*   every stream stops being read until the port drains
+**/
+int forward_output(pid_t pid, int which, const char *buf, int len)
+{
+  if (ei_reply_queued() > REPLY_HIGH_WATER) {
+    output_paused = 1;
+    return -1;
+  }
+  ei_send_output(write_handle, pid, which, buf, len);
+  return 0;
+}
+
+/**
+* erlang_readable
+* @description
+*   Called off of the event loop when Erlang has sent us a command
+**/
+void erlang_readable(int fd, int events, void *data)
+{
+  // Read whatever Erlang has sent us and run every complete command in it
+  static ei_recv_buf_t rb;
+  unsigned char* buf;
+  int len = 0;
+  
+  if ((len = ei_recv_fill(fd, &rb)) <= 0) {
+    if (len < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    // Erlang closed the port, time to go
+    terminated = 1;
+    return;
+  }
+  
+  while ((len = ei_recv_next(&rb, &buf)) > 0) {
+    if (decode_and_run_erlang(buf, len)) {
+      // Something is afoot (failed)
+    } else {
+      // Everything went well
+    }
+  }
 }
 
 int main (int argc, char const *argv[])
 {
-  // Consider making this multi-plexing
-  fd_set rfds, wfds;      // temp file descriptor list for select()
-  int rnum = 0, wnum = 0;
-      
-  if (parse_the_command_line(argc, argv)) return 0;
+  if (parse_the_command_line(argc, argv)) return -1;
   
-  setup_erl_daemon_signal_handlers();
   if (setup()) return -1;
+  if (pm_loop_init()) return -1;
+  if (setup_erl_daemon_signal_handlers()) return -1;
+  if (pm_loop_add(read_handle, PM_LOOP_READ, erlang_readable, NULL)) {
+    perror("pm_loop_add");
+    return -1;
+  }
+  pm_output_set_forwarder(forward_output, coalesce_ms);
+  // Signals are all taken by the loop by now, the workers start out with them blocked
+  if (pm_set_spawn_threads(spawn_threads, child_changed_status)) {
+    perror("pm_set_spawn_threads");
+    return -1;
+  }
+  pm_set_restart_cb(child_restarted);
+  if (journal) {
+    if (pm_journal_open(journal)) {
+      fprintf(stderr, "--journal %s: %s\n", journal, strerror(errno));
+      return -1;
+    }
+    pm_adopt_children(child_adopted, child_changed_status);
+  }
+  // Replies are queued and flushed off of the loop, never block on the port
+  fcntl(write_handle, F_SETFL, fcntl(write_handle, F_GETFL) | O_NONBLOCK);
+  // Nothing may come in for a while, whatever adopting queued goes out now
+  flush_replies();
   
-  // Create the timeout struct
-  struct timeval m_tv;
-  m_tv.tv_usec = 0; 
-  m_tv.tv_sec = 5;
-    
   /* Do stuff */
-  while (!terminated) {    
+  // Nothing wakes us up but Erlang, a signal, output that is due to go out or a timer
+  while (!terminated) {
+    int timeout = pm_output_next_timeout(), next_timer = pm_timer_next_timeout();
+    if (timeout < 0 || (next_timer >= 0 && next_timer < timeout)) timeout = next_timer;
     debug(dbg, 4, "preparing next loop...\n");
-    if (pm_next_loop(child_changed_status) < 0) break;
-    
-    // Erlang fun... pull the next command from the read_fds parameter on the erlang fd
-    pm_set_can_not_jump();
-    
-    // clean socket lists
-		FD_ZERO(&rfds);
-		FD_ZERO(&wfds);
-    
-    FD_SET(read_handle, &rfds);
-    rnum = read_handle;
-    // FD_SET(write_handle, &wfds);
-    wnum = -1;
-    
-    // Block until something happens with select
-    int num_ready_socks = select(
-			(wnum > rnum) ? wnum+1 : rnum+1,
-			(-1 != rnum)  ? &rfds : NULL,
-			(-1 != wnum)  ? &wfds : NULL, // never will write... yet?
-			(fd_set *) 0,
-			&m_tv
-		);
-    debug(dbg, 4, "number of ready sockets from select: %d\n", num_ready_socks);
-    
-    int interrupted = (num_ready_socks < 0 && errno == EINTR);
-    pm_set_can_jump();
-    
-    if (interrupted || num_ready_socks == 0) {
-      if (pm_check_children(child_changed_status, terminated) < 0) continue;
-    } else if (num_ready_socks < 0) {
-      perror("select"); 
-      exit(9);
-    } else if ( FD_ISSET(read_handle, &rfds) ) {
-      // Read from read_handle a command sent by Erlang
-      unsigned char* buf;
-      int len = 0;
-      
-      if ((len = ei_read(read_handle, &buf)) < 0) {
-        terminated = len;
-        break;
-      }
-      
-      if (decode_and_run_erlang(buf, len)) {
-        // Something is afoot (failed)
-      } else {
-        // Everything went well
-      }
-      free(buf);
-    } else {
-      // Something else
-    }
+    if (pm_loop_run_once(timeout) < 0) exit(9);
+    pm_timer_run_due();
+    pm_output_flush_due();
+    flush_replies();
   }
+  // Whatever the workers still have gets its reply too
+  pm_spawner_stop();
+  // Get the last replies out, waiting on the port if we have to
+  fcntl(write_handle, F_SETFL, fcntl(write_handle, F_GETFL) & ~O_NONBLOCK);
+  ei_reply_flush(write_handle);
   terminate_all();
+  pm_loop_close();
   return 0;
 }
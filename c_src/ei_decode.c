@@ -7,29 +7,187 @@
 * @params
 * {Cmd::string(), [Option]}
 *     Option = {env, Strings} | {cd, Dir} | {do_before, Cmd} | {do_after, Cmd} | {nice, int()}
+*            | {stdout, Target} | {stderr, Target}   (Target is described in pm_output.h)
 **/
-const char* babysitter_action_strings[] = {"run", "exec", "list", "status", "kill", NULL};
+const char* babysitter_action_strings[] = {"run", "exec", "list", "status", "kill", "stop", "stats", NULL};
 enum BabysitterActionT ei_decode_command_call_into_process(char *buf, process_t **ptr)
 {
-  int err_code = -1;
-  // Instantiate a new process
-  if (pm_new_process(ptr)) return err_code--;
+  int index = 0;
+  long transId;
   
-  int   arity, index, version, size;
-  int i = 0, tuple_size, type;
-  long  transId;
-    
-  // Reset the index, so that ei functions can decode terms from the 
-  // beginning of the buffer
-  index = 0;
+  *ptr = NULL;
+  if (ei_decode_request_header(buf, &index, &transId) < 0) return -1;
+  return ei_decode_action(buf, &index, transId, NULL, ptr);
+}
 
+/**
+* Decode the {TransId, Request} wrapper every request comes in, leaving
+* index on the Request
+**/
+int ei_decode_request_header(char *buf, int *index, long *transId)
+{
+  int version, arity;
   /* Ensure that we are receiving the binary term by reading and 
    * stripping the version byte */
-  if (ei_decode_version(buf, &index, &version) < 0) return err_code--;
+  if (ei_decode_version(buf, index, &version) < 0) return -1;
   // Decode the tuple header and make sure that the arity is 2
   // as the tuple spec requires it to contain a tuple: {TransId, {Cmd::atom(), Arg1, Arg2, ...}}
-  if (ei_decode_tuple_header(buf, &index, &arity) < 0) return err_code--;; // decode the tuple and capture the arity
-  if (ei_decode_long(buf, &index, &transId) < 0) return err_code--;; // Get the transId
+  if (ei_decode_tuple_header(buf, index, &arity) < 0 || arity != 2) return -1;
+  if (ei_decode_long(buf, index, transId) < 0) return -1; // Get the transId
+  return 0;
+}
+
+/**
+* Check for a {batch, [Op]} request, where every Op is decoded with
+* ei_decode_action in turn
+* @return
+*   int - number of ops (index is left on the first) or -1 if the request
+*   is a single action (index is left alone)
+**/
+int ei_decode_batch_header(char *buf, int *index)
+{
+  int i = *index, arity, type, size;
+  char atom[8];
+  
+  if (ei_decode_tuple_header(buf, &i, &arity) < 0 || arity != 2) return -1;
+  if (ei_get_type(buf, &i, &type, &size) < 0 || size != 5) return -1;
+  if (ei_decode_atom(buf, &i, atom) < 0 || strcmp(atom, "batch")) return -1;
+  if (ei_decode_list_header(buf, &i, &size) < 0) return -1;
+  *index = i;
+  return size;
+}
+
+/**
+* A string (or the list a long one comes in as) at index, owned by process
+**/
+static char* decode_string(char *buf, int *index, process_t *process)
+{
+  int type, size;
+  char *value;
+  if (ei_get_type(buf, index, &type, &size) < 0) return NULL;
+  if ((value = pm_process_alloc(process, size + 1)) == NULL) return NULL;
+  if (ei_decode_string(buf, index, value) < 0) {
+    fprintf(stderr, "ei_decode_string error: %d\n", errno);
+    if (!process->arena) free(value);
+    return NULL;
+  }
+  return value;
+}
+
+/**
+* Decode an options list into process, tail and all
+* @return
+*   int - 0 or -1 if it didn't decode
+**/
+static int decode_options(char *buf, int *index, process_t *process)
+{
+  enum OptionT            { CD,   ENV,   NICE,  DO_BEFORE, DO_AFTER,     STDOUT,    STDERR,   COMMAND,   TIMEOUT,
+                            MEMORY_MAX,   CPU_WEIGHT,   CPU_MAX,   PIDS_MAX,
+                            RESTART,   MAX_RESTARTS,   RESTART_WINDOW,   BACKOFF,   MAX_BACKOFF,   APP } opt;
+  const char* options[] = {"cd", "env", "nice", "do_before", "do_after", "stdout", "stderr", "command", "timeout",
+                           "memory_max", "cpu_weight", "cpu_max", "pids_max",
+                           "restart", "max_restarts", "restart_window", "backoff", "max_backoff", "app", NULL};
+  // In the order of enum RestartPolicyT
+  const char* policies[] = {"temporary", "transient", "permanent", NULL};
+  int i, size, tuple_size;
+  
+  if (ei_decode_list_header(buf, index, &size) < 0) return -1;
+  
+  for (i = 0; i < size; i++) {
+    // Decode the tuple of the form {atom, string()|int()};
+    if (ei_decode_tuple_header(buf, index, &tuple_size) < 0) return -1;
+
+    if ((int)(opt = (enum OptionT)decode_atom_index(buf, index, options)) < 0) return -1;
+
+    switch (opt) {
+      case CD:
+      case DO_BEFORE:
+      case DO_AFTER:
+      case STDOUT:
+      case STDERR:
+      case COMMAND:
+      case CPU_MAX:
+      case APP:
+      case ENV: {
+        char *value, **attr = NULL;
+        if ((value = decode_string(buf, index, process)) == NULL) return -1;
+        
+        if (opt == CD) attr = &process->cd;
+        else if (opt == DO_BEFORE) attr = &process->before;
+        else if (opt == DO_AFTER) attr = &process->after;
+        else if (opt == STDOUT) attr = &process->stdout;
+        else if (opt == STDERR) attr = &process->stderr;
+        else if (opt == COMMAND) attr = &process->command;
+        else if (opt == CPU_MAX) attr = &process->cgroup.cpu_max;
+        else if (opt == APP) attr = &process->app;
+        
+        if (value[0] == '\0' || (opt == ENV && pm_take_env(process, value))) {
+          if (!process->arena) free(value);
+        } else if (attr) {
+          // The last one given wins
+          if (*attr && !process->arena) free(*attr);
+          *attr = value;
+        }
+      }
+      break;
+      case NICE:
+      case TIMEOUT:
+      case MEMORY_MAX:
+      case CPU_WEIGHT:
+      case PIDS_MAX:
+      case MAX_RESTARTS:
+      case RESTART_WINDOW:
+      case BACKOFF:
+      case MAX_BACKOFF: {
+        long lval;
+        if (ei_decode_long(buf, index, &lval) < 0) return -1;
+        if (opt == NICE) process->nice = lval;
+        else if (opt == TIMEOUT) process->timeout = lval;
+        else if (opt == MEMORY_MAX) process->cgroup.memory_max = lval;
+        else if (opt == CPU_WEIGHT) process->cgroup.cpu_weight = lval;
+        else if (opt == PIDS_MAX) process->cgroup.pids_max = lval;
+        else if (opt == MAX_RESTARTS) process->restart.max_restarts = lval;
+        else if (opt == RESTART_WINDOW) process->restart.window_ms = lval;
+        else if (opt == BACKOFF) process->restart.backoff_ms = lval;
+        else process->restart.max_backoff_ms = lval;
+      }
+      break;
+      case RESTART: {
+        int policy;
+        if ((policy = decode_atom_index(buf, index, policies)) < 0) return -1;
+        process->restart.policy = (enum RestartPolicyT)policy;
+      }
+      break;
+      default:
+        return -1;
+      break;
+    }
+  }
+  // A non-empty list ends in a tail, step over it to whatever comes next
+  if (size > 0 && ei_decode_list_header(buf, index, &size) < 0) return -1;
+  return 0;
+}
+
+/**
+* Decode a single {Action, ...} at index into a new process. With an arena
+* the process and everything decoded into it comes out of the arena,
+* otherwise it's all malloced and goes with pm_free_process
+*   {run|exec, Command::string(), Options::list()}
+*   {status|kill, OsPid::integer()} | {kill, OsPid::integer(), Signal::integer()}
+*   {stop, OsPid::integer()} | {stop, OsPid::integer(), Options::list()}
+*   {stats, [OsPid::integer()]}
+*   {list}
+* @return
+*   enum BabysitterActionT - the action, or a negative number if it didn't decode
+**/
+enum BabysitterActionT ei_decode_action(char *buf, int *pindex, long transId, pm_arena_t *arena, process_t **ptr)
+{
+  int err_code = -1;
+  // Instantiate a new process
+  if (pm_new_process_in(arena, ptr)) return err_code--;
+  
+  int   arity, index = *pindex;
+  
   if ((ei_decode_tuple_header(buf, &index, &arity)) < 0) return err_code--;; 
   
   process_t *process = *ptr;
@@ -37,153 +195,346 @@ enum BabysitterActionT ei_decode_command_call_into_process(char *buf, process_t
   
   // Get the outer tuple
   // The first command is an atom
-  // {Cmd::atom(), Command::string(), Options::list()}
-  ei_get_type(buf, &index, &type, &size); 
-  char *action = NULL; if ((action = (char*) calloc(sizeof(char*), size + 1)) == NULL) return err_code--;
-  // Get the command
-  if (ei_decode_atom(buf, &index, action)) return err_code--;
   int ret = -1;
-  if ((int)(ret = (enum BabysitterActionT)string_index(babysitter_action_strings, action)) < 0) return err_code--;
+  if ((ret = decode_atom_index(buf, &index, babysitter_action_strings)) < 0) return err_code--;
   
   switch(ret) {
     case BS_STATUS:
-    case BS_KILL: {
-      ei_get_type(buf, &index, &type, &size);
+    case BS_KILL:
+    case BS_STOP: {
       long lval;
-      ei_decode_long(buf, &index, &lval);
+      if (ei_decode_long(buf, &index, &lval) < 0) return err_code--;
       process->pid = (pid_t)lval;
+      // A kill can come with the signal to send
+      if (ret == BS_KILL && arity == 3) {
+        if (ei_decode_long(buf, &index, &lval) < 0) return err_code--;
+        process->signal = (int)lval;
+      }
+      // A stop can come with the command that stops it and how long to wait on it
+      if (ret == BS_STOP && arity == 3 && decode_options(buf, &index, process)) return err_code--;
+    }
+    break;
+    case BS_STATS: {
+      long lval;
+      int i, size;
+      if (ei_decode_list_header(buf, &index, &size) < 0) return err_code--;
+      if (size > 0 && (process->pids = (pid_t *) pm_process_alloc(process, size * sizeof(pid_t))) == NULL) return err_code--;
+      for (i = 0; i < size; i++) {
+        if (ei_decode_long(buf, &index, &lval) < 0) return err_code--;
+        process->pids[process->pids_c++] = (pid_t)lval;
+      }
+      if (size > 0 && ei_decode_list_header(buf, &index, &size) < 0) return err_code--;
     }
     break;
     case BS_LIST:
     break;
     default:
-      // Get the next string
-      ei_get_type(buf, &index, &type, &size); 
-      char *command = NULL; if ((command = (char*) calloc(sizeof(char*), size + 1)) == NULL) return err_code--;
-
-      // Get the command  
-      if (ei_decode_string(buf, &index, command) < 0) return err_code--;
-      pm_malloc_and_set_attribute(&process->command, command);
-
+      // Get the command
+      if ((process->command = decode_string(buf, &index, process)) == NULL) return err_code--;
       // The second element of the tuple is a list of options
-      if (ei_decode_list_header(buf, &index, &size) < 0) return err_code--;
-
-      enum OptionT            { CD,   ENV,   NICE,  DO_BEFORE, DO_AFTER,     STDOUT,    STDERR } opt;
-      const char* options[] = {"cd", "env", "nice", "do_before", "do_after", "stdout", "stderr", NULL};
-
-      for (i = 0; i < size; i++) {
-        // Decode the tuple of the form {atom, string()|int()};
-        if (ei_decode_tuple_header(buf, &index, &tuple_size) < 0) return err_code--;
-
-        if ((int)(opt = (enum OptionT)decode_atom_index(buf, &index, options)) < 0) return err_code--;
-
-        switch (opt) {
-          case CD:
-          case DO_BEFORE:
-          case DO_AFTER:
-          case STDOUT:
-          case STDERR:
-          case ENV: {
-            int size;
-            ei_get_type(buf, &index, &type, &size); 
-            char *value = NULL;
-            if ((value = (char*) calloc(sizeof(char*), size + 1)) == NULL) return err_code--;
-
-            if (ei_decode_string(buf, &index, value) < 0) {
-              fprintf(stderr, "ei_decode_string error: %d\n", errno);
-              free(value);
-              return err_code--;
-            }
-            
-            if (strlen(value) > 0) {
-              if (opt == CD)
-                pm_malloc_and_set_attribute(&process->cd, value);
-              else if (opt == ENV)
-                pm_add_env(&process, value);
-              else if (opt == DO_BEFORE)
-                pm_malloc_and_set_attribute(&process->before, value);
-              else if (opt == DO_AFTER)
-                pm_malloc_and_set_attribute(&process->after, value);
-              else if (opt == STDOUT)
-                pm_malloc_and_set_attribute(&process->stdout, value);
-              else if (opt == STDERR)
-                pm_malloc_and_set_attribute(&process->stderr, value);
-            }
-            free(value);
-          }
-          break;
-          case NICE: {
-            long lval;
-            ei_decode_long(buf, &index, &lval);
-            process->nice = lval;
-          }
-          break;
-          default:
-            return err_code--;
-          break;
-        }
-      }
+      if (decode_options(buf, &index, process)) return err_code--;
     break;
   }
   *ptr = process;
+  *pindex = index;
   return ret;
 }
 
 /**
-* Basic read off the buffer. Extract the length from the header
+* Receive buffer
+* Commands are read straight into one buffer that lives as long as the
+* daemon does. Every read takes as much as the port has ready and every
+* complete packet in it is handed out in place, so a burst of commands
+* costs a read or two and no mallocs at all
 **/
-int read_cmd(int fd, unsigned char **bufr, int *size)
+
+/**
+* Framing
+* {packet, 2} caps every command and reply at 65535 bytes, {packet, 4}
+* (the daemon's --packet 4) lifts that to EI_PACKET_MAX_SZ. Both ends
+* have to agree, so this is set once before the first read
+**/
+int ei_packet_header_len = 2;
+
+int ei_set_packet(int header_len)
 {
-  unsigned char *buf = *bufr;
+  if (header_len != 2 && header_len != 4) return -1;
+  ei_packet_header_len = header_len;
+  return 0;
+}
+
+/* Largest packet the header can describe */
+static unsigned long packet_max_sz()
+{
+  return ei_packet_header_len == 2 ? 0xffff : EI_PACKET_MAX_SZ;
+}
+
+/**
+* ei_recv_fill
+* @description
+*   One read() off of fd into the free space at the end of rb, making room
+*   first by sliding a partial packet to the front or growing for a big one
+* @return
+*   int - bytes read, 0 when Erlang closed the port or -1 on failure
+**/
+int ei_recv_fill(int fd, ei_recv_buf_t *rb)
+{
+  int n, want;
   
-  int header_len = 2;
-  if ((read_exact(fd, buf, header_len)) != header_len) return -1;
+  if (rb->buf == NULL) {
+    if ((rb->buf = (unsigned char *) malloc(EI_RECV_BUF_SZ)) == NULL) return -1;
+    rb->size = EI_RECV_BUF_SZ;
+    rb->start = rb->end = 0;
+  }
   
-  int len = 0;
-  int i = 0;
-  for(i = 0; i < header_len; i++) len |= buf[i] << (8*(header_len-i-1));
+  // Everything handed out already, start at the front again
+  if (rb->start == rb->end) rb->start = rb->end = 0;
   
-  if (len > *size) {
-    unsigned char* tmp = (unsigned char *) realloc(buf, len);
-    if (tmp == NULL)
-      return -1;
-    else
-      buf = tmp;
-    *size = len;
+  if (rb->end == rb->size) {
+    // A packet that was cut short, slide it down to the front
+    if (rb->start > 0) {
+      memmove(rb->buf, rb->buf + rb->start, rb->end - rb->start);
+      rb->end -= rb->start;
+      rb->start = 0;
+    }
   }
-  int ret = read_exact(fd, buf, len);
-  *bufr = buf;
-  return ret;
-}
-
-int ei_read(int fd, unsigned char** bufr)
-{
-  int size = MAX_BUFFER_SZ;
-  unsigned char *buf;
-  if ((buf = (unsigned char *) malloc(sizeof(unsigned char) * size)) == NULL) {
-    fprintf(stderr, "Could not create an erlang buffer: %s\n", strerror(errno));
+  
+  // Make sure the packet we are in the middle of fits, with room left to read into
+  if ((want = ei_recv_packet_len(rb)) < 0) {
+    errno = EMSGSIZE;
     return -1;
   }
+  if (want < rb->end - rb->start + 1) want = rb->end - rb->start + 1;
+  if (want > rb->size) {
+    if (want < rb->size * 2) want = rb->size * 2;
+    unsigned char *tmp = (unsigned char *) realloc(rb->buf, want);
+    if (tmp == NULL) return -1;
+    rb->buf = tmp;
+    rb->size = want;
+  }
   
-  int ret = read_cmd(fd, &buf, &size);
-  
-  if (ret > 0) *bufr = buf;
-  return ret;
+  while ((n = read(fd, rb->buf + rb->end, rb->size - rb->end)) < 0 && errno == EINTR) ;
+  if (n > 0) rb->end += n;
+  return n;
+}
+
+/**
+* Length of the packet at the front of rb, header included, 0 if we
+* don't even have the header yet or -1 if it's bigger than we take
+**/
+int ei_recv_packet_len(ei_recv_buf_t *rb)
+{
+  unsigned long len = 0;
+  int i;
+  if (rb->end - rb->start < ei_packet_header_len) return 0;
+  for (i = 0; i < ei_packet_header_len; i++) len = (len << 8) | rb->buf[rb->start + i];
+  if (len > packet_max_sz()) return -1;
+  return (int)len + ei_packet_header_len;
+}
+
+/**
+* ei_recv_next
+* @description
+*   Hand out the next complete packet in rb. The packet is only good until
+*   the next ei_recv_fill
+* @params
+*   ei_recv_buf_t* rb - The receive buffer
+*   unsigned char** packet - Points at the packet, inside of rb
+* @return
+*   int - length of the packet or 0 if there isn't a complete one
+**/
+int ei_recv_next(ei_recv_buf_t *rb, unsigned char **packet)
+{
+  int len = ei_recv_packet_len(rb);
+  if (len <= 0 || rb->end - rb->start < len) return 0;
+  *packet = rb->buf + rb->start + ei_packet_header_len;
+  rb->start += len;
+  return len - ei_packet_header_len;
+}
+
+void ei_recv_free(ei_recv_buf_t *rb)
+{
+  if (rb->buf) free(rb->buf);
+  memset(rb, 0, sizeof(ei_recv_buf_t));
 }
 
 /**
 * Data marshalling functions
+* The ei_encode_* functions only encode the body of a reply, so the same
+* body can go out on its own or as one of the results of a batch
 **/
 
-int encode_header(ei_x_buff *result, int transId, int next_tuple_len)
+int encode_reply_header(ei_x_buff *result, int transId)
 {
-  if (ei_x_new_with_version(result)) return -1;
+  if (ei_reply_new(result)) return -1;
   if (ei_x_encode_tuple_header(result, 2)) return -1;
   if (ei_x_encode_long(result, transId)) return -2;
+  return 0;
+}
+
+int encode_header(ei_x_buff *result, int transId, int next_tuple_len)
+{
+  if (encode_reply_header(result, transId)) return -1;
   if (ei_x_encode_tuple_header(result, next_tuple_len)) return -2;
   return 0;
 }
 
+/**
+* {Header::atom(), Pid::integer(), Status::integer()}
+**/
+int ei_encode_pid_status(ei_x_buff *x, const char* header, pid_t pid, int status)
+{
+  if (ei_x_encode_tuple_header(x, 3)) return -1;
+  if (ei_x_encode_atom(x, header)) return -2;
+  if (ei_x_encode_long(x, (int)pid)) return -3;
+  if (ei_x_encode_long(x, (int)status)) return -3;
+  return 0;
+}
+
+/**
+* {ok, [Pid::integer()]}
+**/
+int ei_encode_pid_list(ei_x_buff *x, const pid_t *pids, int size)
+{
+  int i;
+  if (ei_x_encode_tuple_header(x, 2)) return -1;
+  if (ei_x_encode_atom(x, "ok") ) return -2;
+  if (size > 0 && ei_x_encode_list_header(x, size)) return -3;
+  for (i = 0; i < size; i++) ei_x_encode_long(x, pids[i]);
+  if (ei_x_encode_empty_list(x)) return -4;
+  return 0;
+}
+
+/* {Name::atom(), Value::integer()} */
+static int ei_encode_stat(ei_x_buff *x, const char *name, unsigned long long value)
+{
+  if (ei_x_encode_tuple_header(x, 2)) return -1;
+  if (ei_x_encode_atom(x, name)) return -2;
+  if (ei_x_encode_ulonglong(x, value)) return -3;
+  return 0;
+}
+
+/**
+* {ok, [{Pid::integer(), [{rss, Bytes}, {utime, Ms}, {stime, Ms}, {threads, N},
+*   {fds, N}, {read_bytes, Bytes}, {write_bytes, Bytes}, {descendants, N}]} | {Pid::integer(), {error, Reason::string()}}]}
+**/
+int ei_encode_stats(ei_x_buff *x, const pm_stats_t *stats, int size)
+{
+  int i;
+  if (ei_x_encode_tuple_header(x, 2)) return -1;
+  if (ei_x_encode_atom(x, "ok") ) return -2;
+  if (size > 0 && ei_x_encode_list_header(x, size)) return -3;
+  for (i = 0; i < size; i++) {
+    const pm_stats_t *s = &stats[i];
+    if (ei_x_encode_tuple_header(x, 2) || ei_x_encode_long(x, s->pid)) return -3;
+    if (s->err) {
+      if (ei_encode_error(x, strerror(s->err))) return -3;
+      continue;
+    }
+    // What its cgroup leaf used, when it has one
+    if (ei_x_encode_list_header(x, s->limited ? 12 : 8)) return -3;
+    ei_encode_stat(x, "rss", s->rss);
+    ei_encode_stat(x, "utime", s->utime_ms);
+    ei_encode_stat(x, "stime", s->stime_ms);
+    ei_encode_stat(x, "threads", s->threads);
+    ei_encode_stat(x, "fds", s->fds);
+    ei_encode_stat(x, "read_bytes", s->read_bytes);
+    ei_encode_stat(x, "write_bytes", s->write_bytes);
+    ei_encode_stat(x, "descendants", s->descendants);
+    if (s->limited) {
+      ei_encode_stat(x, "memory_current", s->cgroup.memory_current);
+      ei_encode_stat(x, "cpu_usage_usec", s->cgroup.cpu_usage_usec);
+      ei_encode_stat(x, "cpu_user_usec", s->cgroup.cpu_user_usec);
+      ei_encode_stat(x, "cpu_system_usec", s->cgroup.cpu_system_usec);
+    }
+    if (ei_x_encode_empty_list(x)) return -3;
+  }
+  if (ei_x_encode_empty_list(x)) return -4;
+  return 0;
+}
+
+/**
+* {error, Stage::atom(), Pid::integer(), Status::integer(), Error::string()}
+**/
+int ei_encode_process_error_status(ei_x_buff *x, pid_t pid, int status, enum ProcessReturnState state, char* err)
+{
+  if (ei_x_encode_tuple_header(x, 5)) return -1;
+  if (ei_x_encode_atom(x, "error") ) return -4;
+  switch(state) {
+    case PRS_BEFORE:
+      if (ei_x_encode_atom(x, "before_command") ) return -4;
+      break;
+    case PRS_COMMAND:
+      if (ei_x_encode_atom(x, "command") ) return -4;
+      break;
+    case PRS_AFTER:
+      if (ei_x_encode_atom(x, "after_command") ) return -4;
+      break;
+    default:
+      if (ei_x_encode_atom(x, "unknown") ) return -4;
+    break;
+  }
+  // Encode pid
+  if (ei_x_encode_long(x, (int)pid)) return -5;
+  if (ei_x_encode_long(x, (int)status)) return -5;
+  // A stage that just exited non-zero has no error string to go with it
+  if (err == NULL) err = "";
+  if (ei_x_encode_string_len(x, err, strlen(err))) return -6;
+  return 0;
+}
+
+int ei_encode_process_status(ei_x_buff *x, process_return_t *p)
+{
+  if(p->stage == PRS_OKAY)
+    return ei_encode_pid_status(x, "ok", p->pid, p->exit_status);
+  else
+    return ei_encode_process_error_status(x, p->pid, p->exit_status, p->stage, p->stderr);
+}
+
+/**
+* {error, Reason::string()}
+**/
+int ei_encode_error(ei_x_buff *x, const char *reason)
+{
+  if (ei_x_encode_tuple_header(x, 2)) return -1;
+  if (ei_x_encode_atom(x, "error")) return -2;
+  if (ei_x_encode_string(x, reason)) return -3;
+  return 0;
+}
+
+/**
+* Send the results of a batch, each encoded on its own
+* {transId, {ok, [Result]}}
+**/
+int ei_send_results(int fd, int transId, ei_x_buff *results, int size)
+{
+  ei_x_buff result;
+  int i;
+  if (encode_header(&result, transId, 2)) return -1;
+  if (ei_x_encode_atom(&result, "ok")) return -2;
+  if (ei_x_encode_list_header(&result, size)) return -3;
+  for (i = 0; i < size; i++)
+    if (ei_x_append_buf(&result, results[i].buff, results[i].index)) return -4;
+  if (ei_x_encode_empty_list(&result)) return -4;
+  if (write_cmd(fd, &result) < 0) return -5;
+  ei_x_free(&result);
+  return 0;
+}
+
+/**
+* Send one body that was encoded on its own
+* {transId, Body}
+**/
+int ei_send_result(int fd, int transId, ei_x_buff *body)
+{
+  ei_x_buff result;
+  if (encode_reply_header(&result, transId)) return -1;
+  if (ei_x_append_buf(&result, body->buff, body->index)) return -2;
+  if (write_cmd(fd, &result) < 0) return -5;
+  ei_x_free(&result);
+  return 0;
+}
+
 /**
 * ei_write_atom
 * @params
@@ -229,15 +580,11 @@ int ei_pid_ok(int fd, int transId, pid_t pid)
 * Send a list of pids
 * {transId, [Pid::integer()]}
 **/
-int ei_send_pid_list(int fd, int transId, process_struct *hd, int size)
+int ei_send_pid_list(int fd, int transId, const pid_t *pids, int size)
 {
   ei_x_buff result;
-  process_struct *ps;
-  if (encode_header(&result, transId, 2)) return -1;
-  if (ei_x_encode_atom(&result, "ok") ) return -2;
-  if (ei_x_encode_list_header(&result, size)) return -3;
-  for( ps = hd; ps != NULL; ps = ps->hh.next ) ei_x_encode_long(&result, ps->pid);
-  if (ei_x_encode_empty_list(&result)) return -4;
+  if (encode_reply_header(&result, transId)) return -1;
+  if (ei_encode_pid_list(&result, pids, size)) return -2;
   if (write_cmd(fd, &result) < 0) return -5;
   ei_x_free(&result);
   return 0;
@@ -246,11 +593,8 @@ int ei_send_pid_list(int fd, int transId, process_struct *hd, int size)
 int ei_pid_status_header(int fd, int transId, pid_t pid, int status, const char* header)
 {
   ei_x_buff result;
-  if (encode_header(&result, transId, 3)) return -1;
-  if (ei_x_encode_atom(&result, header) ) return -4;
-  // Encode pid
-  if (ei_x_encode_long(&result, (int)pid)) return -5;
-  if (ei_x_encode_long(&result, (int)status)) return -5;
+  if (encode_reply_header(&result, transId)) return -1;
+  if (ei_encode_pid_status(&result, header, pid, status)) return -4;
   if (write_cmd(fd, &result) < 0) {
     return -5;
   }
@@ -269,26 +613,8 @@ int ei_pid_status(int fd, int transId, pid_t pid, int status)
 int ei_process_error_status(int fd, int transId, pid_t pid, int status, enum ProcessReturnState state, char* err)
 {
   ei_x_buff result;
-  if (encode_header(&result, transId, 5)) return -1;
-  if (ei_x_encode_atom(&result, "error") ) return -4;
-  switch(state) {
-    case PRS_BEFORE:
-      if (ei_x_encode_atom(&result, "before_command") ) return -4;
-      break;
-    case PRS_COMMAND:
-      if (ei_x_encode_atom(&result, "command") ) return -4;
-      break;
-    case PRS_AFTER:
-      if (ei_x_encode_atom(&result, "after_command") ) return -4;
-      break;
-    default:
-      if (ei_x_encode_atom(&result, "unknown") ) return -4;
-    break;
-  }
-  // Encode pid
-  if (ei_x_encode_long(&result, (int)pid)) return -5;
-  if (ei_x_encode_long(&result, (int)status)) return -5;
-  if (ei_x_encode_string_len(&result, err, strlen(err))) return -6;
+  if (encode_reply_header(&result, transId)) return -1;
+  if (ei_encode_process_error_status(&result, pid, status, state, err)) return -4;
   if (write_cmd(fd, &result) < 0) {
     return -5;
   }
@@ -305,11 +631,60 @@ int ei_return_process_status(int fd, int transId, process_return_t *p)
     return ei_process_error_status(fd, transId, p->pid, p->exit_status, p->stage, p->stderr);
 }
 
+/**
+* Forward output of a child
+* {0, {stdout|stderr, Pid::integer(), Output::binary()}}
+**/
+int ei_send_output(int fd, pid_t pid, int which, const char *buf, int len)
+{
+  ei_x_buff result;
+  if (encode_header(&result, 0, 3)) return -1;
+  if (ei_x_encode_atom(&result, which == 2 ? "stderr" : "stdout")) return -2;
+  if (ei_x_encode_long(&result, (int)pid)) return -3;
+  if (ei_x_encode_binary(&result, buf, len)) return -4;
+  if (write_cmd(fd, &result) < 0) return -5;
+  ei_x_free(&result);
+  return 0;
+}
+
 int ei_pid_status_term(int fd, int transId, pid_t pid, int status)
 {
   return ei_pid_status_header(fd, transId, pid, status, "exit_status");
 }
 
+/**
+* {0, {restarted, OldPid::integer(), NewPid::integer(), Status::integer()}}
+**/
+int ei_send_restarted(int fd, pid_t old_pid, pid_t new_pid, int status)
+{
+  ei_x_buff result;
+  if (encode_reply_header(&result, 0)) return -1;
+  if (ei_x_encode_tuple_header(&result, 4)) return -2;
+  if (ei_x_encode_atom(&result, "restarted")) return -3;
+  if (ei_x_encode_long(&result, (int)old_pid)) return -3;
+  if (ei_x_encode_long(&result, (int)new_pid)) return -3;
+  if (ei_x_encode_long(&result, status)) return -3;
+  if (write_cmd(fd, &result) < 0) return -5;
+  ei_x_free(&result);
+  return 0;
+}
+
+/**
+* {0, {adopted, Pid::integer(), App::string()}}
+**/
+int ei_send_adopted(int fd, pid_t pid, const char *app)
+{
+  ei_x_buff result;
+  if (encode_reply_header(&result, 0)) return -1;
+  if (ei_x_encode_tuple_header(&result, 3)) return -2;
+  if (ei_x_encode_atom(&result, "adopted")) return -3;
+  if (ei_x_encode_long(&result, (int)pid)) return -3;
+  if (ei_x_encode_string(&result, app ? app : "")) return -3;
+  if (write_cmd(fd, &result) < 0) return -5;
+  ei_x_free(&result);
+  return 0;
+}
+
 int ei_ok(int fd, int transId, const char* fmt, ...)
 {  
   va_list *vargs = NULL;
@@ -322,30 +697,162 @@ int ei_error(int fd, int transId, const char* fmt, ...){
 
 int decode_atom_index(char* buf, int *index, const char* cmds[])
 {
-  int type, size;
-  ei_get_type(buf, index, &type, &size); 
-  char *atom_name = NULL;
-  if ((atom_name = (char*) calloc(sizeof(char), size)) == NULL) return -1;
-  
+  char atom_name[MAXATOMLEN];
   if (ei_decode_atom(buf, index, atom_name)) return -1;
-  
-  int ret = string_index(cmds, atom_name);
-  free(atom_name);
-  return ret;
+  return string_index(cmds, atom_name);
+}
+
+/**
+* Outbound replies
+* write_cmd only queues a reply, taking over its ei_x_buff. The queue goes
+* out in as few writev calls as the port will take whenever the loop
+* calls ei_reply_flush, and the buffers are kept around for the next replies
+**/
+typedef struct _ei_reply_t_ {
+  ei_x_buff     x;
+  unsigned char header[EI_PACKET_HEADER_MAX];
+} ei_reply_t;
+
+static ei_reply_t*  replies = NULL;
+static int          replies_capacity = 0;
+static int          replies_head = 0;       // First reply that hasn't fully gone out
+static int          replies_tail = 0;       // One past the last queued reply
+static int          replies_head_offset = 0;// Bytes of the first reply already written
+static int          replies_bytes = 0;      // Bytes waiting to go out
+static ei_x_buff    reply_pool[EI_REPLY_POOL_SZ];
+static int          reply_pool_count = 0;
+
+/**
+* Start a new reply, on a buffer that a sent reply left behind if there is one
+**/
+int ei_reply_new(ei_x_buff *x)
+{
+  if (reply_pool_count == 0) return ei_x_new_with_version(x);
+  *x = reply_pool[--reply_pool_count];
+  x->index = 0;
+  return ei_x_encode_version(x);
+}
+
+static void reply_recycle(ei_x_buff *x)
+{
+  // Hang on to a few buffers of a sane size, let the rest go
+  if (reply_pool_count < EI_REPLY_POOL_SZ && x->buffsz <= MAX_BUFFER_SZ)
+    reply_pool[reply_pool_count++] = *x;
+  else
+    ei_x_free(x);
+}
+
+static int reply_len(ei_reply_t *r)
+{
+  return ei_packet_header_len + r->x.index;
 }
 
 /**
-* Data i/o
+* write_cmd
+* @description
+*   Queue buff up to go out to Erlang on the next ei_reply_flush. The queue
+*   takes the buffer over, buff is left empty (ei_x_free on it is a no-op)
+* @return
+*   int - length of the reply or -1 on failure. A reply too big for the
+*   packet header goes out as {TransId, {error, Reason}} instead
 **/
 int write_cmd(int fd, ei_x_buff *buff)
 {
-  unsigned char li;
+  ei_reply_t *r;
+  int i, len = buff->index;
+  
+  if ((unsigned long)len > packet_max_sz()) {
+    // Rather than send it with a truncated length, tell the caller it didn't fit
+    long transId = 0;
+    int index = 0, version, arity;
+    ei_decode_version(buff->buff, &index, &version);
+    ei_decode_tuple_header(buff->buff, &index, &arity);
+    ei_decode_long(buff->buff, &index, &transId);
+    ei_x_free(buff);
+    if (transId != 0 && encode_reply_header(buff, transId) == 0 &&
+        ei_encode_error(buff, "reply too big for the packet size, use --packet 4") == 0)
+      return write_cmd(fd, buff);
+    errno = EMSGSIZE;
+    return -1;
+  }
+  
+  if (replies_tail == replies_capacity) {
+    if (replies_head > 0) {
+      // Slide what's left down to the front before growing
+      memmove(replies, replies + replies_head, (replies_tail - replies_head) * sizeof(ei_reply_t));
+      replies_tail -= replies_head;
+      replies_head = 0;
+    } else {
+      int new_capacity = replies_capacity ? replies_capacity * 2 : 64;
+      ei_reply_t *tmp = (ei_reply_t *) realloc(replies, new_capacity * sizeof(ei_reply_t));
+      if (tmp == NULL) return -1;
+      replies = tmp;
+      replies_capacity = new_capacity;
+    }
+  }
+  
+  r = &replies[replies_tail++];
+  r->x = *buff;
+  for (i = 0; i < ei_packet_header_len; i++)
+    r->header[i] = (len >> (8 * (ei_packet_header_len - i - 1))) & 0xff;
+  replies_bytes += reply_len(r);
+  
+  buff->buff = NULL;
+  buff->buffsz = buff->index = 0;
+  return len;
+}
+
+/**
+* ei_reply_flush
+* @description
+*   Write out as much of the queue as fd takes, a batch of replies per writev
+* @return
+*   int - bytes still queued (fd would have blocked) or -1 if the port is gone
+**/
+int ei_reply_flush(int fd)
+{
+  struct iovec iov[EI_REPLY_IOV_MAX];
+  int i, n, k, off;
+  ssize_t wrote;
+  
+  while (replies_head < replies_tail) {
+    for (n = 0, i = replies_head; i < replies_tail && n + 2 <= EI_REPLY_IOV_MAX; i++) {
+      iov[n].iov_base = replies[i].header;
+      iov[n++].iov_len = ei_packet_header_len;
+      iov[n].iov_base = replies[i].x.buff;
+      iov[n++].iov_len = replies[i].x.index;
+    }
+    // Skip what already went out of the first reply
+    for (k = 0, off = replies_head_offset; off > 0 && off >= (int)iov[k].iov_len; k++) off -= iov[k].iov_len;
+    iov[k].iov_base = (char *)iov[k].iov_base + off;
+    iov[k].iov_len -= off;
+    
+    if ((wrote = writev(fd, iov + k, n - k)) < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return replies_bytes;
+      return -1;
+    }
+    replies_bytes -= wrote;
+    
+    // Retire every reply that made it out entirely
+    wrote += replies_head_offset;
+    while (replies_head < replies_tail && wrote >= reply_len(&replies[replies_head])) {
+      wrote -= reply_len(&replies[replies_head]);
+      reply_recycle(&replies[replies_head].x);
+      replies_head++;
+    }
+    replies_head_offset = wrote;
+  }
+  replies_head = replies_tail = replies_head_offset = 0;
+  return 0;
+}
 
-  li = (buff->index >> 8) & 0xff;
-  write_exact(fd, &li, 1);
-  li = buff->index & 0xff;
-  write_exact(fd, &li, 1);
-  return write_exact(fd, (unsigned char*)buff->buff, buff->index);
+/**
+* How many bytes of replies are waiting on the port
+**/
+int ei_reply_queued()
+{
+  return replies_bytes;
 }
 
 int read_exact(int fd, unsigned char *buf, int len)
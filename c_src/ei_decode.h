@@ -7,30 +7,81 @@
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <sys/uio.h>
 
 #include "process_manager.h"
 #include "pm_helpers.h"
 
 // Defines
+/* Length header in front of every packet, 2 ({packet, 2}) unless set with ei_set_packet */
+#define EI_PACKET_HEADER_MAX  4
+#ifndef EI_PACKET_MAX_SZ
+#define EI_PACKET_MAX_SZ      (64 * 1024 * 1024)
+#endif
+#ifndef EI_RECV_BUF_SZ
+#define EI_RECV_BUF_SZ        (2 * MAX_BUFFER_SZ)
+#endif
+
+/* Sent reply buffers kept around for reuse */
+#ifndef EI_REPLY_POOL_SZ
+#define EI_REPLY_POOL_SZ      64
+#endif
+/* Replies handed to a single writev, two iovecs apiece */
+#ifndef EI_REPLY_IOV_MAX
+#define EI_REPLY_IOV_MAX      256
+#endif
+
+/* Types */
+typedef struct _ei_recv_buf_t_ {
+  unsigned char*  buf;
+  int             size;     // Capacity of buf
+  int             start;    // First byte that hasn't been handed out
+  int             end;      // One past the last byte read
+} ei_recv_buf_t;
+
+extern int ei_packet_header_len;
 
 // Ei
-enum BabysitterActionT {BS_RUN,BS_EXEC,BS_LIST,BS_STATUS,BS_KILL};
+int ei_set_packet(int header_len);
+enum BabysitterActionT {BS_RUN,BS_EXEC,BS_LIST,BS_STATUS,BS_KILL,BS_STOP,BS_STATS};
 enum BabysitterActionT ei_decode_command_call_into_process(char *buf, process_t **ptr);
+int ei_decode_request_header(char *buf, int *index, long *transId);
+int ei_decode_batch_header(char *buf, int *index);
+enum BabysitterActionT ei_decode_action(char *buf, int *index, long transId, pm_arena_t *arena, process_t **ptr);
 int decode_atom_index(char* buf, int *index, const char* cmds[]);
 
+// Ei reply bodies
+int ei_encode_pid_status(ei_x_buff *x, const char* header, pid_t pid, int status);
+int ei_encode_pid_list(ei_x_buff *x, const pid_t *pids, int size);
+int ei_encode_stats(ei_x_buff *x, const pm_stats_t *stats, int size);
+int ei_encode_process_error_status(ei_x_buff *x, pid_t pid, int status, enum ProcessReturnState state, char* err);
+int ei_encode_process_status(ei_x_buff *x, process_return_t *p);
+int ei_encode_error(ei_x_buff *x, const char *reason);
+
 // Ei responses
+int ei_send_result(int fd, int transId, ei_x_buff *body);
+int ei_send_results(int fd, int transId, ei_x_buff *results, int size);
 int ei_pid_ok(int fd, int transId, pid_t pid);
 int ei_pid_status_term(int fd, int transId, pid_t pid, int status);
-int ei_send_pid_list(int fd, int transId, process_struct *hd, int size);
+int ei_send_restarted(int fd, pid_t old_pid, pid_t new_pid, int status);
+int ei_send_adopted(int fd, pid_t pid, const char *app);
+int ei_send_pid_list(int fd, int transId, const pid_t *pids, int size);
 int ei_pid_status(int fd, int transId, pid_t pid, int status);
 int ei_return_process_status(int fd, int transId, process_return_t *p);
 int ei_process_status(int fd, int transId, pid_t pid, int status, enum ProcessReturnState state);
+int ei_send_output(int fd, pid_t pid, int which, const char *buf, int len);
 // Responses
 int ei_error(int fd, int transId, const char* fmt, ...);
 int ei_ok(int fd, int transId, const char* fmt, ...);
 
-int ei_read(int fd, unsigned char** bufr);
+int ei_recv_fill(int fd, ei_recv_buf_t *rb);
+int ei_recv_packet_len(ei_recv_buf_t *rb);
+int ei_recv_next(ei_recv_buf_t *rb, unsigned char **packet);
+void ei_recv_free(ei_recv_buf_t *rb);
 int write_cmd(int fd, ei_x_buff *buff);
+int ei_reply_new(ei_x_buff *x);
+int ei_reply_flush(int fd);
+int ei_reply_queued();
 int read_exact(int fd, unsigned char *buf, int len);
 int write_exact(int fd, unsigned char *buf, int len);
 
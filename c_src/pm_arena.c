@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pm_arena.h"
+
+/* Arenas that have been let go of, all reset */
+static pm_arena_t*  pool = NULL;
+static int          pool_size = 0;
+
+#define ALIGN_UP(n) (((n) + PM_ARENA_ALIGN - 1) & ~((size_t)PM_ARENA_ALIGN - 1))
+/* The first block shares its malloc with the arena itself */
+#define FIRST_BLOCK(a) ((char *)(a) + ALIGN_UP(sizeof(pm_arena_t)))
+
+/**
+* pm_arena_new
+* @description
+*   An empty arena, off of the pool if there is one waiting
+* @return
+*   pm_arena_t* - the arena or NULL when out of memory
+**/
+pm_arena_t* pm_arena_new()
+{
+  pm_arena_t *arena;
+  if ((arena = pool) != NULL) {
+    pool = arena->next;
+    pool_size--;
+  } else {
+    if ((arena = (pm_arena_t *) malloc(ALIGN_UP(sizeof(pm_arena_t)) + PM_ARENA_BLOCK_SZ)) == NULL) return NULL;
+    arena->blocks = NULL;
+    pm_arena_reset(arena);
+  }
+  arena->next = NULL;
+  return arena;
+}
+
+/**
+* pm_arena_alloc
+* @description
+*   size bytes that live until the arena is reset or freed. Anything that
+*   doesn't fit what's left of the current block gets a block of its own
+* @return
+*   void* - the memory or NULL when out of memory
+**/
+void* pm_arena_alloc(pm_arena_t *arena, size_t size)
+{
+  void *ptr;
+  size = ALIGN_UP(size ? size : 1);
+
+  if (size > (size_t)(arena->end - arena->cur)) {
+    size_t block_sz = size > PM_ARENA_BLOCK_SZ ? size : PM_ARENA_BLOCK_SZ;
+    pm_arena_block_t *block = (pm_arena_block_t *) malloc(ALIGN_UP(sizeof(pm_arena_block_t)) + block_sz);
+    if (block == NULL) return NULL;
+    block->size = block_sz;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    ptr = (char *)block + ALIGN_UP(sizeof(pm_arena_block_t));
+    // A big one-off leaves the block we were filling as it is
+    if (block_sz == size) return ptr;
+    arena->cur = (char *)ptr;
+    arena->end = arena->cur + block_sz;
+  }
+  ptr = arena->cur;
+  arena->cur += size;
+  return ptr;
+}
+
+void* pm_arena_calloc(pm_arena_t *arena, size_t size)
+{
+  void *ptr;
+  if ((ptr = pm_arena_alloc(arena, size)) != NULL) memset(ptr, 0, size);
+  return ptr;
+}
+
+char* pm_arena_strdup(pm_arena_t *arena, const char *str)
+{
+  size_t len = strlen(str);
+  char *copy;
+  if ((copy = (char *) pm_arena_alloc(arena, len + 1)) == NULL) return NULL;
+  memcpy(copy, str, len + 1);
+  return copy;
+}
+
+/**
+* pm_arena_reset
+* @description
+*   Give back everything allocated out of arena, only the first block
+*   stays with it
+**/
+void pm_arena_reset(pm_arena_t *arena)
+{
+  pm_arena_block_t *block, *next;
+  for (block = arena->blocks; block != NULL; block = next) {
+    next = block->next;
+    free(block);
+  }
+  arena->blocks = NULL;
+  arena->cur = FIRST_BLOCK(arena);
+  arena->end = arena->cur + PM_ARENA_BLOCK_SZ;
+}
+
+/**
+* pm_arena_free
+* @description
+*   Done with arena and everything in it, it goes back on the pool unless
+*   the pool is full
+**/
+void pm_arena_free(pm_arena_t *arena)
+{
+  if (arena == NULL) return;
+  pm_arena_reset(arena);
+  if (pool_size >= PM_ARENA_POOL_SZ) {
+    free(arena);
+    return;
+  }
+  arena->next = pool;
+  pool = arena;
+  pool_size++;
+}
+
+int pm_arena_pooled()
+{
+  return pool_size;
+}
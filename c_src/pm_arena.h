@@ -0,0 +1,45 @@
+#ifndef PM_ARENA_H
+#define PM_ARENA_H
+
+#include <stddef.h>
+
+/**
+* Request arenas
+* Everything decoded out of a request (the processes, their strings and
+* env vectors) is bump allocated out of the request's arena and all of it
+* goes at once when the reply is out. Arenas are kept around after that,
+* so a steady stream of requests runs out of memory it already has
+**/
+
+#ifndef PM_ARENA_BLOCK_SZ
+#define PM_ARENA_BLOCK_SZ     4096
+#endif
+/* Arenas kept around for the next requests */
+#ifndef PM_ARENA_POOL_SZ
+#define PM_ARENA_POOL_SZ      16
+#endif
+#define PM_ARENA_ALIGN        16
+
+/* Types */
+typedef struct _pm_arena_block_t_ {
+  struct _pm_arena_block_t_ *next;
+  size_t size;
+} pm_arena_block_t;
+
+typedef struct _pm_arena_t_ {
+  char*               cur;        // Next free byte
+  char*               end;        // One past the last byte of the current block
+  pm_arena_block_t*   blocks;     // Blocks on top of the first one, newest first
+  struct _pm_arena_t_ *next;      // Pool link
+} pm_arena_t;
+
+/* External exports */
+pm_arena_t* pm_arena_new();
+void* pm_arena_alloc(pm_arena_t *arena, size_t size);
+void* pm_arena_calloc(pm_arena_t *arena, size_t size);
+char* pm_arena_strdup(pm_arena_t *arena, const char *str);
+void pm_arena_reset(pm_arena_t *arena);
+void pm_arena_free(pm_arena_t *arena);
+int pm_arena_pooled();
+
+#endif
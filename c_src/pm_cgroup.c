@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "pm_cgroup.h"
+
+static int root_fd = -1;      // The delegated root, opened once
+
+static int write_file(int dir_fd, const char *name, const char *value)
+{
+  int fd, err = 0;
+  size_t len = strlen(value);
+  if ((fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) return -1;
+  if (write(fd, value, len) != (ssize_t)len) err = errno ? errno : EIO;
+  close(fd);
+  if (err) errno = err;
+  return err ? -1 : 0;
+}
+
+/* The first size - 1 bytes of a file, relative to the root */
+static int read_file(const char *path, char *buf, size_t size)
+{
+  int fd;
+  ssize_t len;
+  if ((fd = openat(root_fd, path, O_RDONLY | O_CLOEXEC)) < 0) return -1;
+  len = read(fd, buf, size - 1);
+  close(fd);
+  if (len < 0) return -1;
+  buf[len] = '\0';
+  return 0;
+}
+
+/**
+* pm_cgroup_set_root
+* @description
+*   Put the leaves under path from here on, and hand the memory, cpu and
+*   pids controllers down to them. A controller the root wasn't given
+*   is skipped, only the limits that need it fail. NULL goes back to no
+*   cgroups at all
+* @return
+*   int - 0, or -1 with errno set if path can't be opened
+**/
+int pm_cgroup_set_root(const char *path)
+{
+  const char* controllers[] = {"+memory", "+cpu", "+pids", NULL};
+  int fd, i;
+
+  if (path == NULL) {
+    if (root_fd >= 0) close(root_fd);
+    root_fd = -1;
+    return 0;
+  }
+  if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) return -1;
+  if (root_fd >= 0) close(root_fd);
+  root_fd = fd;
+  for (i = 0; controllers[i]; i++) write_file(root_fd, "cgroup.subtree_control", controllers[i]);
+  return 0;
+}
+
+int pm_cgroup_enabled()
+{
+  return root_fd >= 0;
+}
+
+int pm_cgroup_wanted(const pm_cgroup_limits_t *limits)
+{
+  return limits != NULL &&
+    (limits->memory_max > 0 || limits->cpu_weight > 0 || limits->cpu_max != NULL || limits->pids_max > 0);
+}
+
+static int write_limits(int leaf_fd, const pm_cgroup_limits_t *limits)
+{
+  char value[32];
+  if (limits->memory_max > 0) {
+    snprintf(value, sizeof(value), "%ld", limits->memory_max);
+    if (write_file(leaf_fd, "memory.max", value)) return -1;
+  }
+  if (limits->cpu_weight > 0) {
+    snprintf(value, sizeof(value), "%d", limits->cpu_weight);
+    if (write_file(leaf_fd, "cpu.weight", value)) return -1;
+  }
+  if (limits->cpu_max != NULL && write_file(leaf_fd, "cpu.max", limits->cpu_max)) return -1;
+  if (limits->pids_max > 0) {
+    snprintf(value, sizeof(value), "%ld", limits->pids_max);
+    if (write_file(leaf_fd, "pids.max", value)) return -1;
+  }
+  return 0;
+}
+
+/**
+* pm_cgroup_place
+* @description
+*   Make the leaf of pid, write its limits and move pid into it. Safe to
+*   call from a spawn worker, nothing here is shared but the root fd.
+*   A pid that's already gone has nothing left to limit and is let be
+* @return
+*   int - 0 on success, -1 with errno set otherwise (the leaf is gone
+*   again). A leftover leaf that can't be removed (EBUSY, something
+*   still lives in it) fails rather than being shared
+**/
+int pm_cgroup_place(pid_t pid, const pm_cgroup_limits_t *limits)
+{
+  char leaf[32], value[32];
+  int leaf_fd, err = 0;
+
+  if (root_fd < 0) {
+    errno = ENOTSUP;
+    return -1;
+  }
+  snprintf(leaf, sizeof(leaf), PM_CGROUP_LEAF_FMT, pid);
+  // Left behind by an earlier pid with the same number, start over if it's empty. One
+  // something still lives in isn't ours to share
+  if (mkdirat(root_fd, leaf, 0755) < 0) {
+    if (errno != EEXIST) return -1;
+    if (unlinkat(root_fd, leaf, AT_REMOVEDIR) < 0 || mkdirat(root_fd, leaf, 0755) < 0) return -1;
+  }
+  if ((leaf_fd = openat(root_fd, leaf, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    err = errno;
+  } else {
+    snprintf(value, sizeof(value), "%d", pid);
+    if (write_limits(leaf_fd, limits) || (write_file(leaf_fd, "cgroup.procs", value) && errno != ESRCH)) err = errno;
+    close(leaf_fd);
+  }
+  if (err) {
+    unlinkat(root_fd, leaf, AT_REMOVEDIR);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+/* The value of key in a flat keyed file like cpu.stat */
+static unsigned long long keyed_value(const char *buf, const char *key)
+{
+  size_t len = strlen(key);
+  const char *line = buf;
+  while (line != NULL) {
+    if (!strncmp(line, key, len) && line[len] == ' ') return strtoull(line + len + 1, NULL, 10);
+    if ((line = strchr(line, '\n')) != NULL) line++;
+  }
+  return 0;
+}
+
+/**
+* pm_cgroup_usage
+* @description
+*   What the leaf of pid has used so far, read straight out of
+*   memory.current and cpu.stat
+* @return
+*   int - 0, or -1 when pid has no leaf
+**/
+int pm_cgroup_usage(pid_t pid, pm_cgroup_usage_t *usage)
+{
+  char path[64], buf[512];
+  int len;
+
+  memset(usage, 0, sizeof(pm_cgroup_usage_t));
+  if (root_fd < 0) {
+    errno = ENOTSUP;
+    return -1;
+  }
+  len = snprintf(path, sizeof(path), PM_CGROUP_LEAF_FMT "/", pid);
+  strcpy(path + len, "cpu.stat");
+  if (read_file(path, buf, sizeof(buf))) return -1;
+  usage->cpu_usage_usec = keyed_value(buf, "usage_usec");
+  usage->cpu_user_usec = keyed_value(buf, "user_usec");
+  usage->cpu_system_usec = keyed_value(buf, "system_usec");
+  strcpy(path + len, "memory.current");
+  if (read_file(path, buf, sizeof(buf)) == 0) usage->memory_current = strtoull(buf, NULL, 10);
+  return 0;
+}
+
+/**
+* pm_cgroup_release
+* @description
+*   pid was reaped, remove its leaf. A leaf something of pid's still
+*   lives in stays behind until it's reused
+* @return
+*   int - 0 if the leaf is gone (or there never was one), -1 otherwise
+**/
+int pm_cgroup_release(pid_t pid)
+{
+  char leaf[32];
+  if (root_fd < 0) return 0;
+  snprintf(leaf, sizeof(leaf), PM_CGROUP_LEAF_FMT, pid);
+  if (unlinkat(root_fd, leaf, AT_REMOVEDIR) < 0 && errno != ENOENT) return -1;
+  return 0;
+}
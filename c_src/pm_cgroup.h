@@ -0,0 +1,43 @@
+#ifndef PM_CGROUP_H
+#define PM_CGROUP_H
+
+#include <sys/types.h>
+
+/**
+* cgroup v2 limits
+* With a delegated root (the daemon's --cgroup_root) every command that
+* asks for a limit runs in a leaf of its own, <root>/bs-<pid>. The leaf
+* is made and its limits written right after the fork, while the child
+* waits on a pipe before it execs, so nothing of the command ever runs
+* outside of it. Limited commands are always forked for that, never
+* posix_spawn'd. The leaf is removed once the child has been reaped. The
+* daemon itself must not live in the root, cgroup v2 only lets leaves
+* hold processes once the root hands controllers down
+**/
+
+#define PM_CGROUP_LEAF_FMT    "bs-%d"
+
+/* Types */
+typedef struct _pm_cgroup_limits_t_ {
+  long    memory_max;     // bytes, memory.max
+  int     cpu_weight;     // 1-10000, cpu.weight
+  char*   cpu_max;        // "$MAX $PERIOD", cpu.max
+  long    pids_max;       // pids.max
+} pm_cgroup_limits_t;     // 0 (or NULL) leaves a limit alone
+
+typedef struct _pm_cgroup_usage_t_ {
+  unsigned long long memory_current;    // bytes, 0 without the memory controller
+  unsigned long long cpu_usage_usec;
+  unsigned long long cpu_user_usec;
+  unsigned long long cpu_system_usec;
+} pm_cgroup_usage_t;
+
+/* External exports */
+int pm_cgroup_set_root(const char *path);
+int pm_cgroup_enabled();
+int pm_cgroup_wanted(const pm_cgroup_limits_t *limits);
+int pm_cgroup_place(pid_t pid, const pm_cgroup_limits_t *limits);
+int pm_cgroup_usage(pid_t pid, pm_cgroup_usage_t *usage);
+int pm_cgroup_release(pid_t pid);
+
+#endif
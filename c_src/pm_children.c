@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pm_children.h"
+
+/* Where a pid starts probing from, pids come in runs so they get mixed up first */
+static unsigned int home_slot(pm_child_table_t *t, pid_t pid)
+{
+  unsigned int h = (unsigned int)pid * 2654435761u;
+  return (h ^ (h >> 16)) & t->mask;
+}
+
+static int find_slot(pm_child_table_t *t, pid_t pid)
+{
+  unsigned int s;
+  if (t->slots == NULL || pid <= 0) return -1;
+  for (s = home_slot(t, pid); t->slots[s].pid != 0; s = (s + 1) & t->mask)
+    if (t->slots[s].pid == pid) return (int)s;
+  return -1;
+}
+
+static void insert_slot(pm_child_table_t *t, pid_t pid, int index)
+{
+  unsigned int s;
+  for (s = home_slot(t, pid); t->slots[s].pid != 0; s = (s + 1) & t->mask) ;
+  t->slots[s].pid = pid;
+  t->slots[s].index = index;
+}
+
+#define GROW_ARRAY(arr, n) do { \
+  void *grown = realloc(arr, (n) * sizeof(*(arr))); \
+  if (grown == NULL) return -1; \
+  arr = grown; \
+} while (0)
+
+/* Room for capacity entries, with the index never more than half full */
+static int grow(pm_child_table_t *t, int capacity)
+{
+  pm_child_slot_t *slots;
+  unsigned int nslots = 1, i;
+
+  GROW_ARRAY(t->pid, capacity);
+  GROW_ARRAY(t->kill_pid, capacity);
+  GROW_ARRAY(t->deadline, capacity);
+  GROW_ARRAY(t->status, capacity);
+  GROW_ARRAY(t->signal, capacity);
+  GROW_ARRAY(t->transId, capacity);
+  t->capacity = capacity;
+
+  while (nslots < (unsigned int)capacity * 2) nslots <<= 1;
+  if ((slots = (pm_child_slot_t *) calloc(nslots, sizeof(pm_child_slot_t))) == NULL) return -1;
+  free(t->slots);
+  t->slots = slots;
+  t->mask = nslots - 1;
+  for (i = 0; i < (unsigned int)t->count; i++) insert_slot(t, t->pid[i], i);
+  return 0;
+}
+
+int pm_children_init(pm_child_table_t *t)
+{
+  memset(t, 0, sizeof(pm_child_table_t));
+  return 0;
+}
+
+void pm_children_free(pm_child_table_t *t)
+{
+  free(t->pid);
+  free(t->kill_pid);
+  free(t->deadline);
+  free(t->status);
+  free(t->signal);
+  free(t->transId);
+  free(t->slots);
+  pm_children_init(t);
+}
+
+/**
+* pm_children_add
+* @description
+*   Start tracking pid, a pid that's already in the table is left as it is
+* @return
+*   int - entry of pid or -1 when out of memory
+**/
+int pm_children_add(pm_child_table_t *t, pid_t pid, int transId)
+{
+  int i;
+  if ((i = pm_children_find(t, pid)) >= 0) return i;
+  if (t->count == t->capacity && grow(t, t->capacity ? t->capacity * 2 : PM_CHILDREN_MIN_SZ)) return -1;
+
+  i = t->count++;
+  t->pid[i] = pid;
+  t->kill_pid[i] = 0;
+  t->deadline[i] = 0;
+  t->status[i] = 0;
+  t->signal[i] = 0;
+  t->transId[i] = transId;
+  insert_slot(t, pid, i);
+  return i;
+}
+
+/**
+* pm_children_find
+* @return
+*   int - entry of pid or -1 if it isn't tracked
+**/
+int pm_children_find(pm_child_table_t *t, pid_t pid)
+{
+  int s = find_slot(t, pid);
+  return s < 0 ? -1 : t->slots[s].index;
+}
+
+/**
+* pm_children_remove_at
+* @description
+*   Stop tracking entry i. The last entry takes its place, so a walk that
+*   removes as it goes has to walk back to front
+**/
+int pm_children_remove_at(pm_child_table_t *t, int i)
+{
+  unsigned int hole, j, k;
+  int last = t->count - 1;
+  int s;
+
+  if (i < 0 || i > last || (s = find_slot(t, t->pid[i])) < 0) return -1;
+
+  // Shift the rest of the probe run back over the slot
+  hole = (unsigned int)s;
+  t->slots[hole].pid = 0;
+  for (j = (hole + 1) & t->mask; t->slots[j].pid != 0; j = (j + 1) & t->mask) {
+    k = home_slot(t, t->slots[j].pid);
+    // Already as close to home as it gets, leave it
+    if (hole <= j ? (hole < k && k <= j) : (hole < k || k <= j)) continue;
+    t->slots[hole] = t->slots[j];
+    t->slots[j].pid = 0;
+    hole = j;
+  }
+
+  if (i != last) {
+    t->pid[i] = t->pid[last];
+    t->kill_pid[i] = t->kill_pid[last];
+    t->deadline[i] = t->deadline[last];
+    t->status[i] = t->status[last];
+    t->signal[i] = t->signal[last];
+    t->transId[i] = t->transId[last];
+    t->slots[find_slot(t, t->pid[i])].index = i;
+  }
+  t->count--;
+  return 0;
+}
+
+int pm_children_remove(pm_child_table_t *t, pid_t pid)
+{
+  return pm_children_remove_at(t, pm_children_find(t, pid));
+}
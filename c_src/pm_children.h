@@ -0,0 +1,51 @@
+#ifndef PM_CHILDREN_H
+#define PM_CHILDREN_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/**
+* Child tables
+* The children the daemon tracks, kept dense: pid, kill_pid, deadline,
+* status, signal and transId each live in an array of their own, entry i of
+* every array belongs to the same child. Walking the children walks
+* those arrays front to back.
+* Finding a child goes through an open addressed (linear probing) index
+* from pid to its entry. Removing one moves the last entry into the hole
+* and shifts the probe run back over the slot it had, so there are never
+* any tombstones to skip over
+**/
+
+#ifndef PM_CHILDREN_MIN_SZ
+#define PM_CHILDREN_MIN_SZ    64
+#endif
+
+/* Types */
+typedef struct _pm_child_slot_t_ {
+  pid_t pid;                  // 0 when the slot is empty
+  int   index;                // entry in the arrays
+} pm_child_slot_t;
+
+typedef struct _pm_child_table_t_ {
+  int               count;
+  int               capacity;     // of the arrays
+  pid_t*            pid;
+  pid_t*            kill_pid;
+  time_t*           deadline;
+  int*              status;
+  int*              signal;       // Last signal we sent it, 0 if none
+  int*              transId;
+  pm_child_slot_t*  slots;
+  unsigned int      mask;         // slot count - 1, the slot count is a power of two
+} pm_child_table_t;
+
+/* External exports */
+int pm_children_init(pm_child_table_t *t);
+void pm_children_free(pm_child_table_t *t);
+int pm_children_add(pm_child_table_t *t, pid_t pid, int transId);
+int pm_children_find(pm_child_table_t *t, pid_t pid);
+int pm_children_remove_at(pm_child_table_t *t, int i);
+int pm_children_remove(pm_child_table_t *t, pid_t pid);
+#define pm_children_count(t) ((t)->count)
+
+#endif
@@ -1,4 +1,13 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <pthread.h>
 #include "pm_helpers.h"
+#include "uthash.h"
 
 int string_index(const char* cmds[], const char *cmd)
 {
@@ -48,23 +57,141 @@ char* str_safe_quote(const char *str)
   return res;
 }
 
-const char *find_binary(const char *file)
+/**
+* Resolved binary cache
+* Lookups are keyed by command name against the one PATH the cache was
+* built for. Any change to a directory on that PATH (noticed through
+* inotify, or through its mtime where inotify isn't around) flushes it.
+**/
+typedef struct _binary_cache_t_ {
+  char*           file;       // key, the command name as it was asked for
+  char*           resolved;   // full path or NULL when it is not on the PATH
+  UT_hash_handle  hh;
+} binary_cache_t;
+
+typedef struct _path_dir_t_ {
+  char*   dir;
+  int     wd;                 // inotify watch or -1 when checked by mtime
+  time_t  mtime;              // 0 when the directory doesn't exist
+} path_dir_t;
+
+static binary_cache_t*  binary_cache = NULL;
+static int              binary_cache_size = 0;
+static char*            cached_path = NULL;
+static path_dir_t*      path_dirs = NULL;
+static int              path_dirs_count = 0;
+static int              inotify_fd = -1;
+static pthread_mutex_t  binary_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t dir_mtime(const char *dir)
 {
-  char buf[BUFFER_SZ];
-  const char *p, *path;
-  int len = 0, lp;
+  struct stat st;
+  if (stat(dir, &st) != 0) return 0;
+  return st.st_mtime;
+}
+
+static void binary_cache_flush()
+{
+  binary_cache_t *entry, *tmp;
+  for (entry = binary_cache; entry != NULL; entry = tmp) {
+    tmp = entry->hh.next;
+    HASH_DEL(binary_cache, entry);
+    free(entry->file);
+    if (entry->resolved) free(entry->resolved);
+    free(entry);
+  }
+  binary_cache_size = 0;
+}
+
+static void binary_cache_forget_path()
+{
+  int i;
+  for (i = 0; i < path_dirs_count; i++) {
+#ifdef __linux__
+    if (path_dirs[i].wd >= 0) inotify_rm_watch(inotify_fd, path_dirs[i].wd);
+#endif
+    free(path_dirs[i].dir);
+  }
+  if (path_dirs) free(path_dirs);
+  if (cached_path) free(cached_path);
+  path_dirs = NULL;
+  path_dirs_count = 0;
+  cached_path = NULL;
+}
+
+static void binary_cache_adopt_path(const char *path)
+{
+  const char *p = path, *end;
+  int count = 1;
   
-  if (file[0] == '\0') {
-    errno = ENOENT;
-    return NULL;
+  for (end = path; *end; end++) if (*end == ':') count++;
+  if ((path_dirs = (path_dir_t *) calloc(count, sizeof(path_dir_t))) == NULL) return;
+  cached_path = strdup(path);
+  
+#ifdef __linux__
+  if (inotify_fd < 0) inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+  
+  do {
+    for (end = p; *end != 0 && *end != ':'; end++) ;
+    path_dir_t *d = &path_dirs[path_dirs_count++];
+    // An empty element means the current directory
+    d->dir = (end == p) ? strdup(".") : strndup(p, end - p);
+    d->wd = -1;
+#ifdef __linux__
+    if (inotify_fd >= 0)
+      d->wd = inotify_add_watch(inotify_fd, d->dir, 
+        IN_CREATE|IN_DELETE|IN_ATTRIB|IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR);
+#endif
+    d->mtime = dir_mtime(d->dir);
+    p = end + 1;
+  } while (*end == ':');
+}
+
+/**
+* Has anything on the PATH changed since the cache was filled
+**/
+static int binary_cache_stale()
+{
+  int i, stale = 0;
+#ifdef __linux__
+  char buf[BUFFER_SZ] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+  
+  while (inotify_fd >= 0 && (len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+    char *ptr;
+    stale = 1;
+    for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event *)ptr)->len) {
+      struct inotify_event *ev = (struct inotify_event *)ptr;
+      if (!(ev->mask & IN_IGNORED)) continue;
+      // The directory itself went away, fall back to watching its mtime
+      for (i = 0; i < path_dirs_count; i++)
+        if (path_dirs[i].wd == ev->wd) path_dirs[i].wd = -1;
+    }
   }
-  if (!strcmp(file,"")) return "";
-  if (!pm_abs_path(file)) return file;
+#endif
+  for (i = 0; i < path_dirs_count; i++) {
+    if (path_dirs[i].wd >= 0) continue;
+    time_t mtime = dir_mtime(path_dirs[i].dir);
+    if (mtime != path_dirs[i].mtime) {
+      path_dirs[i].mtime = mtime;
+      stale = 1;
+    }
+  }
+  return stale;
+}
+
+/**
+* Walk the PATH looking for an executable file
+* @return
+*   char* - a newly allocated full path or NULL when it isn't there
+**/
+static char *search_path(const char *file, const char *path)
+{
+  char buf[BUFFER_SZ];
+  const char *p;
+  int len = strlen(file), lp;
   
-  // Get the path
-  if (!(path = getenv("PATH"))) path = _PATH_DEFPATH;
-	
-  len = strlen(file);
   do {
     /* Find the end of this path element. */
 		for (p = path; *path != 0 && *path != ':'; path++)
@@ -75,18 +202,76 @@ const char *find_binary(const char *file)
 			p = ".";
 			lp = 1;
 		} else lp = path - p;
-		    
-    (void*)memset(buf, '\0', BUFFER_SZ);
+		
+		if (lp + len + 2 > BUFFER_SZ) continue;
     memcpy(buf, p, lp);
 		buf[lp] = '/';
 		memcpy(buf + lp + 1, file, len);
 		buf[lp + len + 1] = '\0';
 		
-    if (0 == access(buf, X_OK)) {return strdup(buf);}
+    if (0 == access(buf, X_OK)) return strdup(buf);
     
   } while(*path++ == ':');
   
-  return file;
+  return NULL;
+}
+
+/**
+* find_binary
+* @return
+*   const char* - the full path to file on the PATH, or file itself when it is
+*   absolute or can't be found. The result is owned by the cache, don't free it
+**/
+const char *find_binary(const char *file)
+{
+  const char *path;
+  binary_cache_t *entry;
+  
+  if (file[0] == '\0') {
+    errno = ENOENT;
+    return NULL;
+  }
+  if (!pm_abs_path(file)) return file;
+  
+  // Get the path
+  if (!(path = getenv("PATH"))) path = _PATH_DEFPATH;
+  
+  if (cached_path == NULL || strcmp(cached_path, path)) {
+    binary_cache_flush();
+    binary_cache_forget_path();
+    binary_cache_adopt_path(path);
+  } else if (binary_cache_stale()) {
+    binary_cache_flush();
+  }
+  
+  HASH_FIND_STR(binary_cache, file, entry);
+  if (entry) return entry->resolved ? entry->resolved : file;
+  
+  if (binary_cache_size >= BINARY_CACHE_SZ) binary_cache_flush();
+  if ((entry = (binary_cache_t *) calloc(1, sizeof(binary_cache_t))) == NULL) return file;
+  entry->file = strdup(file);
+  entry->resolved = search_path(file, path);
+  HASH_ADD_KEYPTR(hh, binary_cache, entry->file, strlen(entry->file), entry);
+  binary_cache_size++;
+  
+  return entry->resolved ? entry->resolved : file;
+}
+
+/**
+* find_binary_copy
+* @description
+*   find_binary for the spawn workers, the cache is shared between them so
+*   the lookup is locked and the caller gets a copy it owns
+**/
+char *find_binary_copy(const char *file)
+{
+  const char *found;
+  char *copy = NULL;
+  
+  pthread_mutex_lock(&binary_cache_lock);
+  if ((found = find_binary(file)) != NULL) copy = strdup(found);
+  pthread_mutex_unlock(&binary_cache_lock);
+  return copy;
 }
 
 
@@ -141,13 +326,46 @@ int argify(const char *line, char ***argv_ptr)
   argc = count_args (line);
   if (argc == 0)
       return -1;
-  argv = (char **)malloc (sizeof (char *) * argc);
+  // Leave room for the NULL that terminates an exec argv
+  argv = (char **)malloc (sizeof (char *) * (argc + 1));
   if (!argv) return -1;
   if (copy_args (line, argc, argv) < 0) return -1;
+  argv[argc] = NULL;
   *argv_ptr = argv;
   
   return argc;
 }
 
+/* Builtins and keywords, there's no binary of that name to exec (or the one there is does nothing for us) */
+static const char* shell_words[] = {
+  ".", ":", "alias", "bg", "break", "case", "cd", "command", "continue", "do", "done",
+  "elif", "else", "esac", "eval", "exec", "exit", "export", "fg", "fi", "for", "function",
+  "getopts", "hash", "if", "jobs", "let", "local", "read", "readonly", "return", "select",
+  "set", "shift", "source", "test", "then", "time", "times", "trap", "type", "ulimit",
+  "umask", "unalias", "unset", "until", "wait", "while", NULL
+};
+
+/**
+* Does the command need a shell to run, or can it be split on whitespace
+* and exec'd as is. Anything that looks like quoting, globbing, expansion,
+* redirection, job control, a leading VAR=value or a first word that's a
+* builtin or a keyword goes to the shell
+**/
+int pm_needs_shell(const char *command)
+{
+  const char *p = command, *word;
+  int i;
+  
+  SKIP (p);
+  word = p;
+  // VAR=value cmd
+  for (; WANT (p); p++) if (*p == '=') return 1;
+  for (i = 0; shell_words[i]; i++)
+    if ((size_t)(p - word) == strlen(shell_words[i]) && !strncmp(word, shell_words[i], p - word)) return 1;
+  for (p = command; *p; p++)
+    if (strchr(SHELL_METACHARS, *p)) return 1;
+  return 0;
+}
+
 #undef SKIP
 #undef WANT
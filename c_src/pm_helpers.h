@@ -27,6 +27,13 @@
 #define MAX_ENV 256
 #endif
 
+#ifndef BINARY_CACHE_SZ
+#define BINARY_CACHE_SZ 1024
+#endif
+
+/* Any of these in a command means it has to be run through $SHELL -c */
+#define SHELL_METACHARS "|&;<>()$`\\\"'*?[#~{}\n"
+
 #ifndef PREFIX_LEN
 #define PREFIX_LEN 8
 #endif
@@ -34,8 +41,10 @@
 /* prototypes */
 int pm_abs_path(const char *path);
 const char *find_binary(const char *file);
+char *find_binary_copy(const char *file);
 int string_index(const char* cmds[], const char *cmd);
 int argify(const char *line, char ***argv_ptr);
+int pm_needs_shell(const char *command);
 char* str_chomp(const char *string);
 char* str_safe_quote(const char *str);
 
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pm_journal.h"
+
+static int                  journal_fd = -1;
+static char*                journal_path = NULL;
+static pm_journal_rec_t*    slots = NULL;       // slots[0] is the header, records start at 1
+static size_t               slot_count = 0;
+static size_t               tail = 0;           // next slot to write
+static pm_journal_entry_t*  entries = NULL;     // what's live, by pid
+
+static void forget_entries()
+{
+  pm_journal_entry_t *e, *next;
+  for (e = entries; e != NULL; e = next) {
+    next = e->hh.next;
+    HASH_DEL(entries, e);
+    free(e);
+  }
+}
+
+static void unmap()
+{
+  if (slots) munmap(slots, slot_count * sizeof(pm_journal_rec_t));
+  if (journal_fd >= 0) close(journal_fd);
+  slots = NULL;
+  slot_count = tail = 0;
+  journal_fd = -1;
+}
+
+/* Journal to fd from here on, mapped at addr. It holds a header and size / sizeof(pm_journal_rec_t) - 1 slots */
+static void install(int fd, void *addr, size_t size)
+{
+  unmap();
+  journal_fd = fd;
+  slots = (pm_journal_rec_t *) addr;
+  slot_count = size / sizeof(pm_journal_rec_t);
+}
+
+static int map(int fd, size_t size)
+{
+  void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) return -1;
+  install(fd, addr, size);
+  return 0;
+}
+
+/* A new file of slot_count slots at path, holding the header and nothing else */
+static int create(const char *path, size_t count)
+{
+  pm_journal_rec_t header;
+  int fd, err;
+  if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) return -1;
+  memset(&header, 0, sizeof(header));
+  memcpy(&header, PM_JOURNAL_MAGIC, strlen(PM_JOURNAL_MAGIC));
+  if (write(fd, &header, sizeof(header)) != sizeof(header) || ftruncate(fd, count * sizeof(pm_journal_rec_t)) < 0) {
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+static void apply(const pm_journal_rec_t *rec)
+{
+  pm_journal_entry_t *e = NULL;
+  pid_t pid = rec->pid;
+  if (entries) HASH_FIND_INT(entries, &pid, e);
+  if (rec->op == PM_JOURNAL_DEL) {
+    if (e) {
+      HASH_DEL(entries, e);
+      free(e);
+    }
+    return;
+  }
+  if (e == NULL) {
+    if ((e = (pm_journal_entry_t *) calloc(1, sizeof(pm_journal_entry_t))) == NULL) return;
+    e->pid = pid;
+    HASH_ADD_INT(entries, pid, e);
+  }
+  e->start_time = rec->start_time;
+  e->transId = rec->transId;
+  memcpy(e->app, rec->app, PM_JOURNAL_APP_LEN);
+  e->app[PM_JOURNAL_APP_LEN - 1] = '\0';
+}
+
+/* Read back what's live, up to the first slot that was never written */
+static void replay()
+{
+  for (tail = 1; tail < slot_count; tail++) {
+    const pm_journal_rec_t *rec = &slots[tail];
+    if (rec->op != PM_JOURNAL_ADD && rec->op != PM_JOURNAL_DEL) break;
+    apply(rec);
+  }
+}
+
+/**
+* pm_journal_open
+* @description
+*   Journal to path from here on, reading back the children whatever
+*   journaled there before us left running (see pm_journal_entries). A
+*   file that isn't a journal is started over
+* @return
+*   int - 0, or -1 with errno set when path can't be opened or mapped
+**/
+int pm_journal_open(const char *path)
+{
+  struct stat st;
+  char *copy;
+  int fd;
+
+  pm_journal_close();
+  if ((copy = strdup(path)) == NULL) return -1;
+  if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) goto fail;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= 2 * sizeof(pm_journal_rec_t) &&
+      st.st_size % sizeof(pm_journal_rec_t) == 0 && map(fd, st.st_size) == 0) {
+    if (memcmp(slots, PM_JOURNAL_MAGIC, strlen(PM_JOURNAL_MAGIC)) == 0) goto opened;
+    unmap();
+  } else {
+    close(fd);
+  }
+  // Not one of ours, or cut short
+  if ((fd = create(path, PM_JOURNAL_RECORDS + 1)) < 0) goto fail;
+  if (map(fd, (PM_JOURNAL_RECORDS + 1) * sizeof(pm_journal_rec_t))) {
+    close(fd);
+    goto fail;
+  }
+
+opened:
+  journal_path = copy;
+  replay();
+  return 0;
+
+fail:
+  free(copy);
+  return -1;
+}
+
+void pm_journal_close()
+{
+  unmap();
+  forget_entries();
+  if (journal_path) free(journal_path);
+  journal_path = NULL;
+}
+
+int pm_journal_enabled()
+{
+  return slots != NULL;
+}
+
+/**
+* pm_journal_compact
+* @description
+*   Rewrite the journal with only what's live, in a file with room for
+*   at least as many entries again, and put it in place of the old one
+* @return
+*   int - 0, or -1 with errno set (the old journal is kept)
+**/
+int pm_journal_compact()
+{
+  pm_journal_entry_t *e;
+  pm_journal_rec_t rec;
+  char tmp[PATH_MAX];
+  size_t count = PM_JOURNAL_RECORDS, live = HASH_COUNT(entries);
+  void *addr = MAP_FAILED;
+  int fd, err = 0;
+
+  if (!pm_journal_enabled()) return 0;
+  while (count < 2 * live) count *= 2;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", journal_path);
+  if ((fd = create(tmp, count + 1)) < 0) return -1;
+  for (e = entries; e != NULL && !err; e = e->hh.next) {
+    memset(&rec, 0, sizeof(rec));
+    rec.op = PM_JOURNAL_ADD;
+    rec.pid = e->pid;
+    rec.start_time = e->start_time;
+    rec.transId = e->transId;
+    memcpy(rec.app, e->app, PM_JOURNAL_APP_LEN);
+    if (write(fd, &rec, sizeof(rec)) != sizeof(rec)) err = errno ? errno : EIO;
+  }
+  // Mapped before it's renamed, so the file in place is always the one being written
+  if (!err && (addr = mmap(NULL, (count + 1) * sizeof(pm_journal_rec_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) err = errno;
+  if (!err && rename(tmp, journal_path) < 0) err = errno;
+  if (err) {
+    if (addr != MAP_FAILED) munmap(addr, (count + 1) * sizeof(pm_journal_rec_t));
+    close(fd);
+    unlink(tmp);
+    errno = err;
+    return -1;
+  }
+  install(fd, addr, (count + 1) * sizeof(pm_journal_rec_t));
+  tail = live + 1;
+  return 0;
+}
+
+static int append(enum JournalOpT op, pid_t pid, unsigned long long start_time, int transId, const char *app)
+{
+  pm_journal_rec_t *rec;
+  if (!pm_journal_enabled()) return 0;
+  if (tail >= slot_count && pm_journal_compact()) return -1;
+  rec = &slots[tail++];
+  rec->pid = pid;
+  rec->start_time = start_time;
+  rec->transId = transId;
+  memset(rec->app, 0, PM_JOURNAL_APP_LEN);
+  if (app) strncpy(rec->app, app, PM_JOURNAL_APP_LEN - 1);
+  // A daemon that dies before this leaves a slot that was never written
+  __sync_synchronize();
+  rec->op = op;
+  apply(rec);
+  return 0;
+}
+
+/* pid, started start_time ticks after boot, is running */
+int pm_journal_add(pid_t pid, unsigned long long start_time, int transId, const char *app)
+{
+  return append(PM_JOURNAL_ADD, pid, start_time, transId, app);
+}
+
+/* pid is gone */
+int pm_journal_remove(pid_t pid)
+{
+  pm_journal_entry_t *e = NULL;
+  if (entries) HASH_FIND_INT(entries, &pid, e);
+  if (e == NULL) return 0;
+  return append(PM_JOURNAL_DEL, pid, 0, 0, NULL);
+}
+
+/* What's live, a uthash to walk with hh.next */
+pm_journal_entry_t* pm_journal_entries()
+{
+  return entries;
+}
@@ -0,0 +1,57 @@
+#ifndef PM_JOURNAL_H
+#define PM_JOURNAL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "uthash.h"
+
+/**
+* Journal of running children
+* Every run command that's left running is appended as it starts and
+* again as it's reaped, to a file mapped into memory so an entry costs
+* a store rather than a write. It outlives the daemon, the next one
+* started with the same file reads back whatever was still running and
+* adopts what of it is still there. A child is known by its start time
+* as well as its pid, a pid that has been reused is never adopted.
+* Once the file is full it's rewritten with only the live entries and
+* renamed over the old one, a crash halfway leaves the old file whole
+**/
+
+/* Slots the journal starts out with, it doubles from there as needed */
+#ifndef PM_JOURNAL_RECORDS
+#define PM_JOURNAL_RECORDS    1024
+#endif
+#define PM_JOURNAL_APP_LEN    44
+#define PM_JOURNAL_MAGIC      "BSJRNL01"
+
+/* What a record says happened, 0 is a slot never written */
+enum JournalOpT {PM_JOURNAL_END, PM_JOURNAL_ADD, PM_JOURNAL_DEL};
+
+/* Types */
+typedef struct _pm_journal_rec_t_ {
+  uint32_t  op;                         // written last, the record doesn't count until it is
+  int32_t   pid;
+  uint64_t  start_time;                 // clock ticks after boot, field 22 of /proc/<pid>/stat
+  int32_t   transId;
+  char      app[PM_JOURNAL_APP_LEN];
+} pm_journal_rec_t;                     // 64 bytes, a slot of the file
+
+typedef struct _pm_journal_entry_t_ {
+  pid_t               pid;              // key
+  unsigned long long  start_time;
+  int                 transId;
+  char                app[PM_JOURNAL_APP_LEN];
+  UT_hash_handle      hh;               // makes this structure hashable
+} pm_journal_entry_t;
+
+/* External exports */
+int pm_journal_open(const char *path);
+void pm_journal_close();
+int pm_journal_enabled();
+int pm_journal_add(pid_t pid, unsigned long long start_time, int transId, const char *app);
+int pm_journal_remove(pid_t pid);
+int pm_journal_compact();
+pm_journal_entry_t* pm_journal_entries();
+
+#endif
@@ -0,0 +1,319 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#else
+#include <poll.h>
+#endif
+
+#include "pm_loop.h"
+
+#define PM_LOOP_MAX_EVENTS 64
+
+typedef struct _pm_loop_handler_ {
+  int         active;     // Is this fd registered at all
+  int         events;     // PM_LOOP_READ | PM_LOOP_WRITE, may be 0 while paused
+  pm_loop_cb  cb;
+  void*       data;
+} pm_loop_handler;
+
+/**
+* Handlers are indexed by fd, so every lookup is O(1)
+**/
+static pm_loop_handler*   handlers = NULL;
+static int                handlers_capacity = 0;
+static int                signal_fd = -1;   // signalfd on linux, read end of the self-pipe elsewhere
+static pm_signal_cb       signal_cb = NULL;
+
+#ifdef __linux__
+static int                epoll_fd = -1;
+#else
+static int                signal_pipe[2] = {-1, -1};
+static struct pollfd*     poll_fds = NULL;
+static int                poll_fds_capacity = 0;
+#endif
+
+static int ensure_capacity(int fd)
+{
+  if (fd < handlers_capacity) return 0;
+
+  int new_capacity = handlers_capacity ? handlers_capacity : 64;
+  while (new_capacity <= fd) new_capacity *= 2;
+
+  pm_loop_handler *tmp = (pm_loop_handler *) realloc(handlers, new_capacity * sizeof(pm_loop_handler));
+  if (tmp == NULL) {
+    perror("pm_loop realloc");
+    return -1;
+  }
+  memset(tmp + handlers_capacity, 0, (new_capacity - handlers_capacity) * sizeof(pm_loop_handler));
+  handlers = tmp;
+  handlers_capacity = new_capacity;
+  return 0;
+}
+
+static void dispatch(int fd, int events)
+{
+  if (fd < 0 || fd >= handlers_capacity || !handlers[fd].active) return;
+  // Only hand out the events that were asked for (hangups count as readable)
+  events &= handlers[fd].events;
+  if (events) handlers[fd].cb(fd, events, handlers[fd].data);
+}
+
+#ifdef __linux__
+static unsigned int to_epoll(int events)
+{
+  unsigned int ev = 0;
+  if (events & PM_LOOP_READ)  ev |= EPOLLIN;
+  if (events & PM_LOOP_WRITE) ev |= EPOLLOUT;
+  return ev;
+}
+
+int pm_loop_init()
+{
+  if (epoll_fd >= 0) return 0;
+  if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    perror("epoll_create1");
+    return -1;
+  }
+  return 0;
+}
+
+int pm_loop_add(int fd, int events, pm_loop_cb cb, void *data)
+{
+  struct epoll_event ev;
+  if (fd < 0 || ensure_capacity(fd)) return -1;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = to_epoll(events);
+  ev.data.fd = fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) return -1;
+
+  handlers[fd].active = 1;
+  handlers[fd].events = events;
+  handlers[fd].cb = cb;
+  handlers[fd].data = data;
+  return 0;
+}
+
+int pm_loop_modify(int fd, int events)
+{
+  struct epoll_event ev;
+  if (fd < 0 || fd >= handlers_capacity || !handlers[fd].active) return -1;
+  if (handlers[fd].events == events) return 0;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = to_epoll(events);
+  ev.data.fd = fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) return -1;
+  handlers[fd].events = events;
+  return 0;
+}
+
+int pm_loop_remove(int fd)
+{
+  if (fd < 0 || fd >= handlers_capacity || !handlers[fd].active) return -1;
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  memset(&handlers[fd], 0, sizeof(pm_loop_handler));
+  return 0;
+}
+
+static void read_signals(int fd, int events, void *data)
+{
+  struct signalfd_siginfo si;
+  while (read(fd, &si, sizeof(si)) == sizeof(si))
+    if (signal_cb) signal_cb((int)si.ssi_signo);
+}
+
+/**
+* Block the signals in set and deliver them through a signalfd instead,
+* so they arrive as ordinary events and never interrupt us mid-command
+**/
+int pm_loop_watch_signals(const sigset_t *set, pm_signal_cb cb)
+{
+  if (sigprocmask(SIG_BLOCK, set, NULL) < 0) return -1;
+  if ((signal_fd = signalfd(signal_fd, set, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+    perror("signalfd");
+    return -1;
+  }
+  signal_cb = cb;
+  if (signal_fd < handlers_capacity && handlers[signal_fd].active) return 0;
+  return pm_loop_add(signal_fd, PM_LOOP_READ, read_signals, NULL);
+}
+
+/**
+* pm_loop_run_once
+* @params
+*   int timeout_ms - How long to block for, -1 blocks until something happens
+* @return
+*   int - number of fds that were ready or -1 on failure
+**/
+int pm_loop_run_once(int timeout_ms)
+{
+  struct epoll_event evs[PM_LOOP_MAX_EVENTS];
+  int i, n;
+
+  if ((n = epoll_wait(epoll_fd, evs, PM_LOOP_MAX_EVENTS, timeout_ms)) < 0) {
+    if (errno == EINTR) return 0;
+    perror("epoll_wait");
+    return -1;
+  }
+
+  for (i = 0; i < n; i++) {
+    int events = 0;
+    if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) events |= PM_LOOP_READ;
+    if (evs[i].events & (EPOLLOUT | EPOLLERR)) events |= PM_LOOP_WRITE;
+    dispatch(evs[i].data.fd, events);
+  }
+  return n;
+}
+
+void pm_loop_close()
+{
+  if (signal_fd >= 0) close(signal_fd);
+  if (epoll_fd >= 0) close(epoll_fd);
+  signal_fd = epoll_fd = -1;
+  signal_cb = NULL;
+  free(handlers);
+  handlers = NULL;
+  handlers_capacity = 0;
+}
+
+#else
+
+int pm_loop_init()
+{
+  return 0;
+}
+
+int pm_loop_add(int fd, int events, pm_loop_cb cb, void *data)
+{
+  if (fd < 0 || ensure_capacity(fd)) return -1;
+  handlers[fd].active = 1;
+  handlers[fd].events = events;
+  handlers[fd].cb = cb;
+  handlers[fd].data = data;
+  return 0;
+}
+
+int pm_loop_modify(int fd, int events)
+{
+  if (fd < 0 || fd >= handlers_capacity || !handlers[fd].active) return -1;
+  handlers[fd].events = events;
+  return 0;
+}
+
+int pm_loop_remove(int fd)
+{
+  if (fd < 0 || fd >= handlers_capacity || !handlers[fd].active) return -1;
+  memset(&handlers[fd], 0, sizeof(pm_loop_handler));
+  return 0;
+}
+
+static void pm_loop_gotsignal(int signo)
+{
+  int saved_errno = errno;
+  unsigned char c = (unsigned char)signo;
+  ssize_t r = write(signal_pipe[1], &c, 1);
+  (void)r;
+  errno = saved_errno;
+}
+
+static void read_signals(int fd, int events, void *data)
+{
+  unsigned char sigs[64];
+  ssize_t i, n;
+  while ((n = read(fd, sigs, sizeof(sigs))) > 0)
+    for (i = 0; i < n; i++)
+      if (signal_cb) signal_cb((int)sigs[i]);
+}
+
+/**
+* Route the signals in set through a self-pipe, so they arrive as
+* ordinary events and never interrupt us mid-command
+**/
+int pm_loop_watch_signals(const sigset_t *set, pm_signal_cb cb)
+{
+  struct sigaction sa;
+  int signo;
+
+  if (signal_pipe[0] < 0) {
+    if (pipe(signal_pipe) < 0) {
+      perror("pipe");
+      return -1;
+    }
+    for (signo = 0; signo < 2; signo++) {
+      fcntl(signal_pipe[signo], F_SETFL, fcntl(signal_pipe[signo], F_GETFL) | O_NONBLOCK);
+      fcntl(signal_pipe[signo], F_SETFD, FD_CLOEXEC);
+    }
+  }
+  signal_fd = signal_pipe[0];
+  signal_cb = cb;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = pm_loop_gotsignal;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  for (signo = 1; signo < NSIG; signo++)
+    if (sigismember(set, signo) == 1) sigaction(signo, &sa, NULL);
+
+  if (handlers_capacity > signal_fd && handlers[signal_fd].active) return 0;
+  return pm_loop_add(signal_fd, PM_LOOP_READ, read_signals, NULL);
+}
+
+int pm_loop_run_once(int timeout_ms)
+{
+  int fd, i, n, nfds = 0;
+
+  if (poll_fds_capacity < handlers_capacity) {
+    struct pollfd *tmp = (struct pollfd *) realloc(poll_fds, handlers_capacity * sizeof(struct pollfd));
+    if (tmp == NULL) return -1;
+    poll_fds = tmp;
+    poll_fds_capacity = handlers_capacity;
+  }
+
+  for (fd = 0; fd < handlers_capacity; fd++) {
+    if (!handlers[fd].active || !handlers[fd].events) continue;
+    poll_fds[nfds].fd = fd;
+    poll_fds[nfds].events = ((handlers[fd].events & PM_LOOP_READ) ? POLLIN : 0) |
+                            ((handlers[fd].events & PM_LOOP_WRITE) ? POLLOUT : 0);
+    poll_fds[nfds].revents = 0;
+    nfds++;
+  }
+
+  if ((n = poll(poll_fds, nfds, timeout_ms)) < 0) {
+    if (errno == EINTR) return 0;
+    perror("poll");
+    return -1;
+  }
+
+  for (i = 0; i < nfds; i++) {
+    int events = 0;
+    if (poll_fds[i].revents & (POLLIN | POLLHUP | POLLERR)) events |= PM_LOOP_READ;
+    if (poll_fds[i].revents & (POLLOUT | POLLERR)) events |= PM_LOOP_WRITE;
+    if (events) dispatch(poll_fds[i].fd, events);
+  }
+  return n;
+}
+
+void pm_loop_close()
+{
+  if (signal_pipe[0] >= 0) close(signal_pipe[0]);
+  if (signal_pipe[1] >= 0) close(signal_pipe[1]);
+  signal_pipe[0] = signal_pipe[1] = signal_fd = -1;
+  signal_cb = NULL;
+  free(handlers);
+  free(poll_fds);
+  handlers = NULL;
+  poll_fds = NULL;
+  handlers_capacity = poll_fds_capacity = 0;
+}
+
+#endif
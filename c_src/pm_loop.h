@@ -0,0 +1,28 @@
+#ifndef PM_LOOP_H
+#define PM_LOOP_H
+
+#include <signal.h>
+
+/**
+* Event loop
+* Uses epoll + signalfd on linux and poll + a self-pipe everywhere else
+**/
+
+/* Events */
+#define PM_LOOP_READ    0x1
+#define PM_LOOP_WRITE   0x2
+
+/* Types */
+typedef void (*pm_loop_cb)(int fd, int events, void *data);
+typedef void (*pm_signal_cb)(int signo);
+
+/* External exports */
+int pm_loop_init();
+int pm_loop_add(int fd, int events, pm_loop_cb cb, void *data);
+int pm_loop_modify(int fd, int events);
+int pm_loop_remove(int fd);
+int pm_loop_watch_signals(const sigset_t *set, pm_signal_cb cb);
+int pm_loop_run_once(int timeout_ms);
+void pm_loop_close();
+
+#endif
@@ -0,0 +1,517 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "uthash.h"
+#include "pm_loop.h"
+#include "pm_output.h"
+
+#define PM_OUTPUT_CHUNK             65536
+#define PM_OUTPUT_CHUNKS_PER_WAKEUP 16    // Don't let one chatty child hog the loop
+
+extern char* outputFile;
+
+/**
+* Every pipe headed for the same path shares one sink, so the daemon is
+* the only writer that file ever has
+**/
+typedef struct _pm_output_sink_t_ {
+  char*   path;               // key
+  int     fd;
+  off_t   size;               // Bytes written since the last rotation
+  int     refs;               // Pipes still feeding this sink
+  UT_hash_handle hh;          // makes this structure hashable
+} pm_output_sink_t;
+
+/**
+* An "erlang" target, output is held back for up to coalesce_ms so a
+* chatty child sends a few big frames instead of many small ones
+**/
+typedef struct _pm_output_stream_t_ {
+  int     fd;                 // Read end of the pipe, -1 once it hit eof
+  pid_t   pid;                // The child writing into it
+  int     which;              // 1 for stdout, 2 for stderr
+  char    buf[PM_OUTPUT_COALESCE_SZ];
+  int     len;
+  long    deadline;           // When buf has to go out (ms), only meaningful when len > 0
+  struct _pm_output_stream_t_ *next;
+} pm_output_stream_t;
+
+static pm_output_sink_t*    sinks = NULL;
+static off_t                rotate_size = PM_OUTPUT_ROTATE_SIZE;
+static int                  rotate_count = PM_OUTPUT_ROTATE_COUNT;
+static pm_output_stream_t*  streams = NULL;
+static pm_output_forward_cb forwarder = NULL;
+static int                  coalesce_ms = 0;
+static int                  congested = 0;      // Erlang isn't keeping up, stop reading
+
+/**
+* pm_output_parse
+* @params
+*   const char* spec - The stdout or stderr option, NULL or "" for the default
+*   int fd - 1 or 2, which one spec is for
+*   pm_output_t* out - Filled in with where the fd should go
+* @return
+*   int - 0 on success or -1 if the spec makes no sense
+**/
+int pm_output_parse(const char *spec, int fd, pm_output_t *out)
+{
+  out->pipe[0] = out->pipe[1] = -1;
+  out->path = NULL;
+
+  if (spec == NULL || spec[0] == '\0') {
+    if (fd == 2) {
+      out->mode = PM_OUTPUT_STDOUT;
+    } else {
+      out->mode = PM_OUTPUT_APPEND;
+      out->path = outputFile;
+    }
+    return 0;
+  }
+
+  if (!strcmp(spec, "null")) {
+    out->mode = PM_OUTPUT_NULL;
+    out->path = "/dev/null";
+  } else if (!strcmp(spec, "erlang")) {
+    out->mode = PM_OUTPUT_ERLANG;
+    return 0;
+  } else if (!strcmp(spec, "stdout")) {
+    if (fd != 2) return -1;
+    out->mode = PM_OUTPUT_STDOUT;
+    return 0;
+  } else if (!strncmp(spec, "append:", 7)) {
+    out->mode = PM_OUTPUT_APPEND;
+    out->path = spec + 7;
+  } else if (!strncmp(spec, "pipe:", 5)) {
+    out->mode = PM_OUTPUT_PIPE;
+    out->path = spec + 5;
+  } else if (!strncmp(spec, "file:", 5)) {
+    out->mode = PM_OUTPUT_FILE;
+    out->path = spec + 5;
+  } else {
+    out->mode = PM_OUTPUT_FILE;
+    out->path = spec;
+  }
+  return out->path[0] == '\0' ? -1 : 0;
+}
+
+/**
+* Create the pipe for a pipe target, both ends close on exec and the
+* daemon's end never blocks
+**/
+int pm_output_prepare(pm_output_t *out)
+{
+  if (out->mode != PM_OUTPUT_PIPE && out->mode != PM_OUTPUT_ERLANG) return 0;
+#ifdef __linux__
+  if (pipe2(out->pipe, O_CLOEXEC) < 0) return -1;
+#else
+  if (pipe(out->pipe) < 0) return -1;
+  fcntl(out->pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(out->pipe[1], F_SETFD, FD_CLOEXEC);
+#endif
+  fcntl(out->pipe[0], F_SETFL, fcntl(out->pipe[0], F_GETFL) | O_NONBLOCK);
+  return 0;
+}
+
+static int open_flags(enum OutputModeT mode)
+{
+  if (mode == PM_OUTPUT_FILE) return O_WRONLY|O_CREAT|O_TRUNC;
+  if (mode == PM_OUTPUT_APPEND) return O_WRONLY|O_CREAT|O_APPEND;
+  return O_WRONLY;
+}
+
+/**
+* Point fd at out, in a forked child right before it execs
+**/
+int pm_output_apply(pm_output_t *out, int fd)
+{
+  int file;
+  switch (out->mode) {
+    case PM_OUTPUT_PIPE:
+    case PM_OUTPUT_ERLANG:
+      return dup2(out->pipe[1], fd) < 0 ? -1 : 0;
+    case PM_OUTPUT_STDOUT:
+      return dup2(1, fd) < 0 ? -1 : 0;
+    default:
+      if ((file = open(out->path, open_flags(out->mode), 00644)) < 0) return -1;
+      if (file != fd) {
+        dup2(file, fd);
+        close(file);
+      }
+      return 0;
+  }
+}
+
+/**
+* Same as pm_output_apply, as file actions for posix_spawn
+**/
+int pm_output_spawn_actions(posix_spawn_file_actions_t *actions, pm_output_t *out, int fd)
+{
+  switch (out->mode) {
+    case PM_OUTPUT_PIPE:
+    case PM_OUTPUT_ERLANG:
+      return posix_spawn_file_actions_adddup2(actions, out->pipe[1], fd);
+    case PM_OUTPUT_STDOUT:
+      return posix_spawn_file_actions_adddup2(actions, 1, fd);
+    default:
+      return posix_spawn_file_actions_addopen(actions, fd, out->path, open_flags(out->mode), 00644);
+  }
+}
+
+static int open_sink_file(const char *path, int flags)
+{
+  return open(path, O_WRONLY|O_CREAT|O_CLOEXEC|flags, 00644);
+}
+
+/**
+* Move path to path.1, path.1 to path.2 and so on, dropping the oldest,
+* then start over on an empty path
+**/
+static void sink_rotate(pm_output_sink_t *sink)
+{
+  char from[PATH_MAX], to[PATH_MAX];
+  int i;
+
+  if (rotate_count > 0) {
+    for (i = rotate_count - 1; i > 0; i--) {
+      snprintf(from, sizeof(from), "%s.%d", sink->path, i);
+      snprintf(to, sizeof(to), "%s.%d", sink->path, i + 1);
+      rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", sink->path);
+    rename(sink->path, to);
+    if (sink->fd >= 0) close(sink->fd);
+    sink->fd = open_sink_file(sink->path, O_TRUNC);
+  } else if (sink->fd >= 0) {
+    // Nowhere to keep old logs, just start the file over
+    if (ftruncate(sink->fd, 0) == 0) lseek(sink->fd, 0, SEEK_SET);
+  }
+  sink->size = 0;
+}
+
+/**
+* Copy what's waiting in the pipe into the sink
+* On linux the data is spliced across and never copied through userspace
+* @return
+*   ssize_t - bytes moved, 0 once every writer is gone or -1 (EAGAIN when drained)
+**/
+static ssize_t sink_move(int fd, pm_output_sink_t *sink)
+{
+  static char buf[PM_OUTPUT_CHUNK];
+  ssize_t n, wrote, w;
+
+#ifdef __linux__
+  if (sink->fd >= 0) {
+    n = splice(fd, NULL, sink->fd, NULL, PM_OUTPUT_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    // Some filesystems can't be spliced into, copy those instead
+    if (n >= 0 || errno != EINVAL) return n;
+  }
+#endif
+  if ((n = read(fd, buf, sizeof(buf))) <= 0) return n;
+  // With nowhere to put it (a rotation failed to reopen) the output is dropped
+  for (wrote = 0; sink->fd >= 0 && wrote < n; wrote += w) {
+    if ((w = write(sink->fd, buf + wrote, n - wrote)) < 0) {
+      if (errno == EINTR) { w = 0; continue; }
+      break;
+    }
+  }
+  return n;
+}
+
+static void sink_release(pm_output_sink_t *sink)
+{
+  if (--sink->refs > 0) return;
+  HASH_DEL(sinks, sink);
+  if (sink->fd >= 0) close(sink->fd);
+  free(sink->path);
+  free(sink);
+}
+
+static void sink_readable(int fd, int events, void *data)
+{
+  pm_output_sink_t *sink = (pm_output_sink_t *) data;
+  ssize_t n = -1;
+  int chunks;
+
+  for (chunks = 0; chunks < PM_OUTPUT_CHUNKS_PER_WAKEUP; chunks++) {
+    if ((n = sink_move(fd, sink)) <= 0) break;
+    sink->size += n;
+    if (rotate_size > 0 && sink->size >= rotate_size) sink_rotate(sink);
+  }
+
+  // Every writer (the child and anything it left behind) is gone
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+    pm_loop_remove(fd);
+    close(fd);
+    sink_release(sink);
+  }
+}
+
+static pm_output_sink_t* find_or_open_sink(const char *path)
+{
+  pm_output_sink_t *sink;
+
+  HASH_FIND_STR(sinks, path, sink);
+  if (sink) return sink;
+
+  if ((sink = (pm_output_sink_t *) calloc(1, sizeof(pm_output_sink_t))) == NULL) return NULL;
+  if ((sink->fd = open_sink_file(path, 0)) < 0) {
+    free(sink);
+    return NULL;
+  }
+  // splice can't write to O_APPEND files, we're the only writer so seek instead
+  sink->size = lseek(sink->fd, 0, SEEK_END);
+  sink->path = strdup(path);
+  HASH_ADD_KEYPTR(hh, sinks, sink->path, strlen(sink->path), sink);
+  return sink;
+}
+
+/*--- Forwarding to Erlang ---*/
+static long now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/**
+* Stop (or start again) reading every stream, so a congested port pushes
+* back all the way to the children writing into the pipes
+**/
+static void set_congested(int is_congested)
+{
+  pm_output_stream_t *st;
+  congested = is_congested;
+  for (st = streams; st != NULL; st = st->next)
+    if (st->fd >= 0) pm_loop_modify(st->fd, congested ? 0 : PM_LOOP_READ);
+}
+
+static int stream_flush(pm_output_stream_t *st)
+{
+  if (st->len == 0) return 0;
+  if (forwarder == NULL || forwarder(st->pid, st->which, st->buf, st->len) == 0) {
+    st->len = 0;
+    return 0;
+  }
+  if (!congested) set_congested(1);
+  return -1;
+}
+
+/**
+* Read whatever the pipe has, handing the buffer off whenever it fills
+* @return
+*   int - 0 once the pipe is drained, 1 at eof and -1 if the port is congested
+**/
+static int stream_read(pm_output_stream_t *st)
+{
+  ssize_t n;
+  while (st->fd >= 0) {
+    if (st->len == PM_OUTPUT_COALESCE_SZ && stream_flush(st)) return -1;
+    if ((n = read(st->fd, st->buf + st->len, PM_OUTPUT_COALESCE_SZ - st->len)) < 0) {
+      if (errno == EINTR) continue;
+      return errno == EAGAIN ? 0 : 1;
+    }
+    if (n == 0) return 1;
+    if (st->len == 0) st->deadline = now_ms() + coalesce_ms;
+    st->len += n;
+  }
+  return 1;
+}
+
+/**
+* Free the streams that are at eof and have nothing left to send
+**/
+static void stream_reap()
+{
+  pm_output_stream_t **pst = &streams, *st;
+  while ((st = *pst) != NULL) {
+    if (st->fd < 0 && st->len == 0) {
+      *pst = st->next;
+      free(st);
+    } else {
+      pst = &st->next;
+    }
+  }
+}
+
+static void stream_close(pm_output_stream_t *st)
+{
+  pm_loop_remove(st->fd);
+  close(st->fd);
+  st->fd = -1;
+}
+
+static void stream_readable(int fd, int events, void *data)
+{
+  pm_output_stream_t *st = (pm_output_stream_t *) data;
+  int eof = stream_read(st);
+  
+  if (eof < 0) return;
+  if (eof > 0) stream_close(st);
+  // Without a window everything goes straight out, at eof there's nothing left to wait for
+  if (st->len > 0 && (coalesce_ms <= 0 || eof > 0)) stream_flush(st);
+  if (eof > 0) stream_reap();
+}
+
+/**
+* pm_output_set_forwarder
+* @params
+*   pm_output_forward_cb cb - Sends a chunk of output to Erlang
+*   int ms - How long output may be held back to send it in bigger frames
+**/
+void pm_output_set_forwarder(pm_output_forward_cb cb, int ms)
+{
+  forwarder = cb;
+  coalesce_ms = ms;
+}
+
+/**
+* How long the loop can sleep before some held back output is due
+* @return
+*   int - milliseconds, or -1 when nothing is waiting to go out
+**/
+int pm_output_next_timeout()
+{
+  pm_output_stream_t *st;
+  long now, next = -1;
+  if (congested) return -1;
+  for (st = streams; st != NULL; st = st->next) {
+    if (st->len == 0) continue;
+    if (next < 0 || st->deadline < next) next = st->deadline;
+  }
+  if (next < 0) return -1;
+  now = now_ms();
+  return next <= now ? 0 : (int)(next - now);
+}
+
+/**
+* Send everything whose coalescing window ran out
+**/
+void pm_output_flush_due()
+{
+  pm_output_stream_t *st;
+  long now = now_ms();
+  for (st = streams; st != NULL && !congested; st = st->next)
+    if (st->len > 0 && st->deadline <= now) stream_flush(st);
+  stream_reap();
+}
+
+/**
+* Pull everything pid has written so far and send it, so its output
+* arrives before the news that it exited
+**/
+void pm_output_flush_pid(pid_t pid)
+{
+  pm_output_stream_t *st;
+  int eof;
+  for (st = streams; st != NULL && !congested; st = st->next) {
+    if (st->pid != pid) continue;
+    if ((eof = stream_read(st)) < 0) break;
+    if (eof > 0) stream_close(st);
+    stream_flush(st);
+  }
+  stream_reap();
+}
+
+/**
+* The port drained, send what was held back and start reading again
+**/
+void pm_output_resume_forwarding()
+{
+  pm_output_stream_t *st;
+  congested = 0;
+  for (st = streams; st != NULL; st = st->next)
+    if (st->len > 0 && (st->fd < 0 || st->deadline <= now_ms()) && stream_flush(st)) return;
+  set_congested(0);
+  stream_reap();
+}
+
+static int attach_stream(pm_output_t *out, pid_t pid, int which)
+{
+  pm_output_stream_t *st = (pm_output_stream_t *) calloc(1, sizeof(pm_output_stream_t));
+  if (st == NULL) {
+    close(out->pipe[0]);
+    return -1;
+  }
+  st->fd = out->pipe[0];
+  st->pid = pid;
+  st->which = which;
+  if (pm_loop_add(st->fd, congested ? 0 : PM_LOOP_READ, stream_readable, st) < 0) {
+    close(st->fd);
+    free(st);
+    return -1;
+  }
+  st->next = streams;
+  streams = st;
+  return 0;
+}
+
+/**
+* pm_output_attach
+* @description
+*   Called in the daemon once the child is running. Hands the read end of
+*   a pipe or erlang target to the event loop, which keeps it flowing
+* @params
+*   pm_output_t* out - The target
+*   pid_t pid - The child
+*   int fd - 1 or 2, the fd of the child out is for
+* @return
+*   int - 0 on success or -1 on failure
+**/
+int pm_output_attach(pm_output_t *out, pid_t pid, int fd)
+{
+  pm_output_sink_t *sink;
+
+  if (out->mode != PM_OUTPUT_PIPE && out->mode != PM_OUTPUT_ERLANG) return 0;
+  close(out->pipe[1]);
+  out->pipe[1] = -1;
+  
+  if (out->mode == PM_OUTPUT_ERLANG) return attach_stream(out, pid, fd);
+
+  if ((sink = find_or_open_sink(out->path)) == NULL) {
+    perror("pm_output_attach");
+    close(out->pipe[0]);
+    return -1;
+  }
+  if (pm_loop_add(out->pipe[0], PM_LOOP_READ, sink_readable, sink) < 0) {
+    close(out->pipe[0]);
+    if (sink->refs == 0) {
+      sink->refs = 1;
+      sink_release(sink);
+    }
+    return -1;
+  }
+  sink->refs++;
+  return 0;
+}
+
+/**
+* The child never started, throw the pipe away
+**/
+void pm_output_abandon(pm_output_t *out)
+{
+  if (out->pipe[0] >= 0) close(out->pipe[0]);
+  if (out->pipe[1] >= 0) close(out->pipe[1]);
+  out->pipe[0] = out->pipe[1] = -1;
+}
+
+/**
+* pm_output_set_rotation
+* @params
+*   off_t size - Rotate a pipe target once it grows past size bytes, 0 never rotates
+*   int count - How many rotated files to keep around, 0 truncates in place
+**/
+void pm_output_set_rotation(off_t size, int count)
+{
+  rotate_size = size;
+  rotate_count = count;
+}
@@ -0,0 +1,59 @@
+#ifndef PM_OUTPUT_H
+#define PM_OUTPUT_H
+
+#include <sys/types.h>
+#include <spawn.h>
+
+/**
+* Output routing
+* Where fds 1 and 2 of a child go, given as the stdout and stderr options:
+*   "/path" or "file:/path"   truncate and write to path
+*   "append:/path"            append to path
+*   "null"                    /dev/null
+*   "pipe:/path"              a pipe read by the daemon, which splices it
+*                             into path and rotates path as it grows
+*   "erlang"                  a pipe read by the daemon, which forwards it
+*                             to Erlang as {0, {stdout|stderr, OsPid, Binary}}
+*   "stdout"                  (stderr only) wherever stdout goes
+* Without an option stdout is appended to outputFile and stderr follows stdout
+**/
+
+#ifndef PM_OUTPUT_ROTATE_SIZE
+#define PM_OUTPUT_ROTATE_SIZE (10 * 1024 * 1024)
+#endif
+#ifndef PM_OUTPUT_ROTATE_COUNT
+#define PM_OUTPUT_ROTATE_COUNT 5
+#endif
+/* Most output held back per stream while coalescing, keeps frames well under {packet, 2} */
+#ifndef PM_OUTPUT_COALESCE_SZ
+#define PM_OUTPUT_COALESCE_SZ 32768
+#endif
+
+/* Types */
+enum OutputModeT {PM_OUTPUT_FILE, PM_OUTPUT_APPEND, PM_OUTPUT_NULL, PM_OUTPUT_PIPE, PM_OUTPUT_ERLANG, PM_OUTPUT_STDOUT};
+
+typedef struct _pm_output_t_ {
+  enum OutputModeT  mode;
+  const char*       path;       // points into the spec (or at outputFile), not owned
+  int               pipe[2];    // only used by PM_OUTPUT_PIPE and PM_OUTPUT_ERLANG
+} pm_output_t;
+
+/* Hands a chunk of output to Erlang, returns -1 (and keeps nothing) when the port is congested */
+typedef int (*pm_output_forward_cb)(pid_t pid, int fd, const char *buf, int len);
+
+/* External exports */
+int pm_output_parse(const char *spec, int fd, pm_output_t *out);
+int pm_output_prepare(pm_output_t *out);
+int pm_output_apply(pm_output_t *out, int fd);
+int pm_output_spawn_actions(posix_spawn_file_actions_t *actions, pm_output_t *out, int fd);
+int pm_output_attach(pm_output_t *out, pid_t pid, int fd);
+void pm_output_abandon(pm_output_t *out);
+void pm_output_set_rotation(off_t size, int count);
+
+void pm_output_set_forwarder(pm_output_forward_cb cb, int coalesce_ms);
+int pm_output_next_timeout();
+void pm_output_flush_due();
+void pm_output_flush_pid(pid_t pid);
+void pm_output_resume_forwarding();
+
+#endif
@@ -0,0 +1,188 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "pm_loop.h"
+#include "pm_spawner.h"
+#include "process_manager.h"
+
+/* Jobs waiting on a worker, first in first out */
+static pm_spawn_job_t*    queue_head = NULL;
+static pm_spawn_job_t*    queue_tail = NULL;
+static pthread_mutex_t    queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t     queue_cond = PTHREAD_COND_INITIALIZER;
+static int                stopping = 0;
+
+/* Finished jobs, pushed by any worker and taken all at once by the loop */
+static pm_spawn_job_t* volatile finished = NULL;
+static int                wake_pipe[2] = {-1, -1};
+
+static pthread_t          workers[PM_SPAWN_MAX_THREADS];
+static int                worker_count = 0;
+static int                in_flight = 0;      // Only touched by the loop thread
+static pm_spawn_done_cb   done_cb = NULL;
+
+static void push_finished(pm_spawn_job_t *job)
+{
+  pm_spawn_job_t *head;
+  do {
+    head = finished;
+    job->next = head;
+  } while (!__sync_bool_compare_and_swap(&finished, head, job));
+
+  // Only the push onto an empty stack has to wake the loop up
+  if (head == NULL) {
+    char c = 0;
+    while (write(wake_pipe[1], &c, 1) < 0 && errno == EINTR) ;
+  }
+}
+
+static pm_spawn_job_t* take_finished()
+{
+  pm_spawn_job_t *job, *prev = NULL, *next;
+  job = __sync_lock_test_and_set(&finished, NULL);
+  // Came off of a stack, put them back in the order they finished
+  for (; job != NULL; job = next) {
+    next = job->next;
+    job->next = prev;
+    prev = job;
+  }
+  return prev;
+}
+
+static void* worker_main(void *arg)
+{
+  pm_spawn_job_t *job;
+  sigset_t sigset;
+
+  // Every signal is the loop's business
+  sigfillset(&sigset);
+  pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+  for (;;) {
+    pthread_mutex_lock(&queue_lock);
+    while (queue_head == NULL && !stopping) pthread_cond_wait(&queue_cond, &queue_lock);
+    if (queue_head == NULL) {
+      pthread_mutex_unlock(&queue_lock);
+      return NULL;
+    }
+    job = queue_head;
+    if ((queue_head = job->next) == NULL) queue_tail = NULL;
+    pthread_mutex_unlock(&queue_lock);
+
+    errno = 0;
+    job->pid = pm_execute_outputs(job->should_wait, job->command, job->cd, job->nice, job->cgroup, job->env,
+                                  job->stdout_spec, job->stderr_spec, job->out);
+    job->err = job->pid < 0 ? errno : 0;
+    push_finished(job);
+  }
+}
+
+static void spawner_readable(int fd, int events, void *data)
+{
+  char buf[64];
+  pm_spawn_job_t *job, *next;
+
+  while (read(fd, buf, sizeof(buf)) > 0) ;
+  for (job = take_finished(); job != NULL; job = next) {
+    next = job->next;
+    in_flight--;
+    done_cb(job);
+  }
+}
+
+/**
+* pm_spawner_start
+* @description
+*   Start threads workers, done is called off of the loop with every job
+*   that went through one of them
+* @return
+*   int - 0 on success, -1 if the workers could not be started
+**/
+int pm_spawner_start(int threads, pm_spawn_done_cb done)
+{
+  if (threads <= 0 || worker_count > 0) return 0;
+  if (threads > PM_SPAWN_MAX_THREADS) threads = PM_SPAWN_MAX_THREADS;
+
+  if (pipe(wake_pipe) < 0) return -1;
+  fcntl(wake_pipe[0], F_SETFL, fcntl(wake_pipe[0], F_GETFL) | O_NONBLOCK);
+  fcntl(wake_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(wake_pipe[1], F_SETFD, FD_CLOEXEC);
+  if (pm_loop_add(wake_pipe[0], PM_LOOP_READ, spawner_readable, NULL)) {
+    close(wake_pipe[0]); close(wake_pipe[1]);
+    return -1;
+  }
+
+  done_cb = done;
+  stopping = 0;
+  for (worker_count = 0; worker_count < threads; worker_count++) {
+    if (pthread_create(&workers[worker_count], NULL, worker_main, NULL)) break;
+  }
+  if (worker_count == 0) {
+    pm_loop_remove(wake_pipe[0]);
+    close(wake_pipe[0]); close(wake_pipe[1]);
+    return -1;
+  }
+  return 0;
+}
+
+int pm_spawner_running()
+{
+  return worker_count > 0;
+}
+
+/**
+* Hand a job over to the workers, it comes back through the done callback
+**/
+int pm_spawner_submit(pm_spawn_job_t *job)
+{
+  if (worker_count == 0) return -1;
+  job->next = NULL;
+  in_flight++;
+
+  pthread_mutex_lock(&queue_lock);
+  if (queue_tail) queue_tail->next = job;
+  else queue_head = job;
+  queue_tail = job;
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+  return 0;
+}
+
+/**
+* Jobs submitted that haven't been handed to done yet
+**/
+int pm_spawner_in_flight()
+{
+  return in_flight;
+}
+
+/**
+* Let the workers finish what they have and wait for them to go
+**/
+void pm_spawner_stop()
+{
+  int i;
+  if (worker_count == 0) return;
+
+  pthread_mutex_lock(&queue_lock);
+  stopping = 1;
+  pthread_cond_broadcast(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+  for (i = 0; i < worker_count; i++) pthread_join(workers[i], NULL);
+  worker_count = 0;
+
+  spawner_readable(wake_pipe[0], PM_LOOP_READ, NULL);
+  pm_loop_remove(wake_pipe[0]);
+  close(wake_pipe[0]);
+  close(wake_pipe[1]);
+  wake_pipe[0] = wake_pipe[1] = -1;
+}
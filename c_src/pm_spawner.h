@@ -0,0 +1,52 @@
+#ifndef PM_SPAWNER_H
+#define PM_SPAWNER_H
+
+#include <sys/types.h>
+
+#include "pm_output.h"
+#include "pm_cgroup.h"
+
+/**
+* Spawn workers
+* fork/exec, the chdir, opening output files and the script fd of a
+* stage all happen on a pool of worker threads, so a slow spawn never
+* holds up the loop. Jobs go to the workers on a mutex/condvar queue,
+* finished jobs come back on a lock-free stack and the loop is woken up
+* through a pipe to pick them up. Every finished job is handed to the
+* done callback on the loop thread, nothing else ever runs on a worker
+**/
+
+#ifndef PM_SPAWN_THREADS
+#define PM_SPAWN_THREADS 4
+#endif
+#define PM_SPAWN_MAX_THREADS 64
+
+/* Types */
+typedef struct _pm_spawn_job_t_ {
+  // What to run, all owned by the caller and left alone until done
+  int           should_wait;
+  const char*   command;
+  const char*   cd;
+  int           nice;
+  const pm_cgroup_limits_t* cgroup;
+  const char**  env;
+  const char*   stdout_spec;
+  const char*   stderr_spec;
+  // What came of it
+  pid_t         pid;
+  int           err;          // errno when pid is -1
+  pm_output_t   out[2];       // Left for the loop thread to attach
+  void*         data;
+  struct _pm_spawn_job_t_ *next;
+} pm_spawn_job_t;
+
+typedef void (*pm_spawn_done_cb)(pm_spawn_job_t *job);
+
+/* External exports */
+int pm_spawner_start(int threads, pm_spawn_done_cb done);
+int pm_spawner_running();
+int pm_spawner_submit(pm_spawn_job_t *job);
+int pm_spawner_in_flight();
+void pm_spawner_stop();
+
+#endif
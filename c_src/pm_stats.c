@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "uthash.h"
+#include "pm_stats.h"
+
+typedef struct _pm_proc_dir_t_ {
+  pid_t pid;                  // key
+  int   fd;                   // /proc/<pid>
+  UT_hash_handle hh;          // makes this structure hashable
+} pm_proc_dir_t;
+
+static pm_proc_dir_t* proc_dirs = NULL;
+static char           sample_buf[4096];     // Every file is read into this one
+
+/* Read name under the /proc/<pid> directory dir_fd into sample_buf */
+static int read_proc_file(int dir_fd, const char *name)
+{
+  int fd, err;
+  ssize_t len;
+  if ((fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC)) < 0) return -1;
+  len = pread(fd, sample_buf, sizeof(sample_buf) - 1, 0);
+  err = errno;
+  close(fd);
+  if (len < 0) {
+    errno = err;
+    return -1;
+  }
+  sample_buf[len] = '\0';
+  return 0;
+}
+
+/* "key: value" out of a file like io */
+static unsigned long long keyed_value(const char *key)
+{
+  size_t len = strlen(key);
+  const char *line = sample_buf;
+  while (line != NULL) {
+    if (!strncmp(line, key, len) && line[len] == ':') return strtoull(line + len + 1, NULL, 10);
+    if ((line = strchr(line, '\n')) != NULL) line++;
+  }
+  return 0;
+}
+
+/* The first n fields of the stat in sample_buf from field 4 on, the one after (comm) and the state */
+static int stat_fields(unsigned long long *fields, int n)
+{
+  char *p = strrchr(sample_buf, ')');
+  int i;
+
+  if (p == NULL || p[1] == '\0') return -1;
+  // Skip the state, it's the one field that isn't a number
+  p += 3;
+  for (i = 0; i < n; i++) fields[i] = strtoull(p, &p, 10);
+  return 0;
+}
+
+/* utime, stime and num_threads out of stat */
+static int parse_stat(pm_stats_t *stats)
+{
+  static long ticks = 0;
+  unsigned long long fields[18];
+
+  if (stat_fields(fields, 18)) return -1;
+  if (ticks == 0) ticks = sysconf(_SC_CLK_TCK);
+  // Fields 14, 15 and 20 of stat
+  stats->utime_ms = fields[10] * 1000 / ticks;
+  stats->stime_ms = fields[11] * 1000 / ticks;
+  stats->threads = (int)fields[16];
+  return 0;
+}
+
+static int count_fds(int dir_fd)
+{
+  struct dirent *entry;
+  DIR *dir;
+  int fd, n = 0;
+  if ((fd = openat(dir_fd, "fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) return -1;
+  if ((dir = fdopendir(fd)) == NULL) {
+    close(fd);
+    return -1;
+  }
+  while ((entry = readdir(dir)) != NULL)
+    if (entry->d_name[0] != '.') n++;
+  closedir(dir);
+  return n;
+}
+
+static int sample_dir(int dir_fd, pm_stats_t *stats)
+{
+  static long page_size = 0;
+  unsigned long long pages = 0;
+
+  if (read_proc_file(dir_fd, "stat") || parse_stat(stats)) return -1;
+  if (page_size == 0) page_size = sysconf(_SC_PAGESIZE);
+  if (read_proc_file(dir_fd, "statm") == 0 && sscanf(sample_buf, "%*u %llu", &pages) == 1)
+    stats->rss = pages * page_size;
+  // Only there with task io accounting, and only for processes we may trace
+  if (read_proc_file(dir_fd, "io") == 0) {
+    stats->read_bytes = keyed_value("read_bytes");
+    stats->write_bytes = keyed_value("write_bytes");
+  }
+  stats->fds = count_fds(dir_fd);
+  return 0;
+}
+
+static int open_proc_dir(pid_t pid)
+{
+  char path[32];
+  snprintf(path, sizeof(path), "/proc/%d", pid);
+  return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/**
+* pm_stats_sample
+* @description
+*   Sample pid into stats. With cache set the /proc directory of pid is
+*   kept open for the next sample, until pm_stats_forget(pid)
+* @return
+*   int - 0, or -1 with stats->err (and errno) set when pid can't be sampled
+**/
+int pm_stats_sample(pid_t pid, int cache, pm_stats_t *stats)
+{
+  pm_proc_dir_t *dir = NULL;
+  int fd, ret;
+
+  memset(stats, 0, sizeof(pm_stats_t));
+  stats->pid = pid;
+  if (pid < 1) {
+    stats->err = errno = ESRCH;
+    return -1;
+  }
+
+  if (proc_dirs) HASH_FIND_INT(proc_dirs, &pid, dir);
+  if (dir) {
+    fd = dir->fd;
+  } else if ((fd = open_proc_dir(pid)) < 0) {
+    stats->err = errno == ENOENT ? ESRCH : errno;
+    errno = stats->err;
+    return -1;
+  }
+
+  // A cached directory of a process that's gone reads as ESRCH
+  if ((ret = sample_dir(fd, stats)) < 0) stats->err = errno == ENOENT ? ESRCH : errno;
+
+  if (dir == NULL) {
+    if (cache && ret == 0 && HASH_COUNT(proc_dirs) < PM_STATS_CACHE_MAX &&
+        (dir = (pm_proc_dir_t *) calloc(1, sizeof(pm_proc_dir_t))) != NULL) {
+      dir->pid = pid;
+      dir->fd = fd;
+      HASH_ADD_INT(proc_dirs, pid, dir);
+    } else {
+      close(fd);
+    }
+  }
+  if (ret < 0) errno = stats->err;
+  return ret;
+}
+
+/* pid was reaped, let go of its directory */
+void pm_stats_forget(pid_t pid)
+{
+  pm_proc_dir_t *dir;
+  if (proc_dirs == NULL) return;
+  HASH_FIND_INT(proc_dirs, &pid, dir);
+  if (dir == NULL) return;
+  HASH_DEL(proc_dirs, dir);
+  close(dir->fd);
+  free(dir);
+}
+
+/* The process group out of a stat in sample_buf */
+static pid_t stat_pgrp()
+{
+  char *p = strrchr(sample_buf, ')');
+  int ppid, pgrp;
+  if (p == NULL || sscanf(p + 1, " %*c %d %d", &ppid, &pgrp) != 2) return -1;
+  return pgrp;
+}
+
+/**
+* pm_stats_count_descendants
+* @description
+*   Fill in the descendants of every pid in stats that could be sampled:
+*   the processes in the group it leads, other than itself. That's one
+*   pass over all of /proc for the lot of them, so they're counted
+*   together rather than per sample
+* @return
+*   int - 0, or -1 with errno set when /proc can't be read
+**/
+int pm_stats_count_descendants(pm_stats_t *stats, int size)
+{
+  struct dirent *entry;
+  DIR *proc;
+  char name[32];
+  pid_t pid, pgrp;
+  int i, wanted = 0;
+
+  for (i = 0; i < size; i++) {
+    stats[i].descendants = 0;
+    if (!stats[i].err) wanted++;
+  }
+  if (wanted == 0) return 0;
+  if ((proc = opendir("/proc")) == NULL) return -1;
+  while ((entry = readdir(proc)) != NULL) {
+    if (entry->d_name[0] < '1' || entry->d_name[0] > '9') continue;
+    pid = atoi(entry->d_name);
+    snprintf(name, sizeof(name), "%d/stat", pid);
+    // Gone since the readdir, or not ours to read
+    if (read_proc_file(dirfd(proc), name) || (pgrp = stat_pgrp()) < 1 || pgrp == pid) continue;
+    for (i = 0; i < size; i++)
+      if (stats[i].pid == pgrp && !stats[i].err) stats[i].descendants++;
+  }
+  closedir(proc);
+  return 0;
+}
+
+/**
+* pm_stats_start_time
+* @description
+*   When pid started, in clock ticks after boot. Together with the pid
+*   that names a process for good, a pid that's reused starts later
+* @return
+*   int - 0, or -1 with errno set when pid isn't there
+**/
+int pm_stats_start_time(pid_t pid, unsigned long long *start_time)
+{
+  unsigned long long fields[19];
+  char name[32];
+  snprintf(name, sizeof(name), "/proc/%d/stat", pid);
+  if (pid < 1 || read_proc_file(AT_FDCWD, name)) {
+    errno = ESRCH;
+    return -1;
+  }
+  if (stat_fields(fields, 19)) {
+    errno = EINVAL;
+    return -1;
+  }
+  // Field 22
+  *start_time = fields[18];
+  return 0;
+}
+
+int pm_stats_cached()
+{
+  return HASH_COUNT(proc_dirs);
+}
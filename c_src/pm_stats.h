@@ -0,0 +1,47 @@
+#ifndef PM_STATS_H
+#define PM_STATS_H
+
+#include <sys/types.h>
+
+#include "pm_cgroup.h"
+
+/**
+* Process sampling
+* What a child is using right now, read out of /proc/<pid>/stat, statm,
+* io and fd. The /proc/<pid> directory of a child is opened once and
+* kept until the child is reaped, every sample after that is an openat
+* and a pread into the same buffer per file. The directory stays with
+* the process it was opened for, a pid that's reused never reads back
+* as the old child. Every child leads a process group of its own, the
+* rest of the group is counted as its descendants
+**/
+
+/* Directories kept open, past this pids are opened and closed per sample */
+#ifndef PM_STATS_CACHE_MAX
+#define PM_STATS_CACHE_MAX    1024
+#endif
+
+/* Types */
+typedef struct _pm_stats_t_ {
+  pid_t               pid;
+  int                 err;            // errno when it couldn't be sampled, 0 otherwise
+  unsigned long long  rss;            // bytes
+  unsigned long long  utime_ms;
+  unsigned long long  stime_ms;
+  int                 threads;
+  int                 fds;
+  unsigned long long  read_bytes;     // that went to or came from storage
+  unsigned long long  write_bytes;
+  int                 descendants;    // in its process group, see pm_stats_count_descendants
+  int                 limited;        // 1 when it runs in a leaf of its own and cgroup holds what the leaf used
+  pm_cgroup_usage_t   cgroup;
+} pm_stats_t;
+
+/* External exports */
+int pm_stats_sample(pid_t pid, int cache, pm_stats_t *stats);
+void pm_stats_forget(pid_t pid);
+int pm_stats_count_descendants(pm_stats_t *stats, int size);
+int pm_stats_start_time(pid_t pid, unsigned long long *start_time);
+int pm_stats_cached();
+
+#endif
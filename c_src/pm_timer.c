@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "pm_timer.h"
+
+#define SLOT_MASK     (PM_TIMER_SLOTS - 1)
+#define LEVEL_SPAN(l) (1UL << (PM_TIMER_SLOT_BITS * (l)))
+
+static pm_timer_t*    wheel[PM_TIMER_LEVELS][PM_TIMER_SLOTS];
+static unsigned long  cur_tick = 0;       // Last tick that has been run
+static int            started = 0;
+static int            count = 0;
+
+long pm_timer_now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/* With nothing on the wheel it can be set to any time at all */
+static void start(long now_ms)
+{
+  if (started && count > 0) return;
+  cur_tick = (unsigned long)now_ms / PM_TIMER_TICK_MS;
+  started = 1;
+}
+
+static void link_timer(pm_timer_t **head, pm_timer_t *timer)
+{
+  if ((timer->next = *head) != NULL) timer->next->pprev = &timer->next;
+  timer->pprev = head;
+  *head = timer;
+}
+
+static void unlink_timer(pm_timer_t *timer)
+{
+  if (timer->next) timer->next->pprev = timer->pprev;
+  *timer->pprev = timer->next;
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+/* Onto the fastest wheel that turns far enough to hold it */
+static void place(pm_timer_t *timer)
+{
+  unsigned long delta;
+  int level;
+
+  if (timer->expires <= cur_tick) timer->expires = cur_tick + 1;
+  delta = timer->expires - cur_tick;
+  for (level = 0; level < PM_TIMER_LEVELS - 1; level++)
+    if (delta < LEVEL_SPAN(level + 1)) break;
+  // Further off than the wheels reach (a couple of days), it's cut short to the far end
+  if (delta >= LEVEL_SPAN(PM_TIMER_LEVELS)) timer->expires = cur_tick + LEVEL_SPAN(PM_TIMER_LEVELS) - 1;
+  link_timer(&wheel[level][(timer->expires >> (PM_TIMER_SLOT_BITS * level)) & SLOT_MASK], timer);
+}
+
+/* Move every timer in a slot of a slower wheel down to where it belongs now */
+static int cascade(int level, int slot)
+{
+  pm_timer_t *timer, *next;
+  timer = wheel[level][slot];
+  wheel[level][slot] = NULL;
+  for (; timer != NULL; timer = next) {
+    next = timer->next;
+    timer->pprev = NULL;
+    place(timer);
+  }
+  return slot;
+}
+
+/**
+* pm_timer_add
+* @description
+*   Call cb with data in ms milliseconds (rounded up to a tick). timer has
+*   to stay put until it fires or is cancelled, adding a pending timer
+*   moves it
+* @return
+*   int - 0
+**/
+int pm_timer_add(pm_timer_t *timer, long ms, pm_timer_cb cb, void *data)
+{
+  long now = pm_timer_now_ms();
+  start(now);
+  if (timer->pprev) pm_timer_cancel(timer);
+  if (ms < 0) ms = 0;
+  timer->expires = (unsigned long)(now + ms + PM_TIMER_TICK_MS - 1) / PM_TIMER_TICK_MS;
+  timer->cb = cb;
+  timer->data = data;
+  place(timer);
+  count++;
+  return 0;
+}
+
+int pm_timer_pending(pm_timer_t *timer)
+{
+  return timer->pprev != NULL;
+}
+
+void pm_timer_cancel(pm_timer_t *timer)
+{
+  if (timer->pprev == NULL) return;
+  unlink_timer(timer);
+  count--;
+}
+
+/**
+* pm_timer_next_timeout
+* @description
+*   How long the loop can sleep before a timer could be due. Only the
+*   first wheel is looked at, when nothing is on it before it comes back
+*   around the wait is up to where the next slot of a slower one cascades
+* @return
+*   int - milliseconds, or -1 when there are no timers at all
+**/
+int pm_timer_next_timeout()
+{
+  unsigned long tick;
+  long now, due;
+
+  if (count == 0) return -1;
+  for (tick = cur_tick + 1; ; tick++)
+    if (wheel[0][tick & SLOT_MASK] != NULL || (tick & SLOT_MASK) == 0) break;
+  now = pm_timer_now_ms();
+  due = (long)(tick * PM_TIMER_TICK_MS);
+  return due <= now ? 0 : (int)(due - now);
+}
+
+/**
+* pm_timer_advance
+* @description
+*   Run every tick up to now_ms, calling the timers that are due. Timers
+*   may add or cancel timers, themselves included, from their callback
+* @return
+*   int - number of timers that fired
+**/
+int pm_timer_advance(long now_ms)
+{
+  unsigned long target = (unsigned long)now_ms / PM_TIMER_TICK_MS;
+  pm_timer_t *due, *timer;
+  int fired = 0, level;
+
+  if (!started) start(now_ms);
+  while (cur_tick < target) {
+    // Nothing to wait on, skip straight to now
+    if (count == 0) {
+      cur_tick = target;
+      break;
+    }
+    cur_tick++;
+    // The first wheel came around, bring down the next slot of the wheel above (and so on)
+    for (level = 1; level < PM_TIMER_LEVELS; level++)
+      if ((cur_tick & (LEVEL_SPAN(level) - 1)) != 0 ||
+          cascade(level, (cur_tick >> (PM_TIMER_SLOT_BITS * level)) & SLOT_MASK) != 0) break;
+
+    if ((due = wheel[0][cur_tick & SLOT_MASK]) == NULL) continue;
+    // Take the slot off of the wheel, so anything added from a callback waits for its own tick
+    wheel[0][cur_tick & SLOT_MASK] = NULL;
+    due->pprev = &due;
+    while ((timer = due) != NULL) {
+      unlink_timer(timer);
+      count--;
+      fired++;
+      timer->cb(timer->data);
+    }
+  }
+  return fired;
+}
+
+int pm_timer_run_due()
+{
+  return pm_timer_advance(pm_timer_now_ms());
+}
+
+int pm_timer_count()
+{
+  return count;
+}
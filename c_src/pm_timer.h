@@ -0,0 +1,43 @@
+#ifndef PM_TIMER_H
+#define PM_TIMER_H
+
+/**
+* Timer wheel
+* Deadlines (the grace period of a stop, for one) go into a hierarchical
+* timing wheel: PM_TIMER_LEVELS wheels of PM_TIMER_SLOTS slots each, one
+* tick of the first wheel is PM_TIMER_TICK_MS and every wheel after it
+* turns PM_TIMER_SLOTS times slower. Adding or cancelling a timer is
+* O(1), and a tick only looks at the one slot that's due, plus moving
+* the next slot of a slower wheel down whenever a faster one comes
+* around. Timers live in whatever they time, the wheel only links them up
+**/
+
+#ifndef PM_TIMER_TICK_MS
+#define PM_TIMER_TICK_MS      10
+#endif
+#define PM_TIMER_SLOT_BITS    6
+#define PM_TIMER_SLOTS        (1 << PM_TIMER_SLOT_BITS)
+#define PM_TIMER_LEVELS       4
+
+/* Types */
+typedef void (*pm_timer_cb)(void *data);
+
+typedef struct _pm_timer_t_ {
+  unsigned long         expires;    // Tick it's due on
+  pm_timer_cb           cb;
+  void*                 data;
+  struct _pm_timer_t_*  next;
+  struct _pm_timer_t_** pprev;      // NULL while it isn't on the wheel
+} pm_timer_t;
+
+/* External exports */
+long pm_timer_now_ms();
+int pm_timer_add(pm_timer_t *timer, long ms, pm_timer_cb cb, void *data);
+int pm_timer_pending(pm_timer_t *timer);
+void pm_timer_cancel(pm_timer_t *timer);
+int pm_timer_next_timeout();
+int pm_timer_advance(long now_ms);
+int pm_timer_run_due();
+int pm_timer_count();
+
+#endif
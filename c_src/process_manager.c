@@ -1,16 +1,49 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
 #include "process_manager.h"
+#include "pm_loop.h"
+#ifdef __linux__
+#include <sys/mman.h>             // For memfd_create
+#include <sys/prctl.h>            // For PR_SET_CHILD_SUBREAPER
+#include <sys/syscall.h>          // For pidfd_open
+#endif
+#include <dirent.h>               // For the children of every thread
+#include <pthread.h>              // For the abandoned children spawn workers leave
 
-process_struct*     running_children;
-process_struct*     exited_children;
-sigjmp_buf          saved_jump_buf;
-int                 pm_can_jump = 0;
+pm_child_table_t    running_children;
 int                 terminated = 0;
-int                 signaled   = 0;     // indicates that SIGCHLD was signaled
 int                 dbg = 0;
+enum ReapModeT      reap_mode = PM_REAP_DRAIN;
+enum SpawnModeT     spawn_mode = PM_SPAWN_AUTO;
+static int          subreaper = 0;
+static const char*  empty_env[] = {NULL};
 char*               outputFile = "/tmp/babysitter.log";
 
 static int safe_chdir(const char *);
+static void child_failed(const char *msg, int status);
+
+/* What child_changed_status gets told about entry i of t */
+static void child_view(pm_child_table_t *t, int i, process_struct *ps)
+{
+  ps->pid = t->pid[i];
+  ps->kill_pid = t->kill_pid[i];
+  ps->deadline = t->deadline[i];
+  ps->status = t->status[i];
+  ps->signal = t->signal[i];
+  ps->transId = t->transId[i];
+}
+
+static void adopted_forget(pid_t pid);
 
+/* pid is gone for good, let go of everything that was kept for it */
+static void child_reaped(pid_t pid)
+{
+  pm_cgroup_release(pid);
+  pm_stats_forget(pid);
+  pm_journal_remove(pid);
+  adopted_forget(pid);
+}
 
 int pm_check_pid_status(pid_t pid)
 {
@@ -29,21 +62,39 @@ int pm_check_pid_status(pid_t pid)
 int pm_add_env(process_t **ptr, char* value)
 {
   process_t *p = *ptr;
-  int old_size = p->env_c;
+  char *copy = p->arena ? pm_arena_strdup(p->arena, value) : strdup(value);
+  if (copy == NULL) return -1;
+  if (pm_take_env(p, copy)) {
+    if (!p->arena) free(copy);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+* pm_take_env
+* @description
+*   Add value to the env of p without copying it, value has to come out of
+*   pm_process_alloc. There is always room left for the NULL that ends the env
+**/
+int pm_take_env(process_t *p, char* value)
+{
   // Expand space, if necessary
-  if (p->env_c == p->env_capacity) {
-    if (p->env_capacity == 0) p->env_capacity = 1 * sizeof(char*);
-    int new_size = (p->env_capacity *= 2) * sizeof(char*);
-    void *new_env = (char**)realloc(p->env, new_size);
-    if (new_env != NULL) {
-      p->env = new_env;
-      // Clear out the new mem
-      p->env[old_size+1] = NULL;
+  if (p->env_c + 1 >= p->env_capacity) {
+    int new_capacity = p->env_capacity ? p->env_capacity * 2 : 8;
+    char **new_env;
+    if (p->arena) {
+      // The old vector stays in the arena until the request is through
+      if ((new_env = (char **) pm_arena_alloc(p->arena, new_capacity * sizeof(char*))) == NULL) return -1;
+      if (p->env_c) memcpy(new_env, p->env, p->env_c * sizeof(char*));
     } else {
-      return -1; // Something is SERIOUSLY wrong
+      if ((new_env = (char **) realloc(p->env, new_capacity * sizeof(char*))) == NULL) return -1; // Something is SERIOUSLY wrong
     }
+    p->env = new_env;
+    p->env_capacity = new_capacity;
   }
-  p->env[p->env_c++] = strdup(value);
+  p->env[p->env_c++] = value;
+  p->env[p->env_c] = NULL;
   return 0;
 }
 
@@ -64,11 +115,86 @@ int pm_new_process(process_t **ptr)
   p->command = NULL;
   p->before = NULL;
   p->after = NULL;
+  p->arena = NULL;
+  p->signal = SIGKILL;
   
   *ptr = p;
   return 0;
 }
 
+/**
+* pm_new_process_in
+* @description
+*   A new process out of arena. Everything set on it goes into the arena as
+*   well and pm_free_process leaves it all to the arena
+**/
+int pm_new_process_in(pm_arena_t *arena, process_t **ptr)
+{
+  process_t *p;
+  if (arena == NULL) return pm_new_process(ptr);
+  if ((p = (process_t *) pm_arena_calloc(arena, sizeof(process_t))) == NULL) {
+    perror("Could not allocate enough memory to make a new process.\n");
+    return -1;
+  }
+  p->arena = arena;
+  p->signal = SIGKILL;
+  *ptr = p;
+  return 0;
+}
+
+static int clone_string(char **dst, const char *src)
+{
+  if (src == NULL) return 0;
+  return (*dst = strdup(src)) == NULL ? -1 : 0;
+}
+
+/**
+* pm_clone_process
+* @description
+*   A malloced copy of what it takes to run p again, for keeping around
+*   after the request (and the arena) p came in with is gone
+* @return
+*   process_t* - the copy, or NULL when out of memory
+**/
+process_t* pm_clone_process(process_t *p)
+{
+  process_t *c;
+  int i, err = 0;
+
+  if (pm_new_process(&c)) return NULL;
+  c->nice = p->nice;
+  c->pid = p->pid;
+  c->signal = p->signal;
+  c->transId = p->transId;
+  c->timeout = p->timeout;
+  c->cgroup = p->cgroup;
+  c->cgroup.cpu_max = NULL;
+  c->restart = p->restart;
+  err |= clone_string(&c->command, p->command);
+  err |= clone_string(&c->before, p->before);
+  err |= clone_string(&c->after, p->after);
+  err |= clone_string(&c->cd, p->cd);
+  err |= clone_string(&c->stdout, p->stdout);
+  err |= clone_string(&c->stderr, p->stderr);
+  err |= clone_string(&c->cgroup.cpu_max, p->cgroup.cpu_max);
+  err |= clone_string(&c->app, p->app);
+  for (i = 0; i < p->env_c && !err; i++) err |= pm_add_env(&c, p->env[i]);
+  if (err) {
+    pm_free_process(c);
+    return NULL;
+  }
+  return c;
+}
+
+/**
+* Room for a string of p, out of its arena if it has one
+**/
+char* pm_process_alloc(process_t *p, size_t size)
+{
+  if (p->arena) return (char *) pm_arena_alloc(p->arena, size);
+  return (char *) malloc(size);
+}
+
 process_return_t* pm_new_process_return()
 {
   process_return_t *p = (process_return_t *)calloc(1, sizeof(process_return_t));
@@ -105,12 +231,18 @@ int pm_free_process_return(process_return_t *p)
 
 int pm_free_process(process_t *p)
 {
+  // The arena goes all at once, once the request is through
+  if (p->arena) return 0;
+  
   if (p->command) free(p->command);
   if (p->before) free(p->before);
   if (p->after) free(p->after);
   if (p->cd) free(p->cd);
   if (p->stdout) free(p->stdout);
   if (p->stderr) free(p->stderr);
+  if (p->cgroup.cpu_max) free(p->cgroup.cpu_max);
+  if (p->app) free(p->app);
+  if (p->pids) free(p->pids);
   
   int i = 0;
   for (i = 0; i < p->env_c; i++) free(p->env[i]);
@@ -121,45 +253,26 @@ int pm_free_process(process_t *p)
 }
 
 /*--- Run process ---*/
-void pm_gotsignal(int signal)
-{ 
-  switch(signal) {
-    case SIGHUP:
-      break;
-    case SIGTERM:
-    case SIGINT:
-    default:
-    break;
-  }
-}
-
-void pm_gotsigchild(int signal, siginfo_t* si, void* context)
-{
-  // If someone used kill() to send SIGCHLD ignore the event
-  if (signal != SIGCHLD) return;
-  signaled = 1;
-  // process_child_signal(si->si_pid);
-}
 /**
 * Setup signal handlers for the process
+* The daemon blocks the signals it reads off of the event loop and the
+* mask survives exec, so put everything back to the defaults in the child
 **/
 void pm_setup_signal_handlers()
 {
-  struct sigaction sact, sterm;
-  sterm.sa_handler = pm_gotsignal;
-  sigemptyset(&sterm.sa_mask);
-  sigaddset(&sterm.sa_mask, SIGCHLD);
-  sterm.sa_flags = 0;
-  sigaction(SIGINT,  &sterm, NULL);
-  sigaction(SIGTERM, &sterm, NULL);
-  sigaction(SIGHUP,  &sterm, NULL);
-  sigaction(SIGPIPE, &sterm, NULL);
+  sigset_t sigset;
+  struct sigaction sdfl;
+  sdfl.sa_handler = SIG_DFL;
+  sigemptyset(&sdfl.sa_mask);
+  sdfl.sa_flags = 0;
+  sigaction(SIGINT,  &sdfl, NULL);
+  sigaction(SIGTERM, &sdfl, NULL);
+  sigaction(SIGHUP,  &sdfl, NULL);
+  sigaction(SIGPIPE, &sdfl, NULL);
+  sigaction(SIGCHLD, &sdfl, NULL);
   
-  sact.sa_handler = NULL;
-  sact.sa_sigaction = pm_gotsigchild;
-  sigemptyset(&sact.sa_mask);
-  sact.sa_flags = SA_SIGINFO | SA_RESTART | SA_NOCLDSTOP | SA_NODEFER;
-  sigaction(SIGCHLD, &sact, NULL);
+  sigemptyset(&sigset);
+  sigprocmask(SIG_SETMASK, &sigset, NULL);
 }
 
 int pm_setup(int read_handle, int write_handle)
@@ -170,84 +283,138 @@ int pm_setup(int read_handle, int write_handle)
    */
   setmode(read_handle, O_BINARY);
   setmode(write_handle, O_BINARY);
+#else
+  // A child holding the port open would keep Erlang from ever seeing us go. stdio
+  // handles are left alone, the children expect something there
+  if (read_handle > 2) fcntl(read_handle, F_SETFD, fcntl(read_handle, F_GETFD) | FD_CLOEXEC);
+  if (write_handle > 2) fcntl(write_handle, F_SETFD, fcntl(write_handle, F_GETFD) | FD_CLOEXEC);
 #endif
   return 0;
 }
 
-int expand_command(const char* command, int* argc, char ***argv, int *using_a_script)
+/**
+* Put a "#!" script somewhere it can be exec'd from without a file on disk
+* @return
+*   int - a close-on-exec fd holding the script, read from the start,
+*   or -1 on failure. Only the child that runs it keeps it across exec,
+*   the interpreter reads it back through /dev/fd
+**/
+static int open_script_fd(const char* command)
 {
-  char **command_argv = *argv;
-  int command_argc = *argc;
-  int running_script = *using_a_script;
-  const char *full_filepath;
+  int fd = -1;
+  size_t size = strlen(command), wrote = 0;
+  ssize_t n;
   
-  if (!strncmp(command, "#!", 2)) {
-    // We are running a shell script command
-    char *filename = strdup("/tmp/babysitter.XXXXXXX");
-    int size, fd = -1;
-    FILE *sfp;
-    // Note for the future cleanup, that we'll be running a script to cleanup
-    running_script = 1;
-    
-    // Make a tempfile in the filename format
-    // printf("writing a tempfile: %s\n", filename);
-    if ((fd = mkstemp(filename)) == -1 || (sfp = fdopen(fd, "w+")) == NULL) {
-      if (fd != -1) {
-        unlink(filename);
-        close(fd);
-      }
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+  // Close-on-exec, every other worker's child would hold it forever otherwise
+  unsigned int flags = MFD_CLOEXEC;
+#ifdef MFD_EXEC
+  flags |= MFD_EXEC;
+#endif
+  fd = memfd_create("babysitter-script", flags);
+#endif
+  if (fd == -1) {
+    // No memfd, use a tempfile that is unlinked before anything runs it
+    char filename[] = "/tmp/babysitter.XXXXXXX";
+#ifdef O_CLOEXEC
+    fd = mkostemp(filename, O_CLOEXEC);
+#else
+    if ((fd = mkstemp(filename)) != -1) fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+    if (fd == -1) {
       fprintf(stderr, "Could not open tempfile: %s\n", filename);
       return -1;
     }
-    
-    size = strlen(command);
-    // Print the command into the file
-    if (fwrite(command, size, 1, sfp) == -1) {
-      fprintf(stderr, "Could not write command to tempfile: %s\n", filename);
+    unlink(filename);
+  }
+  
+  // Print the command into the file
+  while (wrote < size) {
+    if ((n = write(fd, command + wrote, size - wrote)) <= 0) {
+      if (n < 0 && errno == EINTR) continue;
+      fprintf(stderr, "Could not write command to script: %s\n", strerror(errno));
+      close(fd);
       return -1;
     }
-    fclose(sfp);
-    // Close the file descriptor
+    wrote += n;
+  }
+  
+  // Make it executable
+  if (fchmod(fd, 00700) != 0) {
+    fprintf(stderr, "Could not change permissions of the script %o\n", 00700);
+  }
+  // Where /dev/fd/N is a dup rather than a reopen the interpreter starts reading from our offset
+  if (lseek(fd, 0, SEEK_SET) < 0) {
+    fprintf(stderr, "Could not rewind the script: %s\n", strerror(errno));
     close(fd);
+    return -1;
+  }
+  return fd;
+}
 
-    // Modify the command to match call the filename
-    // should we chown?
-    /*
-		if (chown(filename, m_user, m_group) != 0) {
-#ifdef DEBUG
-     fprintf(stderr, "Could not change owner of '%s' to %d\n", m_script_file.c_str(), m_user);
-#endif
-		}
-		*/
+/**
+* The binary the first word of command runs, found the way the shell would
+* find it. NULL when there's none, the shell gets to say why
+* The spawn workers share the lookup cache, so this is a copy
+**/
+static char* direct_binary(const char* command)
+{
+  const char *cp;
+  char *cmdname, *full_filepath;
+  
+  while (isspace(*command)) command++;
+  for (cp = command; *cp && !isspace(*cp); cp++) ;
+  if ((cmdname = strndup(command, cp - command)) == NULL) return NULL;
+  if (strchr(cmdname, '/')) return cmdname;
+  full_filepath = find_binary_copy(cmdname);
+  free(cmdname);
+  return full_filepath;
+}
 
-    // Make it executable
-    if (chmod(filename, 040700) != 0) {
-      fprintf(stderr, "Could not change permissions to '%s' %o\n", filename, 040700);
-    }
+int expand_command(const char* command, int* argc, char ***argv, int *script_fd)
+{
+  char **command_argv = *argv;
+  int command_argc = *argc;
+  char *full_filepath = NULL;
+  
+  *script_fd = -1;
+  if (!strncmp(command, "#!", 2)) {
+    // We are running a shell script command
+    char filename[32];
+    if ((*script_fd = open_script_fd(command)) == -1) return -1;
+    snprintf(filename, sizeof(filename), "/dev/fd/%d", *script_fd);
 
     // Run in a new process
-    command_argv = (char **) malloc(1 * sizeof(char *));
+    command_argv = (char **) malloc(2 * sizeof(char *));
     command_argv[0] = strdup(filename);
     command_argv[1] = NULL;
     command_argc = 1;
-    free(filename);
+  } else if (!pm_needs_shell(command) && (full_filepath = direct_binary(command)) != NULL &&
+             (command_argc = argify(command, &command_argv)) > 0) {
+    // Nothing for a shell to do, so exec the binary directly and save an exec.
+    // The pid we hand back is the real process, not a shell wrapped around it
+    free(command_argv[0]);
+    command_argv[0] = full_filepath;
   } else {
+    if (full_filepath) free(full_filepath);
     int prefix;
     char *cp, *cmdname, *expanded_command;
 
     // get bare command for path lookup
     for (cp = (char *) command; *cp && !isspace(*cp); cp++) ;
     prefix = cp - command;
-    cmdname = calloc(prefix, sizeof(char));
-    strncpy(cmdname, command, prefix);
+    cmdname = calloc(prefix + 1, sizeof(char));
+    memcpy(cmdname, command, prefix);
 
     // expand command name to full path
-    full_filepath = find_binary(cmdname);
+    if ((full_filepath = find_binary_copy(cmdname)) == NULL) full_filepath = strdup(cmdname);
     
     // build invocable command with args
     expanded_command = calloc(strlen(full_filepath) + strlen(command + prefix) + 1, sizeof(char));
     strcat(expanded_command, full_filepath); 
     strcat(expanded_command, command + prefix);
+    free(full_filepath);
+    free(cmdname);
     
     command_argv = (char **) malloc(4 * sizeof(char *));
     command_argv[0] = strdup(getenv("SHELL"));
@@ -258,11 +425,131 @@ int expand_command(const char* command, int* argc, char ***argv, int *using_a_sc
   }
   *argc = command_argc;
   *argv = command_argv;
-  *using_a_script = running_script;
   
   return 0;
 }
 
+/**
+* Can the spawn be handed to posix_spawn, or does it need a fork
+* posix_spawn can only chdir with posix_spawn_file_actions_addchdir_np
+**/
+static int pm_can_posix_spawn()
+{
+#ifdef HAVE_POSIX_SPAWN_CHDIR
+  return spawn_mode == PM_SPAWN_AUTO;
+#else
+  return 0;
+#endif
+}
+
+/**
+* Spawn with posix_spawn, which never copies the page tables of the daemon
+* @return
+*   int - 0 on success or the errno of the failure, including exec failures
+**/
+static int pm_posix_spawn(pid_t *pid, char **command_argv, const char *cd, const char **env, pm_output_t *out, int script_fd)
+{
+#ifdef HAVE_POSIX_SPAWN_CHDIR
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t sigset;
+  int err = 0;
+  
+  if ((err = posix_spawn_file_actions_init(&actions))) return err;
+  if ((err = posix_spawnattr_init(&attr))) {
+    posix_spawn_file_actions_destroy(&actions);
+    return err;
+  }
+  
+  // Same as the fork path: a process group of its own, default signal handling, nothing blocked
+  posix_spawnattr_setpgroup(&attr, 0);
+  sigemptyset(&sigset);
+  posix_spawnattr_setsigmask(&attr, &sigset);
+  sigaddset(&sigset, SIGINT);
+  sigaddset(&sigset, SIGTERM);
+  sigaddset(&sigset, SIGHUP);
+  sigaddset(&sigset, SIGPIPE);
+  sigaddset(&sigset, SIGCHLD);
+  posix_spawnattr_setsigdefault(&attr, &sigset);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+  
+  posix_spawn_file_actions_addchdir_np(&actions, (cd != NULL && cd[0] != '\0') ? cd : "/tmp");
+  pm_output_spawn_actions(&actions, &out[0], 1);
+  pm_output_spawn_actions(&actions, &out[1], 2);
+  // A dup2 onto itself clears close-on-exec, the script survives into this child alone
+  if (script_fd >= 0) posix_spawn_file_actions_adddup2(&actions, script_fd, script_fd);
+  
+  err = posix_spawn(pid, command_argv[0], &actions, &attr, command_argv, (char* const*) (env ? env : empty_env));
+  
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  return err;
+#else
+  return ENOSYS;
+#endif
+}
+
+int pm_set_spawn_mode(enum SpawnModeT mode)
+{
+  spawn_mode = mode;
+  return 0;
+}
+
+/**
+* pm_set_subreaper
+* @description
+*   Have whatever our children leave behind reparented to us rather than
+*   to init, it's reaped off of pm_check_children like the rest. Stays
+*   in the process group it was started in, so it's still signalled
+*   along with the child it came from
+* @return
+*   int - 0, or -1 with errno set where there's no PR_SET_CHILD_SUBREAPER
+**/
+int pm_set_subreaper(int on)
+{
+#if defined(__linux__) && defined(PR_SET_CHILD_SUBREAPER)
+  if (prctl(PR_SET_CHILD_SUBREAPER, on ? 1 : 0, 0, 0, 0) < 0) return -1;
+  subreaper = on;
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/**
+* pm_signal_tree
+* @description
+*   Send sig to the process group pid leads, which is pid and everything
+*   it started that didn't move out of it. Falls back to pid alone when
+*   there's no such group
+* @return
+*   int - 0 once the signal is sent, -1 with errno set otherwise
+**/
+int pm_signal_tree(pid_t pid, int sig)
+{
+  // Don't want to send a negative pid
+  if (pid < 1) {
+    errno = ESRCH;
+    return -1;
+  }
+  if (kill(-pid, sig) == 0) return 0;
+  return kill(pid, sig);
+}
+
+/* A pipe no other child inherits, the spawn workers fork at the same time */
+static int cloexec_pipe(int fds[2])
+{
+#ifdef __linux__
+  return pipe2(fds, O_CLOEXEC);
+#else
+  if (pipe(fds) < 0) return -1;
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  return 0;
+#endif
+}
+
 /**
 * pm_execute
 * @params
@@ -270,77 +557,203 @@ int expand_command(const char* command, int* argc, char ***argv, int *using_a_sc
 *   const char* command - The command to run
 *   const char* cd - Run in this directory unless it's a NULL pointer
 *   int nice - Special nice level
+*   const pm_cgroup_limits_t* cgroup - Limits for a cgroup of its own, NULL for none
 *   const char** env - Environment variables to run in the shell
+*   const char* stdout_spec - Where stdout goes (see pm_output.h), NULL for the default
+*   const char* stderr_spec - Where stderr goes, NULL follows stdout
 * @output
     pid_t pid - output pid of the new process
 **/
-pid_t pm_execute(int should_wait, const char* command, const char *cd, int nice, const char** env)
+pid_t pm_execute(int should_wait, const char* command, const char *cd, int nice, const pm_cgroup_limits_t *cgroup, const char** env, const char* stdout_spec, const char* stderr_spec)
+{
+  pm_output_t out[2];
+  pid_t pid = pm_execute_outputs(should_wait, command, cd, nice, cgroup, env, stdout_spec, stderr_spec, out);
+  
+  if (pid > 0) {
+    // Pipe targets get read off of the loop from here on
+    pm_output_attach(&out[0], pid, 1);
+    pm_output_attach(&out[1], pid, 2);
+  }
+  return pid;
+}
+
+/**
+* Children killed before they ever ran, because their limits couldn't be
+* had. A spawn worker can't wait on one without racing the loop's
+* waitpid(-1), so the loop reaps them, removes their leaf and drops
+* the exit instead of stashing it.
+* Workers add to it, hence the lock
+**/
+typedef struct _pm_abandoned_t_ {
+  pid_t pid;                  // key
+  UT_hash_handle hh;          // makes this structure hashable
+} pm_abandoned_t;
+
+static pm_abandoned_t*  abandoned = NULL;
+static pthread_mutex_t  abandoned_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void abandon_child(pid_t pid)
+{
+  pm_abandoned_t *a = (pm_abandoned_t *) calloc(1, sizeof(pm_abandoned_t));
+  if (a == NULL) return;
+  a->pid = pid;
+  pthread_mutex_lock(&abandoned_lock);
+  HASH_ADD_INT(abandoned, pid, a);
+  pthread_mutex_unlock(&abandoned_lock);
+}
+
+/**
+* Forget pid if it was abandoned, once it has been reaped (or reap it
+* here when pid is 0, for the sweep, which never waits on anyone else's)
+* @return
+*   int - 1 if pid was abandoned
+**/
+static int abandoned_reaped(pid_t pid)
+{
+  pm_abandoned_t *a, *tmp;
+  int found = 0;
+  pthread_mutex_lock(&abandoned_lock);
+  for (a = abandoned; a != NULL; a = tmp) {
+    tmp = a->hh.next;
+    if (pid ? a->pid != pid : waitpid(a->pid, NULL, WNOHANG) != a->pid) continue;
+    // Its leaf is only empty now
+    pm_cgroup_release(a->pid);
+    HASH_DEL(abandoned, a);
+    free(a);
+    found = 1;
+    if (pid) break;
+  }
+  pthread_mutex_unlock(&abandoned_lock);
+  return found;
+}
+
+/**
+* pm_execute_outputs
+* @description
+*   Everything pm_execute does short of attaching the outputs, which only
+*   the loop thread may do. This is all a spawn worker runs
+* @params
+*   pm_output_t out[2] - Where stdout and stderr went, for pm_output_attach
+**/
+pid_t pm_execute_outputs(int should_wait, const char* command, const char *cd, int nice, const pm_cgroup_limits_t *cgroup, const char** env, const char* stdout_spec, const char* stderr_spec, pm_output_t *out)
 {
   // Setup execution
   char **command_argv = {0};
   int command_argc = 0;
-  int running_script = 0;
-  int countdown = 200;
-  int child_fd[2];
+  int script_fd = -1;
+  int err = 0;
+  int limited = pm_cgroup_wanted(cgroup);
+  int gate[2] = {-1, -1};   // Holds a limited child back until it's in its leaf
   
   // If there is nothing here, don't run anything :)
   if (strlen(command) == 0) return -1;
   
+  if (pm_output_parse(stdout_spec, 1, &out[0]) || pm_output_parse(stderr_spec, 2, &out[1])) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (pm_output_prepare(&out[0]) || pm_output_prepare(&out[1])) {
+    pm_output_abandon(&out[0]);
+    return -1;
+  }
+  
   char* chomped_string = str_chomp(command);
   char* safe_chomped_string = str_safe_quote(chomped_string);
-  if (expand_command((const char*)safe_chomped_string, &command_argc, &command_argv, &running_script)) ;
+  if (expand_command((const char*)safe_chomped_string, &command_argc, &command_argv, &script_fd)) {
+    pm_output_abandon(&out[0]);
+    pm_output_abandon(&out[1]);
+    return -1;
+  }
   command_argv[command_argc] = 0;
       
   // Now actually RUN it!
   pid_t pid;
-  if (pipe(child_fd) < 0) // Create a pipe to the child (do we need this? I doubt it)
-    perror("pipe failed");
-
-  if (should_wait)
-    pid = vfork();
-  else
-    pid = fork();
+  if (limited && cloexec_pipe(gate) < 0) {
+    err = errno;
+    if (script_fd >= 0) close(script_fd);
+    pm_output_abandon(&out[0]);
+    pm_output_abandon(&out[1]);
+    errno = err;
+    return -1;
+  }
+  // A limited child has to wait on the gate before it execs, only fork can do that
+  if (!limited && pm_can_posix_spawn()) {
+    err = pm_posix_spawn(&pid, command_argv, cd, env, out, script_fd);
+    // The child has exec'd (or failed to) by now, it holds its own copy of the script
+    if (script_fd >= 0) close(script_fd);
+    if (err) {
+      pm_output_abandon(&out[0]);
+      pm_output_abandon(&out[1]);
+      errno = err;
+      return -1;
+    }
+  } else {
+    if (should_wait && !limited)
+      pid = vfork();
+    else
+      pid = fork();
+  }
     
   switch (pid) {
   case -1: 
+    err = errno;
+    if (gate[0] >= 0) close(gate[0]);
+    if (gate[1] >= 0) close(gate[1]);
+    if (script_fd >= 0) close(script_fd);
+    pm_output_abandon(&out[0]);
+    pm_output_abandon(&out[1]);
+    errno = err;
     return -1;
   case 0: {    
+    // Leads a process group of its own, whatever it starts can be signalled with it
+    setpgid(0, 0);
+    if (gate[0] >= 0) {
+      char go = 0;
+      // Nothing runs until the parent has us in the leaf, EOF means it couldn't
+      close(gate[1]);
+      while (read(gate[0], &go, 1) < 0 && errno == EINTR) ;
+      if (go != 1) _exit(1);
+    }
     pm_setup_signal_handlers();
     if (cd != NULL && cd[0] != '\0')
       safe_chdir(cd);
     else
       safe_chdir("/tmp");
     
-    // Open outputFile path
-    if ((child_fd[1] = open(outputFile, O_WRONLY|O_CREAT|O_TRUNC, 00644)) == -1) {
-      perror("output.txt");
-      exit(1);
-    }
-    
-    dup2(child_fd[1], 1);
-    dup2(child_fd[1], 2);
+    // Point stdout, then stderr (which may follow it) where they were asked to go
+    if (pm_output_apply(&out[0], 1) || pm_output_apply(&out[1], 2))
+      child_failed("output could not be set up\n", 1);
+    // The script is the one fd of ours the command keeps
+    if (script_fd >= 0) fcntl(script_fd, F_SETFD, 0);
     
-    if (execve((const char*)command_argv[0], command_argv, (char* const*) env) < 0) {
-      printf("execve failed because: %s\n", strerror(errno));      
-      exit(-1);
-    }
+    if (execve((const char*)command_argv[0], command_argv, (char* const*) (env ? env : empty_env)) < 0)
+      child_failed("execve failed\n", -1);
   }
   default:
     // In parent process
+    // Both sides set the group so neither can signal it before it exists, once it has exec'd this fails harmlessly
+    setpgid(pid, pid);
     if (nice != INT_MAX && setpriority(PRIO_PROCESS, pid, nice) < 0) 
       ;
-    if (running_script) {
-      while (countdown > 0) {
-        if (kill(pid, 0) != 0) break;
-        usleep(100);
-        countdown--;
-      }
-      struct stat buffer;
-      if (stat(command_argv[0], &buffer) != 0) {
-        printf("file doesn't exist when it should because: %s\n", strerror(errno));
+    if (limited) {
+      char go = 1;
+      close(gate[0]);
+      // Limits it asked for and can't have, it doesn't get to run at all
+      if (pm_cgroup_place(pid, cgroup) < 0 || write(gate[1], &go, 1) != 1) {
+        err = errno;
+        close(gate[1]);
+        kill(pid, SIGKILL);
+        abandon_child(pid);
+        if (script_fd >= 0) close(script_fd);
+        pm_output_abandon(&out[0]);
+        pm_output_abandon(&out[1]);
+        errno = err;
+        return -1;
       }
-      if( unlink( command_argv[0] ) != 0 ) perror( "Error deleting file" );
+      close(gate[1]);
     }
+    // Nothing to clean up after a script, it only ever lived in the child's fd
+    if (script_fd >= 0) close(script_fd);
     // These are free'd later, anyway
     // if (chomped_string) free(chomped_string); 
     // if (safe_chomped_string) free(safe_chomped_string);
@@ -365,234 +778,1084 @@ int wait_for_pid(pid_t pid, int opts)
   }
 }
 
-typedef enum HookT {BEFORE_HOOK, AFTER_HOOK} hook_t;
-int run_hook(hook_t t, process_t *process, process_return_t *ret)
+/**
+* Look at whether pid already exited without reaping it, so the exit
+* still gets picked up and reported by pm_check_children
+**/
+static int peek_exit_status(pid_t pid)
+{
+  siginfo_t info;
+  memset(&info, 0, sizeof(info));
+  if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) < 0 || info.si_pid != pid) return 0;
+  return info.si_code == CLD_EXITED ? info.si_status : 0;
+}
+
+/*--- Pipelines ---*/
+static pm_pipeline_t* pipelines = NULL;
+
+/* Run commands that are started again when they exit, see Restarts below */
+typedef struct _pm_restart_t_ pm_restart_t;
+/* A stop that came in for a restart still on its way up */
+typedef struct _pm_pending_stop_t_ {
+  pm_stop_done_cb done;       // NULL for none
+  void *data;
+  int timeout;
+} pm_pending_stop_t;
+static void restart_watch(process_t *process, pid_t pid);
+static void restart_started(pm_restart_t *r, pid_t pid, pm_pending_stop_t *stop);
+static int restart_child_exited(pid_t pid, int status, void (*child_changed_status)(process_struct *ps));
+static int stop_running(pid_t pid, int i, process_t *process, int timeout, pm_stop_done_cb done, void *data);
+
+/* Left running, so the daemon after us can find it */
+static void journal_child(pid_t pid, process_t *process)
+{
+  unsigned long long start_time;
+  if (pm_journal_enabled() && pm_stats_start_time(pid, &start_time) == 0)
+    pm_journal_add(pid, start_time, process->transId, process->app);
+}
+
+/**
+* Turn a wait status into the exit status we hand back for a stage
+* Killed by a signal counts as a failure, the same way a shell reports it
+**/
+static int stage_exit_status(int status)
+{
+  if (WIFEXITED(status)) return WEXITSTATUS(status);
+  if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+  return 0;
+}
+
+static void set_stage_error(process_return_t *ret)
+{
+  ret->exit_status = -1;
+  if (ret->stderr) free(ret->stderr);
+  ret->stderr = strdup(strerror(errno));
+}
+
+/**
+* Hand the finished pipeline off to whoever started it
+**/
+static void finish_pipeline(pm_pipeline_t *pl, enum ProcessReturnState stage, void (*child_changed_status)(process_struct *ps))
 {
-  if (t == BEFORE_HOOK) {
-    ret->stage = PRS_BEFORE;
-    ret->pid = pm_execute(1, (const char*)process->before, (const char*)process->cd, (int)process->nice, (const char**)process->env);
-  } else if (t == AFTER_HOOK) {
-    ret->stage = PRS_AFTER;
-    ret->pid = pm_execute(1, (const char*)process->after, (const char*)process->cd, (int)process->nice, (const char**)process->env);
+  process_t *process = pl->process;
+  process_return_t *ret = pl->ret;
+  ret->stage = stage;
+  if (stage == PRS_OKAY && pl->spawn) {
+    if (!pl->command_exited && (ret->exit_status = peek_exit_status(ret->pid)))
+      ret->stage = PRS_COMMAND;
+    else if (pl->command_exited && (ret->exit_status = stage_exit_status(pl->command_status)))
+      ret->stage = PRS_COMMAND;
+  }
+  
+  // done may free process and ret, hold on to what we still need
+  int track = stage == PRS_OKAY && pl->spawn && ret->stage == PRS_OKAY;
+  pid_t pid = ret->pid;
+  int transId = process->transId;
+  pm_restart_t *restart = pl->restart;
+  pm_pending_stop_t stop = {NULL, NULL, 0};
+  // It's watched from a copy of its own, or it's one coming back under a new pid
+  if (track && restart == NULL && process->restart.policy != PM_RESTART_TEMPORARY) {
+    restart_watch(process, pid);
+  } else if (track && restart) {
+    restart_started(restart, pid, &stop);
   }
-  // Check to make sure the hook executed properly
-  ret->exit_status = wait_for_pid(ret->pid, 0);
-  if (ret->exit_status) {
-    if (errno) {
-      ret->stderr = (char*)calloc(1, sizeof(char)*strlen(strerror(errno)));
-      strncpy(ret->stderr, strerror(errno), strlen(strerror(errno)));
+  if (track && !pl->command_exited) journal_child(pid, process);
+  pl->done(process, ret, pl->data);
+  
+  // Track the command from here on, or report it right away if it beat us to it
+  if (track) {
+    if (!pl->command_exited) {
+      pm_children_add(&running_children, pid, transId);
+      // A stop that came in while it was on its way back up
+      if (stop.done && stop_running(pid, pm_children_find(&running_children, pid), NULL, stop.timeout, stop.done, stop.data) < 0)
+        stop.done(pid, ESRCH, stop.data);
+    } else if (!restart_child_exited(pid, pl->command_status, child_changed_status)) {
+      process_struct ps;
+      memset(&ps, 0, sizeof(ps));
+      ps.pid = pid;
+      ps.transId = transId;
+      ps.status = pl->command_status;
+      if (child_changed_status) child_changed_status(&ps);
+      if (stop.done) stop.done(pid, ps.status, stop.data);
     }
-    return -1;
   }
-  return 0;
+  free(pl);
 }
 
-process_return_t* pm_run_and_spawn_process(process_t *process)
+/**
+* Start the next stage of the pipeline
+* @return
+*   pid_t - pid of the stage now running, or 0 if the pipeline finished
+*   or the stage went to a spawn worker
+**/
+static pid_t stage_started(pm_pipeline_t *pl, enum ProcessReturnState stage, pid_t pid, void (*child_changed_status)(process_struct *ps));
+
+static pid_t start_stage(pm_pipeline_t *pl, enum ProcessReturnState stage, void (*child_changed_status)(process_struct *ps))
 {
-  process_return_t* ret = pm_new_process_return();
-  if (ret == NULL) return NULL;
-  // new_process_return
-  if (process->env) process->env[process->env_c] = NULL;
+  process_t *process = pl->process;
+  process_return_t *ret = pl->ret;
+  const char *command = NULL;
+  pid_t pid;
+  
+  // Skip the hooks that weren't asked for
+  if (stage == PRS_BEFORE && !process->before) stage = PRS_COMMAND;
+  if (stage == PRS_AFTER && !process->after) stage = PRS_OKAY;
+  if (stage == PRS_OKAY) {
+    finish_pipeline(pl, PRS_OKAY, child_changed_status);
+    return 0;
+  }
   
-  // Run afterhook
-  if (process->before) {
-    if (run_hook(BEFORE_HOOK, process, ret)) return ret;
+  switch (stage) {
+    case PRS_BEFORE:  command = process->before; break;
+    case PRS_COMMAND: command = process->command; break;
+    default:          command = process->after; break;
   }
+  
+  ret->stage = stage;
+  
+  // Hand the spawn to a worker if there are any, it picks up in spawn_finished
+  if (pl->threaded && pm_spawner_running()) {
+    pm_spawn_job_t *job = &pl->job;
+    memset(job, 0, sizeof(pm_spawn_job_t));
+    job->should_wait = stage == PRS_COMMAND ? !pl->spawn : 1;
+    job->command = command;
+    job->cd = process->cd;
+    job->nice = (int)process->nice;
+    job->cgroup = stage == PRS_COMMAND ? &process->cgroup : NULL;
+    job->env = (const char**)process->env;
+    // Only the command is routed, hook output goes to the daemon's output file
+    job->stdout_spec = stage == PRS_COMMAND ? process->stdout : NULL;
+    job->stderr_spec = stage == PRS_COMMAND ? process->stderr : NULL;
+    job->data = pl;
+    if (pm_spawner_submit(job) == 0) return 0;
+  }
+  
+  errno = 0;
+  // Only the command is routed, hook output goes to the daemon's output file
+  if (stage == PRS_COMMAND)
+    pid = pm_execute(!pl->spawn, command, process->cd, (int)process->nice, &process->cgroup, (const char**)process->env, process->stdout, process->stderr);
+  else
+    pid = pm_execute(1, command, process->cd, (int)process->nice, NULL, (const char**)process->env, NULL, NULL);
+  return stage_started(pl, stage, pid, child_changed_status);
+}
 
-  ret->stage = PRS_COMMAND;
-  ret->pid = pm_execute(0, (const char*)process->command, process->cd, (int)process->nice, (const char**)process->env);
+/**
+* The stage is running as pid (or failed to start when pid is -1)
+* @return
+*   pid_t - pid of the stage now running, or 0 if the pipeline finished
+**/
+static pid_t stage_started(pm_pipeline_t *pl, enum ProcessReturnState stage, pid_t pid, void (*child_changed_status)(process_struct *ps))
+{
+  process_return_t *ret = pl->ret;
   
-  if (errno) {
-    ret->stderr = (char*)calloc(1, sizeof(char)*strlen(strerror(errno)));
-    strncpy(ret->stderr, strerror(errno), strlen(strerror(errno)));
+  if (pid < 0) {
+    set_stage_error(ret);
+    if (stage != PRS_AFTER) ret->pid = pid;
+    finish_pipeline(pl, stage, child_changed_status);
+    return 0;
   }
-  if (ret->pid < 0) {
-    return ret;
+  // The reply names the command, so only a hook that runs before it lends its pid
+  if (stage != PRS_AFTER) ret->pid = pid;
+  
+  // A run command is left running, move straight on to the after hook
+  if (pl->spawn && stage == PRS_COMMAND) return start_stage(pl, PRS_AFTER, child_changed_status);
+  
+  pl->stage_pid = pid;
+  HASH_ADD_INT(pipelines, stage_pid, pl);
+  return pid;
+}
+
+/**
+* Step the pipeline waiting on pid, if there is one
+* @params
+*   pid_t pid - The pid that exited
+*   int status - Its wait status
+* @return
+*   int - 1 if the pid belonged to a pipeline, 0 otherwise
+**/
+static int pm_pipeline_child_exited(pid_t pid, int status, void (*child_changed_status)(process_struct *ps))
+{
+  pm_pipeline_t *pl, *tmp;
+  int exit_status = stage_exit_status(status);
+  
+  child_reaped(pid);
+  HASH_FIND_INT(pipelines, &pid, pl);
+  if (pl == NULL) {
+    // Could be a spawned command that died while its after hook still runs.
+    // There are only ever a handful of pipelines in flight, so just look
+    for (pl = pipelines; pl != NULL; pl = tmp) {
+      tmp = pl->hh.next;
+      if (pl->spawn && pl->ret->stage == PRS_AFTER && pl->ret->pid == pid) {
+        pl->command_exited = 1;
+        pl->command_status = status;
+        return 1;
+      }
+    }
+    return 0;
   }
   
-  ret->exit_status = wait_for_pid(ret->pid, WNOHANG);
-  if (ret->exit_status) {
-    printf("command: %s pid: %d exit_status: %d - %s\n", process->command, ret->pid, ret->exit_status, ret->stderr);
-    return ret;
+  HASH_DEL(pipelines, pl);
+  pl->ret->exit_status = exit_status;
+  if (exit_status) {
+    finish_pipeline(pl, pl->ret->stage, child_changed_status);
+    return 1;
   }
   
-  // Run afterhook
-  if (process->after) {
-    if (run_hook(AFTER_HOOK, process, ret)) return ret;
+  switch (pl->ret->stage) {
+    case PRS_BEFORE:  start_stage(pl, PRS_COMMAND, child_changed_status); break;
+    case PRS_COMMAND: start_stage(pl, PRS_AFTER, child_changed_status); break;
+    default:          finish_pipeline(pl, PRS_OKAY, child_changed_status); break;
   }
+  return 1;
+}
 
-  // Yay, we finished properly
-  ret->stage = PRS_OKAY;
-  process_struct *ps = (process_struct *) calloc(1, sizeof(process_struct));
-  ps->pid = ret->pid;
-  ps->transId = process->transId;
-  HASH_ADD_INT(running_children, pid, ps);
+/**
+* pm_start_pipeline
+* @description
+*   Kick off the before hook, command and after hook of process without
+*   waiting on any of them. done is called once the last stage exits
+*   (or one of them fails) with the process and its return
+* @params
+*   process_t* process - The process to run, owned by the pipeline until done is called
+*   int spawn - 1 leaves the command running (run), 0 waits for it to exit (exec)
+*   pm_pipeline_done_cb done - Called with the result
+*   void* data - Passed along to done
+* @return
+*   pid_t - pid of the stage now running, 0 if the pipeline already finished
+*   (or a spawn worker has the stage) or -1 on failure
+**/
+static pid_t start_pipeline(process_t *process, int spawn, pm_pipeline_done_cb done, void *data, int threaded, pm_restart_t *restart)
+{
+  pm_pipeline_t *pl = (pm_pipeline_t *) calloc(1, sizeof(pm_pipeline_t));
+  if (pl == NULL) return -1;
+  if ((pl->ret = pm_new_process_return()) == NULL) {
+    free(pl);
+    return -1;
+  }
+  if (process->env) process->env[process->env_c] = NULL;
   
-  return ret;
+  pl->process = process;
+  pl->spawn = spawn;
+  pl->done = done;
+  pl->data = data;
+  pl->threaded = threaded;
+  pl->restart = restart;
+  return start_stage(pl, PRS_BEFORE, NULL);
+}
+
+pid_t pm_start_pipeline(process_t *process, int spawn, pm_pipeline_done_cb done, void *data)
+{
+  return start_pipeline(process, spawn, done, data, 1, NULL);
 }
 
 /**
-* Run the process
+* Exits of children whose spawn hasn't come back from a worker yet. The
+* loop can reap a child before it ever hears its pid, so the exit waits
+* here for spawn_finished to claim it
 **/
-process_return_t* pm_run_process(process_t *process)
+typedef struct _pm_early_exit_t_ {
+  pid_t pid;                  // key
+  int status;
+  UT_hash_handle hh;          // makes this structure hashable
+} pm_early_exit_t;
+
+static pm_early_exit_t* early_exits = NULL;
+static void (*spawn_child_changed_status)(process_struct *ps) = NULL;
+
+static void stash_early_exit(pid_t pid, int status)
 {
-  process_return_t* ret = pm_new_process_return();
-  if (ret == NULL) return NULL;
-  
-  if (process->env) process->env[process->env_c] = NULL;
+  pm_early_exit_t *ex = (pm_early_exit_t *) calloc(1, sizeof(pm_early_exit_t));
+  if (ex == NULL) return;
+  ex->pid = pid;
+  ex->status = status;
+  HASH_ADD_INT(early_exits, pid, ex);
+}
+
+/**
+* Did pid already exit, either stashed or waiting to be reaped
+**/
+static int claim_early_exit(pid_t pid, int *status)
+{
+  pm_early_exit_t *ex;
+  HASH_FIND_INT(early_exits, &pid, ex);
+  if (ex) {
+    *status = ex->status;
+    HASH_DEL(early_exits, ex);
+    free(ex);
+    return 1;
+  }
+  return waitpid(pid, status, WNOHANG) == pid;
+}
+
+static void forget_early_exits()
+{
+  pm_early_exit_t *ex, *tmp;
+  for (ex = early_exits; ex != NULL; ex = tmp) {
+    tmp = ex->hh.next;
+    HASH_DEL(early_exits, ex);
+    free(ex);
+  }
+}
+
+/**
+* A spawn worker is through with the stage of pl, back on the loop thread
+**/
+static void spawn_finished(pm_spawn_job_t *job)
+{
+  pm_pipeline_t *pl = (pm_pipeline_t *) job->data;
+  enum ProcessReturnState stage = pl->ret->stage;
+  void (*cb)(process_struct *ps) = spawn_child_changed_status;
+  pid_t pid = job->pid;
+  int status = 0, exited = 0;
   
-  // Run afterhook
-  if (process->before) {
-    if (run_hook(BEFORE_HOOK, process, ret)) return ret;
+  if (pid > 0) {
+    pm_output_attach(&job->out[0], pid, 1);
+    pm_output_attach(&job->out[1], pid, 2);
+    exited = claim_early_exit(pid, &status);
+  } else {
+    errno = job->err;
+  }
+  // A run command that's already gone is reported once its after hook is through
+  if (pl->spawn && !pl->command_exited && stage != PRS_BEFORE) {
+    if (stage == PRS_COMMAND && exited) {
+      pl->command_exited = 1;
+      pl->command_status = status;
+      exited = 0;
+    } else if (stage == PRS_AFTER && claim_early_exit(pl->ret->pid, &pl->command_status)) {
+      pl->command_exited = 1;
+    }
   }
   
-  ret->stage = PRS_COMMAND;
-  pid_t pid = pm_execute(1, (const char*)process->command, process->cd, (int)process->nice, (const char**)process->env);
+  if (stage_started(pl, stage, pid, cb) == pid && exited) pm_pipeline_child_exited(pid, status, cb);
+  if (pm_spawner_in_flight() == 0) forget_early_exits();
+}
+
+/**
+* pm_set_spawn_threads
+* @description
+*   Hand the spawns of every pipeline to threads workers from here on.
+*   Call it once the loop watches the signals, so the workers never see one
+**/
+int pm_set_spawn_threads(int threads, void (*child_changed_status)(process_struct *ps))
+{
+  spawn_child_changed_status = child_changed_status;
+  return pm_spawner_start(threads, spawn_finished);
+}
+
+/**
+* Run a pipeline inline, for callers that have nothing better to do than wait
+**/
+static process_return_t* inline_ret = NULL;
+static void inline_pipeline_done(process_t *process, process_return_t *ret, void *data)
+{
+  inline_ret = ret;
+}
+
+static process_return_t* pm_run_pipeline_inline(process_t *process, int spawn)
+{
+  pid_t pid;
+  int status;
   
-  ret->pid = pid;
-  ret->exit_status = wait_for_pid(pid, 0);
-  if (errno) {
-    ret->stderr = (char*)calloc(1, sizeof(char)*strlen(strerror(errno)));
-    strncpy(ret->stderr, strerror(errno), strlen(strerror(errno)));
+  inline_ret = NULL;
+  // Never goes to the spawn workers, we wait on every stage right here
+  pid = start_pipeline(process, spawn, inline_pipeline_done, NULL, 0, NULL);
+  while (pid > 0) {
+    if (waitpid(pid, &status, 0) < 0) {
+      if (errno == EINTR) continue;
+      status = 0;
+    }
+    pm_pipeline_child_exited(pid, status, NULL);
+    pid = 0;
+    if (inline_ret == NULL) {
+      pm_pipeline_t *pl;
+      for (pl = pipelines; pl != NULL; pl = pl->hh.next)
+        if (pl->process == process) pid = pl->stage_pid;
+    }
+  }
+  return inline_ret;
+}
+
+process_return_t* pm_run_and_spawn_process(process_t *process)
+{
+  return pm_run_pipeline_inline(process, 1);
+}
+
+/**
+* Run the process
+**/
+process_return_t* pm_run_process(process_t *process)
+{
+  return pm_run_pipeline_inline(process, 0);
+}
+
+/**
+* Restarts
+* A run command with a restart policy is watched from a copy of its
+* process. When it exits and its policy says so it's run again (hooks
+* and all) off of a timer: backoff_ms for the first restart of a window,
+* doubling for every one after it up to max_backoff_ms, and only the
+* first half of that is certain so children that went down together
+* don't all come back at once. More than max_restarts in window_ms and
+* it's left down and its exit goes out like any other. A stop, or a kill
+* asking it to go, keeps it down as well
+**/
+struct _pm_restart_t_ {
+  pid_t pid;                  // key, the child as Erlang knows it right now
+  process_t *process;         // what it's run from, owned
+  int restarts;               // in the window
+  long window_start;          // ms
+  int status;                 // of the exit being restarted
+  int armed;                  // 0 once it has to stay down
+  int starting;               // its pipeline is running
+  pm_pending_stop_t stop;     // came in while it was starting, it goes as soon as it's up
+  pm_timer_t timer;
+  void (*child_changed_status)(process_struct *ps);
+  UT_hash_handle hh;          // makes this structure hashable
+};
+
+static pm_restart_t* restarts = NULL;
+static pm_restarted_cb restarted_cb = NULL;
+
+int pm_set_restart_cb(pm_restarted_cb cb)
+{
+  restarted_cb = cb;
+  return 0;
+}
+
+int pm_restarts_watched()
+{
+  return HASH_COUNT(restarts);
+}
+
+static void restart_forget(pm_restart_t *r)
+{
+  HASH_DEL(restarts, r);
+  pm_timer_cancel(&r->timer);
+  pm_free_process(r->process);
+  free(r);
+}
+
+/* It stays down, its last exit goes out after all */
+static void restart_give_up(pm_restart_t *r)
+{
+  void (*child_changed_status)(process_struct *ps) = r->child_changed_status;
+  process_struct ps;
+  memset(&ps, 0, sizeof(ps));
+  ps.pid = r->pid;
+  ps.status = r->status;
+  ps.transId = r->process->transId;
+  restart_forget(r);
+  if (child_changed_status) child_changed_status(&ps);
+}
+
+static void restart_watch(process_t *process, pid_t pid)
+{
+  pm_restart_t *r;
+  if ((r = (pm_restart_t *) calloc(1, sizeof(pm_restart_t))) == NULL) return;
+  if ((r->process = pm_clone_process(process)) == NULL) {
+    free(r);
+    return;
+  }
+  r->pid = pid;
+  r->armed = 1;
+  r->window_start = pm_timer_now_ms();
+  HASH_ADD_INT(restarts, pid, r);
+}
+
+/* It's back up as pid, along with any stop that has to go to it now */
+static void restart_started(pm_restart_t *r, pid_t pid, pm_pending_stop_t *stop)
+{
+  pid_t old_pid = r->pid;
+  *stop = r->stop;
+  memset(&r->stop, 0, sizeof(r->stop));
+  HASH_DEL(restarts, r);
+  r->pid = pid;
+  r->starting = 0;
+  HASH_ADD_INT(restarts, pid, r);
+  if (restarted_cb) restarted_cb(old_pid, pid, r->status);
+}
+
+static int policy_restarts(enum RestartPolicyT policy, int status)
+{
+  if (policy == PM_RESTART_PERMANENT) return 1;
+  if (policy == PM_RESTART_TRANSIENT) return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  return 0;
+}
+
+/* How long until the next restart, or -1 once the window has had too many */
+static long restart_delay(pm_restart_t *r)
+{
+  pm_restart_policy_t *policy = &r->process->restart;
+  int max_restarts = policy->max_restarts > 0 ? policy->max_restarts : PM_RESTART_MAX;
+  long window = policy->window_ms > 0 ? policy->window_ms : PM_RESTART_WINDOW_MS;
+  long delay = policy->backoff_ms > 0 ? policy->backoff_ms : PM_RESTART_BACKOFF_MS;
+  long max_delay = policy->max_backoff_ms > 0 ? policy->max_backoff_ms : PM_RESTART_MAX_BACKOFF_MS;
+  long now = pm_timer_now_ms();
+  int i;
+
+  if (now - r->window_start > window) {
+    r->window_start = now;
+    r->restarts = 0;
+  }
+  if (r->restarts >= max_restarts) return -1;
+  for (i = 0; i < r->restarts && delay < max_delay; i++) delay *= 2;
+  if (delay > max_delay) delay = max_delay;
+  r->restarts++;
+  return delay / 2 + rand() % (delay / 2 + 1);
+}
+
+static void restart_timer_fired(void *data);
+
+/* Wait out the backoff before the next try, or give up */
+static void restart_later(pm_restart_t *r)
+{
+  long delay;
+  if (!r->armed || (delay = restart_delay(r)) < 0) {
+    restart_give_up(r);
+    return;
+  }
+  pm_timer_add(&r->timer, delay, restart_timer_fired, r);
+}
+
+/* The restart didn't get as far as a running command */
+static void restart_pipeline_done(process_t *process, process_return_t *ret, void *data)
+{
+  pm_restart_t *r = (pm_restart_t *) data;
+  pm_free_process_return(ret);
+  // Cleared by restart_started when the command did get going
+  if (!r->starting) return;
+  r->starting = 0;
+  // Stopped on its way back up, and it never got there
+  if (r->stop.done) {
+    pm_pending_stop_t stop = r->stop;
+    pid_t pid = r->pid;
+    int status = r->status;
+    restart_forget(r);
+    stop.done(pid, status, stop.data);
+    return;
+  }
+  restart_later(r);
+}
+
+static void restart_timer_fired(void *data)
+{
+  pm_restart_t *r = (pm_restart_t *) data;
+  debug(dbg, 2, "restarting pid %d\n", r->pid);
+  r->starting = 1;
+  if (start_pipeline(r->process, 1, restart_pipeline_done, r, 1, r) < 0) {
+    r->starting = 0;
+    restart_later(r);
+  }
+}
+
+/**
+* A watched child exited with status
+* @return
+*   int - 1 when it's going to be restarted, so the exit isn't reported
+**/
+static int restart_child_exited(pid_t pid, int status, void (*child_changed_status)(process_struct *ps))
+{
+  pm_restart_t *r;
+  long delay;
+  if (restarts == NULL) return 0;
+  HASH_FIND_INT(restarts, &pid, r);
+  if (r == NULL) return 0;
+  r->status = status;
+  if (child_changed_status) r->child_changed_status = child_changed_status;
+  if (!r->armed || !policy_restarts(r->process->restart.policy, status) || (delay = restart_delay(r)) < 0) {
+    restart_forget(r);
+    return 0;
   }
-  if (ret->exit_status) return ret;
+  pm_timer_add(&r->timer, delay, restart_timer_fired, r);
+  return 1;
+}
+
+/* pid has been asked to go, it stays down once it does */
+static void restart_disarm(pid_t pid)
+{
+  pm_restart_t *r;
+  if (restarts == NULL) return;
+  HASH_FIND_INT(restarts, &pid, r);
+  if (r) r->armed = 0;
+}
+
+/* pid is down and waiting out its backoff */
+static pm_restart_t* restart_waiting(pid_t pid)
+{
+  pm_restart_t *r;
+  if (restarts == NULL) return NULL;
+  HASH_FIND_INT(restarts, &pid, r);
+  return r && pm_timer_pending(&r->timer) ? r : NULL;
+}
+
+/* pid is down and its restart is under way */
+static pm_restart_t* restart_starting(pid_t pid)
+{
+  pm_restart_t *r;
+  if (restarts == NULL) return NULL;
+  HASH_FIND_INT(restarts, &pid, r);
+  return r && r->starting ? r : NULL;
+}
+
+/**
+* Children on their way out. A stop sends SIGTERM (or runs the stop
+* command it was given) and puts a timer on the wheel, a child that is
+* still around when it fires gets a SIGKILL. Whoever asked for the stop
+* hears back once the child has been reaped
+**/
+typedef struct _pm_stop_t_ {
+  pid_t pid;                  // key
+  pid_t action_pid;           // the stop command, 0 for a SIGTERM or once it exited
+  pm_timer_t timer;
+  pm_stop_done_cb done;
+  void *data;
+  UT_hash_handle hh;          // makes this structure hashable
+} pm_stop_t;
+
+static pm_stop_t* stops = NULL;
+
+static void stop_timer_fired(void *data)
+{
+  pm_stop_t *stop = (pm_stop_t *) data;
+  debug(dbg, 2, "pid %d outlived its stop, killing it\n", stop->pid);
+  pm_signal_tree(stop->pid, SIGKILL);
+  if (stop->action_pid > 0) pm_signal_tree(stop->action_pid, SIGKILL);
+}
+
+/* pid was reaped, tell whoever was stopping it */
+static void stop_finished(pid_t pid, int status)
+{
+  pm_stop_t *stop;
+  if (stops == NULL) return;
+  HASH_FIND_INT(stops, &pid, stop);
+  if (stop == NULL) return;
+  HASH_DEL(stops, stop);
+  pm_timer_cancel(&stop->timer);
+  // Anything it started that outlived it goes too, the group can't be reused while it's left
+  kill(-pid, SIGKILL);
+  stop->done(pid, status, stop->data);
+  free(stop);
+}
+
+/* Was pid the stop command of a stop? */
+static int stop_action_exited(pid_t pid)
+{
+  pm_stop_t *stop;
+  for (stop = stops; stop != NULL; stop = stop->hh.next) {
+    if (stop->action_pid == pid) {
+      stop->action_pid = 0;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Send running child i on its way, with the stop command of process if it has one */
+static int stop_running(pid_t pid, int i, process_t *process, int timeout, pm_stop_done_cb done, void *data)
+{
+  pm_stop_t *stop;
+  
+  restart_disarm(pid);
+  if ((stop = (pm_stop_t *) calloc(1, sizeof(pm_stop_t))) == NULL) return -1;
+  stop->pid = pid;
+  stop->done = done;
+  stop->data = data;
   
-  // Run afterhook
-  if (process->after) {
-    if (run_hook(AFTER_HOOK, process, ret)) return ret;
+  if (process && process->command) {
+    char str[32];
+    snprintf(str, sizeof(str), "BABYSITTER_PID=%d", pid);
+    pm_add_env(&process, str);
+    if ((stop->action_pid = pm_execute(0, process->command, process->cd, 0, NULL, (const char**)process->env, NULL, NULL)) < 0)
+      stop->action_pid = 0;
+  }
+  // No stop command, or it wouldn't start
+  if (stop->action_pid == 0) {
+    pm_signal_tree(pid, SIGTERM);
+    running_children.signal[i] = SIGTERM;
   }
   
-  // Yay, we finished properly
-  ret->stage = PRS_OKAY;
-  return ret;
+  running_children.kill_pid[i] = stop->action_pid;
+  running_children.deadline[i] = time(NULL) + (timeout + 999) / 1000;
+  HASH_ADD_INT(stops, pid, stop);
+  pm_timer_add(&stop->timer, timeout, stop_timer_fired, stop);
+  return 0;
 }
 
-int pm_kill_process(process_t *process)
+/**
+* pm_stop_process
+* @description
+*   Ask a running child to go: process->command (run with process->cd and
+*   env, plus BABYSITTER_PID) if given, otherwise SIGTERM. A child that is
+*   still around process->timeout ms later (PM_STOP_TIMEOUT_MS if not
+*   given) is killed. Nothing waits on the child here, done is called
+*   once it has been reaped. One that's down waiting on a restart is
+*   done right away, and one whose restart is under way is stopped as
+*   soon as it's back up (under the pid it was restarted as)
+* @return
+*   int - 0 when the child is on its way out, -1 when it isn't a running
+*   child of ours and -2 when it's already being stopped
+**/
+int pm_stop_process(process_t *process, pm_stop_done_cb done, void *data)
 {
   pid_t pid = process->pid;
+  int timeout = process->timeout > 0 ? process->timeout : PM_STOP_TIMEOUT_MS;
+  pm_stop_t *stop;
+  pm_restart_t *r;
+  int i;
   
-  // Don't want to send a negative pid
-  if (pid < 1) return -1;
-    
-  // process_struct *ps;
-  
-  // for( ps = running_children; ps != NULL; ps = ps->hh.next ) {
-  //   if (pid == ps->pid)
-  //     break;
-  // }
-  // HASH_FIND_INT(running_children, (int)process->pid, ps);
-  
-  // if (ps) {
-    int childExitStatus = -1;
-    // Kill here
-    kill(pid, SIGKILL);
-    waitpid( pid, &childExitStatus, 0 );
+  // Down and waiting on a restart, it's already as stopped as it gets
+  if ((r = restart_waiting(pid)) != NULL) {
+    int status = r->status;
+    restart_forget(r);
+    done(pid, status, data);
     return 0;
-  // } else {
-  //   return -1;
-  // }
+  }
+  // On its way back up, it's stopped once it gets there (or right away if it doesn't)
+  if ((r = restart_starting(pid)) != NULL) {
+    if (r->stop.done) return -2;
+    r->armed = 0;
+    r->stop.done = done;
+    r->stop.data = data;
+    r->stop.timeout = timeout;
+    return 0;
+  }
+  if (pid < 1 || (i = pm_children_find(&running_children, pid)) < 0) return -1;
+  HASH_FIND_INT(stops, &pid, stop);
+  if (stop) return -2;
+  return stop_running(pid, i, process, timeout, done, data);
 }
 
-int pm_check_children(void (*child_changed_status)(process_struct *ps), int isTerminated)
+/**
+* pm_kill_process
+* @description
+*   Send process->signal to process->pid and everything it started (see
+*   pm_signal_tree) and get on with it. Nothing waits on the pid here,
+*   its exit is picked up by pm_check_children like any other (and
+*   killing a stage of a pipeline fails the pipeline)
+* @return
+*   int - 0 once the signal is sent, -1 with errno set otherwise
+**/
+int pm_kill_process(process_t *process)
 {
-  process_struct *ps;
-  int p_status = 0;
-  int status;
+  pid_t pid = process->pid;
+  int sent, to_go, i;
+  pm_restart_t *r;
   
-  // Run through each of the running children and poke at them to see
-  // if they are running or not
-  for( ps = running_children; ps != NULL; ps = ps->hh.next ) {
-    // Prevent zombies...
-    while ((p_status = waitpid(ps->pid, &status, WNOHANG)) < 0 && errno == EINTR);
-    
-    if ((p_status = pm_check_pid_status(ps->pid)) > 0) {
-      time_t now;
-      now = time(NULL); // Current time
-      // Something is wrong with the process, whatever could it be? Did we try to kill it?
-      if (ps->kill_pid > 0 && difftime(ps->deadline, now) > 0) {
-        // We've definitely sent this pid a shutdown and the deadline has clearly passed, let's force kill it
-        kill(ps->pid, SIGTERM);
-        // Kill the killing process too
-        if ((p_status = kill(ps->kill_pid, 0)) == 0) kill(ps->kill_pid, SIGKILL);
-        // Set the deadline for the pid
-        ps->deadline += 5;
-      }
-      // Now wait for it, only if it's going to die.
-      if (p_status > 0) {
-        HASH_ADD(hh, exited_children, pid, sizeof(ps), ps);
-        HASH_DEL(running_children, ps);
-        continue;
-      }
-    } else if (p_status < 0 && errno == ESRCH) {
-      // Now if the pid has most definitely disappeared, then we can 
-      // send the status change and remove the pid from tracking
-      HASH_DEL(running_children, ps);
-      ps->status = ESRCH;
-      child_changed_status(ps);
-    }
+  // Asked to go, rather than poked
+  to_go = process->signal == SIGKILL || process->signal == SIGTERM || process->signal == SIGINT || process->signal == SIGQUIT;
+  sent = pm_signal_tree(pid, process->signal) == 0;
+  if (!sent && (errno != ESRCH || restart_waiting(pid) == NULL)) return -1;
+  if ((i = pm_children_find(&running_children, pid)) >= 0) running_children.signal[i] = process->signal;
+  // Down and waiting on a restart (maybe with leftovers in its group), the kill keeps it down
+  if ((r = restart_waiting(pid)) != NULL && (!sent || to_go)) restart_give_up(r);
+  else if (to_go) restart_disarm(pid);
+  return 0;
+}
+
+/**
+* pm_process_stats
+* @description
+*   Sample what pid is using. A running child keeps its /proc directory
+*   open until it's reaped, anything else is opened for the one sample.
+*   One with a cgroup leaf of its own gets what the leaf used as well
+* @return
+*   int - 0, or -1 with stats->err set
+**/
+int pm_process_stats(pid_t pid, pm_stats_t *stats)
+{
+  if (pm_stats_sample(pid, pm_children_find(&running_children, pid) >= 0, stats) < 0) return -1;
+  stats->limited = pm_cgroup_enabled() && pm_cgroup_usage(pid, &stats->cgroup) == 0;
+  return 0;
+}
+
+/**
+* Adoption
+* Children a daemon before us journaled that are still running. They
+* aren't our children, nothing of theirs ever comes back from waitpid,
+* so a pidfd on the loop tells us when one exits (or a look in /proc
+* every PM_ADOPTED_POLL_MS where there are no pidfds). How it exited
+* went to whoever reaped it, the exit goes out with ESRCH for a status
+* the same as a child the sweep lost track of
+**/
+typedef struct _pm_adopted_t_ {
+  pid_t pid;                  // key
+  int fd;                     // pidfd, -1 when it's polled for
+  unsigned long long start_time;
+  UT_hash_handle hh;          // makes this structure hashable
+} pm_adopted_t;
+
+static pm_adopted_t* adopted = NULL;
+static pm_timer_t adopted_poll;
+static void (*adopted_changed_status)(process_struct *ps) = NULL;
+
+static void adopted_forget(pid_t pid)
+{
+  pm_adopted_t *a;
+  if (adopted == NULL) return;
+  HASH_FIND_INT(adopted, &pid, a);
+  if (a == NULL) return;
+  HASH_DEL(adopted, a);
+  if (a->fd >= 0) {
+    pm_loop_remove(a->fd);
+    close(a->fd);
   }
+  free(a);
+  if (adopted == NULL) pm_timer_cancel(&adopted_poll);
+}
+
+static void adopted_exited(pid_t pid)
+{
+  process_struct ps;
+  int i;
+  if ((i = pm_children_find(&running_children, pid)) < 0) {
+    adopted_forget(pid);
+    return;
+  }
+  child_view(&running_children, i, &ps);
+  pm_children_remove_at(&running_children, i);
+  child_reaped(pid);
+  ps.status = ESRCH;
+  if (adopted_changed_status) adopted_changed_status(&ps);
+  stop_finished(pid, ps.status);
+}
+
+static void adopted_pidfd_readable(int fd, int events, void *data)
+{
+  adopted_exited(((pm_adopted_t *) data)->pid);
+}
+
+static void adopted_poll_fired(void *data)
+{
+  pm_adopted_t *a, *next;
+  unsigned long long start_time;
+  for (a = adopted; a != NULL; a = next) {
+    next = a->hh.next;
+    // Gone, or gone and its pid taken since
+    if (a->fd < 0 && (pm_stats_start_time(a->pid, &start_time) || start_time != a->start_time)) adopted_exited(a->pid);
+  }
+  for (a = adopted; a != NULL; a = a->hh.next)
+    if (a->fd < 0) {
+      pm_timer_add(&adopted_poll, PM_ADOPTED_POLL_MS, adopted_poll_fired, NULL);
+      break;
+    }
+}
+
+static int pidfd_open(pid_t pid)
+{
+#if defined(__linux__) && defined(SYS_pidfd_open)
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
 
+static int adopt(pm_journal_entry_t *e)
+{
+  pm_adopted_t *a;
+  if ((a = (pm_adopted_t *) calloc(1, sizeof(pm_adopted_t))) == NULL) return -1;
+  if (pm_children_add(&running_children, e->pid, e->transId) < 0) {
+    free(a);
+    return -1;
+  }
+  a->pid = e->pid;
+  a->start_time = e->start_time;
+  if ((a->fd = pidfd_open(a->pid)) >= 0 && pm_loop_add(a->fd, PM_LOOP_READ, adopted_pidfd_readable, a) < 0) {
+    close(a->fd);
+    a->fd = -1;
+  }
+  if (a->fd < 0 && !pm_timer_pending(&adopted_poll)) pm_timer_add(&adopted_poll, PM_ADOPTED_POLL_MS, adopted_poll_fired, NULL);
+  HASH_ADD_INT(adopted, pid, a);
   return 0;
 }
 
-int pm_next_loop(void (*child_changed_status)(process_struct *ps))
+/**
+* pm_adopt_children
+* @description
+*   Take on every child the journal says a daemon before us left
+*   running, as long as it's still the same process, and let cb know
+*   about each one. From here on they're running children like any
+*   other: status, stats, kill and stop all work, and their exit goes
+*   to child_changed_status. The rest is dropped from the journal
+* @return
+*   int - how many were adopted
+**/
+int pm_adopt_children(pm_adopted_cb cb, void (*child_changed_status)(process_struct *ps))
 {
-  sigsetjmp(saved_jump_buf, 1); pm_can_jump = 0;
+  pm_journal_entry_t *e, *next;
+  unsigned long long start_time;
+  int n = 0;
 
-  while (!terminated && (HASH_COUNT(exited_children) > 0 || signaled)) pm_check_children(child_changed_status, terminated);
-  pm_check_pending_processes(); // Check for pending signals arrived while we were in the signal handler
+  adopted_changed_status = child_changed_status;
+  for (e = pm_journal_entries(); e != NULL; e = next) {
+    next = e->hh.next;
+    if (pm_children_find(&running_children, e->pid) >= 0) continue;
+    // Gone, or its pid has been taken since
+    if (pm_stats_start_time(e->pid, &start_time) || start_time != e->start_time || adopt(e) < 0) {
+      pm_journal_remove(e->pid);
+      continue;
+    }
+    debug(dbg, 1, "adopted pid %d (%s)\n", e->pid, e->app);
+    if (cb) cb(e->pid, e->app);
+    n++;
+  }
+  // Start out with only what's live
+  pm_journal_compact();
+  return n;
+}
 
-  pm_can_jump = 1;
-  if (terminated) return -1;
-  else return 0;
+/* Is pid a stage of a pipeline, or a run command waiting on its after hook? */
+static int is_pipeline_pid(pid_t pid)
+{
+  pm_pipeline_t *pl;
+  for (pl = pipelines; pl != NULL; pl = pl->hh.next)
+    if (pl->stage_pid == pid || (pl->spawn && !pl->command_exited && pl->ret->pid == pid)) return 1;
+  return 0;
 }
 
-void pm_set_can_jump() {pm_can_jump = 1;}
-void pm_set_can_not_jump() {pm_can_jump = 0;}
+/* Is pid the stop command of a stop? */
+static int is_stop_action(pid_t pid)
+{
+  pm_stop_t *stop;
+  for (stop = stops; stop != NULL; stop = stop->hh.next)
+    if (stop->action_pid == pid) return 1;
+  return 0;
+}
 
-int setup_pm_pending_alarm()
+/**
+* As a subreaper the exits of processes we never started come to us too.
+* Every thread's children are listed under /proc/self/task, reap each of
+* them that has exited and isn't anything we're tracking (those are all
+* waited on by pid). A tracked one that's waiting to be reaped doesn't
+* hold up the orphans behind it
+**/
+static void reap_orphans()
 {
-  struct itimerval tval;
-  struct timeval interval = {0, 20000};
+  struct dirent *entry;
+  siginfo_t info;
+  char path[PATH_MAX];
+  DIR *tasks;
+  FILE *f;
+  pid_t pid;
+  // One of those may not be known yet
+  if (pm_spawner_in_flight() > 0) return;
+  if ((tasks = opendir("/proc/self/task")) == NULL) return;
+  while ((entry = readdir(tasks)) != NULL) {
+    if (entry->d_name[0] == '.') continue;
+    snprintf(path, sizeof(path), "/proc/self/task/%s/children", entry->d_name);
+    if ((f = fopen(path, "r")) == NULL) continue;
+    while (fscanf(f, "%d", &pid) == 1) {
+      if (pm_children_find(&running_children, pid) >= 0 || is_stop_action(pid) || is_pipeline_pid(pid)) continue;
+      memset(&info, 0, sizeof(info));
+      waitid(P_PID, pid, &info, WEXITED | WNOHANG);
+    }
+    fclose(f);
+  }
+  closedir(tasks);
+}
+
+/**
+* Sweep every running child, poking at it with waitpid and kill
+* This costs two syscalls per running child on every call
+**/
+static int pm_sweep_children(void (*child_changed_status)(process_struct *ps), int isTerminated)
+{
+  pm_child_table_t *t = &running_children;
+  process_struct ps;
+  pm_stop_t *stop;
+  pm_pipeline_t *pl, *pltmp;
+  int p_status = 0;
+  int status, i;
+  
+  // Run through each of the running children and poke at them to see
+  // if they are running or not. Back to front, removing one moves the
+  // last one into its place
+  for (i = t->count - 1; i >= 0; i--) {
+    // Prevent zombies...
+    while ((p_status = waitpid(t->pid[i], &status, WNOHANG)) < 0 && errno == EINTR);
+    if (p_status == t->pid[i]) t->status[i] = status;
+    
+    if ((p_status = pm_check_pid_status(t->pid[i])) < 0 && errno == ESRCH) {
+      // Now if the pid has most definitely disappeared, then we can 
+      // send the status change and remove the pid from tracking
+      child_view(t, i, &ps);
+      pm_children_remove_at(t, i);
+      child_reaped(ps.pid);
+      if (!ps.status) ps.status = ESRCH;
+      if (restart_child_exited(ps.pid, ps.status, child_changed_status)) continue;
+      child_changed_status(&ps);
+      stop_finished(ps.pid, ps.status);
+    }
+  }
   
-  tval.it_interval = interval;
-  tval.it_value = interval;
-  setitimer(ITIMER_REAL, &tval, NULL);
+  // Stop commands are children too
+  for (stop = stops; stop != NULL; stop = stop->hh.next)
+    if (stop->action_pid > 0 && waitpid(stop->action_pid, &status, WNOHANG) == stop->action_pid) stop->action_pid = 0;
   
-  struct sigaction spending;
-  spending.sa_handler = pm_gotsignal;
-  sigemptyset(&spending.sa_mask);
-  spending.sa_flags = 0;
-  sigaction(SIGALRM, &spending, NULL);
+  if (subreaper) reap_orphans();
+  abandoned_reaped(0);
   
+  // And every pipeline stage, plus the commands still waiting on an after hook
+  for (pl = pipelines; pl != NULL; pl = pltmp) {
+    pltmp = pl->hh.next;
+    if (pl->spawn && !pl->command_exited && waitpid(pl->ret->pid, &status, WNOHANG) == pl->ret->pid)
+      pm_pipeline_child_exited(pl->ret->pid, status, child_changed_status);
+    if (waitpid(pl->stage_pid, &status, WNOHANG) == pl->stage_pid) {
+      pm_pipeline_child_exited(pl->stage_pid, status, child_changed_status);
+      // That may have finished (or started) any number of pipelines
+      pltmp = pipelines;
+    }
+  }
+
   return 0;
 }
 
-
-int pm_check_pending_processes()
+/**
+* Drain every exited child with waitpid(-1) and look each one up
+* The cost is one syscall per exited child plus one, no matter how many are running
+**/
+static int pm_drain_children(void (*child_changed_status)(process_struct *ps), int isTerminated)
 {
-  int sig = 0;
-  sigset_t sigset;
-  setup_pm_pending_alarm();
-  if ((sigemptyset(&sigset) == -1)
-      || (sigaddset(&sigset, SIGALRM) == -1)
-      || (sigaddset(&sigset, SIGINT) == -1)
-      || (sigaddset(&sigset, SIGTERM) == -1)
-      || (sigprocmask( SIG_BLOCK, &sigset, NULL) == -1)
-     )
-    perror("Failed to block signals before sigwait\n");
-  
-  if (sigpending(&sigset) == 0) {
-    while (errno == EINTR)
-      if (sigwait(&sigset, &sig) == -1) {
-        perror("sigwait");
-        return -1;
-      }
-    pm_gotsignal(sig);
+  process_struct ps;
+  pid_t pid;
+  int status, i;
+  
+  while ((pid = waitpid(-1, &status, WNOHANG)) != 0) {
+    if (pid < 0) {
+      if (errno == EINTR) continue;
+      break; // ECHILD, nothing left to wait for
+    }
+    // Not a running child, maybe a stage of a pipeline or one a worker just spawned
+    if ((i = pm_children_find(&running_children, pid)) < 0) {
+      if (!abandoned_reaped(pid) && !pm_pipeline_child_exited(pid, status, child_changed_status) && !stop_action_exited(pid) && pm_spawner_in_flight() > 0)
+        stash_early_exit(pid, status);
+      continue;
+    }
+    
+    child_view(&running_children, i, &ps);
+    pm_children_remove_at(&running_children, i);
+    child_reaped(pid);
+    ps.status = status;
+    if (restart_child_exited(pid, status, child_changed_status)) continue;
+    child_changed_status(&ps);
+    stop_finished(pid, status);
   }
   return 0;
 }
 
+int pm_set_reap_mode(enum ReapModeT mode)
+{
+  reap_mode = mode;
+  return 0;
+}
+
+int pm_check_children(void (*child_changed_status)(process_struct *ps), int isTerminated)
+{
+  if (reap_mode == PM_REAP_SWEEP)
+    return pm_sweep_children(child_changed_status, isTerminated);
+  else
+    return pm_drain_children(child_changed_status, isTerminated);
+}
 
 // Privates
 int pm_malloc_and_set_attribute(char **ptr, char *value)
@@ -612,10 +1875,21 @@ int pm_malloc_and_set_attribute(char **ptr, char *value)
 static int safe_chdir(const char *pathname)
 {
   int res;
-  if ((res = chdir(pathname)) < 0) {
-    perror("chdir failed");
-    exit(-1);
-  }
+  if ((res = chdir(pathname)) < 0)
+    child_failed("chdir failed\n", -1);
 
   return res;
 }
+
+/**
+* child_failed
+* @description
+*   Give up in a forked child. Another thread may have held a stdio or
+*   malloc lock when we forked, so only write(2) and _exit(2) are safe
+**/
+static void child_failed(const char *msg, int status)
+{
+  ssize_t ignored = write(STDERR_FILENO, msg, strlen(msg));
+  (void)ignored;
+  _exit(status);
+}
@@ -12,12 +12,21 @@
 #include <limits.h>
 #include <signal.h>
 #include <sys/time.h>             // For timeval struct
+#include <sys/resource.h>         // For setpriority
 #include <sys/wait.h>             // For waitpid
 #include <time.h>                 // For time function
+#include <spawn.h>                // For posix_spawn
 
-#include <setjmp.h>
 #include "uthash.h"
 #include "pm_helpers.h"
+#include "pm_output.h"
+#include "pm_spawner.h"
+#include "pm_arena.h"
+#include "pm_children.h"
+#include "pm_timer.h"
+#include "pm_cgroup.h"
+#include "pm_stats.h"
+#include "pm_journal.h"
 
 #include "print_helpers.h"
 
@@ -29,6 +38,31 @@ typedef struct _process_return_t_ {
   enum ProcessReturnState stage;        // At what stage the process exited
 } process_return_t;
 
+/* What happens to a run command once it exits: never restarted, restarted unless it exited 0, always restarted */
+enum RestartPolicyT {PM_RESTART_TEMPORARY, PM_RESTART_TRANSIENT, PM_RESTART_PERMANENT};
+
+/* Defaults of a restart policy, the same intensity a supervisor starts out with */
+#ifndef PM_RESTART_MAX
+#define PM_RESTART_MAX            3
+#endif
+#ifndef PM_RESTART_WINDOW_MS
+#define PM_RESTART_WINDOW_MS      5000
+#endif
+#ifndef PM_RESTART_BACKOFF_MS
+#define PM_RESTART_BACKOFF_MS     100
+#endif
+#ifndef PM_RESTART_MAX_BACKOFF_MS
+#define PM_RESTART_MAX_BACKOFF_MS 30000
+#endif
+
+typedef struct _pm_restart_policy_t_ {
+  enum RestartPolicyT policy;
+  int     max_restarts;     // More restarts than this in window_ms and it stays down
+  int     window_ms;
+  int     backoff_ms;       // Wait before the first restart of a window, doubled on every one after it
+  int     max_backoff_ms;
+} pm_restart_policy_t;      // 0 takes the default
+
 /* Types */
 typedef struct _process_t_ {
   char**  env;
@@ -42,32 +76,95 @@ typedef struct _process_t_ {
   char*   stderr;
   int     nice;
   pid_t   pid;            // Used only when kill is the action
+  int     signal;         // Used only when kill is the action, SIGKILL unless given
   int     transId;        // Communication id
+  int     timeout;        // Used only when stop is the action, ms before SIGKILL
+  pm_cgroup_limits_t cgroup;  // Limits of the command, it gets a cgroup of its own if any are set
+  pm_restart_policy_t restart;  // Of a run command, temporary unless given
+  char*   app;            // What a run command is journaled as, for the daemon that adopts it
+  pid_t*  pids;           // Used only when stats is the action
+  int     pids_c;
+  pm_arena_t* arena;      // Owns the process, its strings and env when set
 } process_t;
 
+/* A child as child_changed_status sees it, the children themselves live in a pm_child_table_t */
 typedef struct _process_struct_ {
     pid_t pid;                  // key
     pid_t kill_pid;             // Kill pid
     time_t deadline;            // Deadline to kill the pid
     int status;                 // Status of the pid
+    int signal;                 // Last signal sent to the pid, 0 if none
     int transId;                // id of the transmission
-    UT_hash_handle hh;          // makes this structure hashable
 } process_struct;
 
+/* How long a stop waits on a child before it sends SIGKILL */
+#ifndef PM_STOP_TIMEOUT_MS
+#define PM_STOP_TIMEOUT_MS 5000
+#endif
+
+/* Callback for a stopped child that has been reaped */
+typedef void (*pm_stop_done_cb)(pid_t pid, int status, void *data);
+
+/* Callback for a run command that exited and was started again as new_pid */
+typedef void (*pm_restarted_cb)(pid_t old_pid, pid_t new_pid, int status);
+
+/* Callback for a child a daemon before us journaled, still running and ours now */
+typedef void (*pm_adopted_cb)(pid_t pid, const char *app);
+
+/* How often adopted children are looked for in /proc where there are no pidfds */
+#ifndef PM_ADOPTED_POLL_MS
+#define PM_ADOPTED_POLL_MS 1000
+#endif
+
+/* Callback for a pipeline that has run to completion, it owns process and ret */
+typedef void (*pm_pipeline_done_cb)(process_t *process, process_return_t *ret, void *data);
+
+/**
+* A run or exec request stepping through before hook -> command -> after hook
+* Every stage is started without waiting on it, the exit of the stage
+* (picked up by pm_check_children) is what starts the next one
+**/
+typedef struct _pm_pipeline_t_ {
+  pid_t stage_pid;            // key, pid of the stage that is running right now
+  int spawn;                  // run leaves the command running, exec waits for it
+  int command_exited;         // the spawned command exited while its after hook ran
+  int command_status;         // and how it exited
+  process_t *process;
+  process_return_t *ret;
+  pm_pipeline_done_cb done;
+  void *data;                 // handed back to done
+  int threaded;               // stages may go to the spawn workers
+  pm_spawn_job_t job;         // the stage a spawn worker has right now
+  struct _pm_restart_t_ *restart;   // the restart that started it, NULL for a request
+  UT_hash_handle hh;          // makes this structure hashable
+} pm_pipeline_t;
+
+/* How pm_check_children finds exited children */
+enum ReapModeT {PM_REAP_DRAIN, PM_REAP_SWEEP};
+/* How pm_execute starts children, auto uses posix_spawn whenever it can */
+enum SpawnModeT {PM_SPAWN_AUTO, PM_SPAWN_FORK};
+
+/* posix_spawn can only change directories with the _np file action */
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+#define HAVE_POSIX_SPAWN_CHDIR 1
+#endif
+
 /* Helpers */
 int pm_new_process(process_t **ptr);
+int pm_new_process_in(pm_arena_t *arena, process_t **ptr);
+process_t* pm_clone_process(process_t *p);
 process_return_t* pm_new_process_return();
 
 /* External exports */
 int pm_check_pid_status(pid_t pid);
 int pm_add_env(process_t **ptr, char *str);
+int pm_take_env(process_t *p, char *str);
 int pm_process_valid(process_t **ptr);
 int pm_free_process(process_t *p);
 int pm_free_process_return(process_return_t *p);
 
 int pm_malloc_and_set_attribute(char **ptr, char *value);
-void pm_set_can_jump();
-void pm_set_can_not_jump();
+char* pm_process_alloc(process_t *p, size_t size);
 
 /* extra helpers */
 int pm_setup(int read_handle, int write_handle);
@@ -76,10 +173,21 @@ int pm_setup(int read_handle, int write_handle);
 process_return_t* pm_run_and_spawn_process(process_t *process);
 process_return_t* pm_run_process(process_t *process);
 int pm_kill_process(process_t *process);
+int pm_signal_tree(pid_t pid, int sig);
+int pm_stop_process(process_t *process, pm_stop_done_cb done, void *data);
+int pm_process_stats(pid_t pid, pm_stats_t *stats);
+pid_t pm_start_pipeline(process_t *process, int spawn, pm_pipeline_done_cb done, void *data);
 
-pid_t pm_execute(int wait, const char* command, const char *cd, int nice, const char** env);
+pid_t pm_execute(int wait, const char* command, const char *cd, int nice, const pm_cgroup_limits_t *cgroup, const char** env, const char* stdout_spec, const char* stderr_spec);
+pid_t pm_execute_outputs(int wait, const char* command, const char *cd, int nice, const pm_cgroup_limits_t *cgroup, const char** env, const char* stdout_spec, const char* stderr_spec, pm_output_t *out);
+int pm_set_spawn_threads(int threads, void (*child_changed_status)(process_struct *ps));
+int pm_set_restart_cb(pm_restarted_cb cb);
+int pm_restarts_watched();
+int pm_adopt_children(pm_adopted_cb cb, void (*child_changed_status)(process_struct *ps));
 int pm_check_children(void (*child_changed_status)(process_struct *ps), int isTerminated);
-int pm_check_pending_processes();
-int pm_next_loop(void (*child_changed_status)(process_struct *ps));
+int pm_set_reap_mode(enum ReapModeT mode);
+int pm_set_spawn_mode(enum SpawnModeT mode);
+int pm_set_subreaper(int on);
+void pm_setup_signal_handlers();
 
 #endif
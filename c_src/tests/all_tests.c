@@ -5,6 +5,14 @@
 #include "ei_decode_test.h"
 #include "process_manager_test.h"
 #include "pm_helpers_test.h"
+#include "pm_loop_test.h"
+#include "pm_output_test.h"
+#include "pm_arena_test.h"
+#include "pm_children_test.h"
+#include "pm_timer_test.h"
+#include "pm_cgroup_test.h"
+#include "pm_stats_test.h"
+#include "pm_journal_test.h"
 
 static char * all_tests() {
   mu_run_test(test_new_process);
@@ -15,11 +23,35 @@ static char * all_tests() {
   mu_run_test(test_pm_valid_process);
   mu_run_test(test_pm_abs_path);
   mu_run_test(test_find_binary);
+  mu_run_test(test_find_binary_cache);
+  mu_run_test(test_needs_shell);
+  mu_run_test(test_argify);
   mu_run_test(test_string_index);
+  mu_run_test(test_arena_allocates_and_is_reused);
+  mu_run_test(test_child_table_finds_and_removes);
+  mu_run_test(test_timer_wheel_fires_in_order);
+  mu_run_test(test_recv_buffer_takes_bursts);
+  mu_run_test(test_replies_are_queued_and_batched);
+  mu_run_test(test_batch_is_decoded_op_by_op);
+  mu_run_test(test_packet_4_lifts_the_frame_limit);
   mu_run_test(test_starting_a_process);
   mu_run_test(test_killing_a_process);
+  mu_run_test(test_exec_without_a_shell);
+  mu_run_test(test_hooks_run_without_blocking);
+  mu_run_test(test_spawn_workers_run_pipelines);
+  mu_run_test(test_stop_escalates_to_kill);
+  mu_run_test(test_restarts_back_off_and_give_up);
+  mu_run_test(test_kill_takes_the_whole_tree);
+  mu_run_test(test_cgroup_limits_are_written);
+  mu_run_test(test_stats_are_sampled_from_proc);
+  mu_run_test(test_journal_survives_a_restart);
   mu_run_test(test_chomp_stringing);
   mu_run_test(test_running_a_process_as_a_script);
+  mu_run_test(test_loop_dispatches_readable_fds);
+  mu_run_test(test_loop_notices_child_exits);
+  mu_run_test(test_output_parse);
+  mu_run_test(test_output_pipe_rotates);
+  mu_run_test(test_output_forwards_to_erlang);
   return 0;
 }
 
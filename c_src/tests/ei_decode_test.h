@@ -1,7 +1,224 @@
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "ei_decode.h"
 #include "minunit.h"
 
 extern int tests_run;
 extern int tests_failed;
 
 /* ei decode tests */
+
+static int write_test_packet(int fd, int i)
+{
+  unsigned char packet[32];
+  int len = snprintf((char *)packet + 2, sizeof(packet) - 2, "command %d", i);
+  packet[0] = (len >> 8) & 0xff;
+  packet[1] = len & 0xff;
+  return write(fd, packet, len + 2);
+}
+
+char *test_recv_buffer_takes_bursts() {
+  ei_recv_buf_t rb;
+  unsigned char *packet;
+  char expected[32];
+  int fds[2], i, len, reads = 0, packets = 0, mangled = 0;
+  
+  memset(&rb, 0, sizeof(rb));
+  mu_assert(pipe(fds) == 0, "could not open a pipe");
+  for (i = 0; i < 1000; i++) write_test_packet(fds[1], i);
+  // Half a packet, the rest shows up later
+  write(fds[1], "\0\12comm", 6);
+  
+  while (packets < 1000 && ei_recv_fill(fds[0], &rb) > 0) {
+    reads++;
+    while ((len = ei_recv_next(&rb, &packet)) > 0) {
+      snprintf(expected, sizeof(expected), "command %d", packets++);
+      if (len != (int)strlen(expected) || memcmp(packet, expected, len)) mangled++;
+    }
+  }
+  mu_assert(packets == 1000, "not every packet came out");
+  mu_assert(mangled == 0, "a packet was mangled");
+  mu_assert(reads <= 2, "a burst of packets took a read per packet");
+  mu_assert(ei_recv_next(&rb, &packet) == 0, "handed out half a packet");
+  
+  write(fds[1], "and 42", 6);
+  mu_assert(ei_recv_fill(fds[0], &rb) == 6, "could not read the rest of the packet");
+  mu_assert(ei_recv_next(&rb, &packet) == 10 && !memcmp(packet, "command 42", 10), "the split packet was mangled");
+  
+  ei_recv_free(&rb);
+  close(fds[0]);
+  close(fds[1]);
+  return 0;
+}
+
+char *test_replies_are_queued_and_batched() {
+  ei_x_buff x;
+  unsigned char buf[4096];
+  int fds[2], i, n, got = 0, queued;
+  
+  mu_assert(pipe(fds) == 0, "could not open a pipe");
+  fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+  
+  for (i = 0; i < 100; i++) {
+    ei_reply_new(&x);
+    ei_x_encode_long(&x, i);
+    write_cmd(fds[1], &x);
+    ei_x_free(&x);
+  }
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+  mu_assert(read(fds[0], buf, sizeof(buf)) < 0, "a reply went out before the flush");
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) & ~O_NONBLOCK);
+  mu_assert(ei_reply_queued() > 0, "nothing was queued");
+  mu_assert(ei_reply_flush(fds[1]) == 0, "the queue did not go out");
+  
+  // Every reply framed with its length: version byte + small integer
+  while (got < 100 * 5 && (n = read(fds[0], buf + got, sizeof(buf) - got)) > 0) got += n;
+  mu_assert(got == 100 * 5, "replies went missing");
+  mu_assert(buf[0] == 0 && buf[1] == 3 && buf[6] == 3 && buf[9] == 1, "replies were framed wrong");
+  
+  // A full pipe keeps the rest queued instead of blocking
+  do {
+    ei_reply_new(&x);
+    ei_x_encode_binary(&x, buf, sizeof(buf));
+    write_cmd(fds[1], &x);
+  } while ((queued = ei_reply_flush(fds[1])) == 0);
+  mu_assert(queued > 0, "a full pipe did not hold replies back");
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+  while ((queued = ei_reply_flush(fds[1])) > 0)
+    while (read(fds[0], buf, sizeof(buf)) > 0) ;
+  mu_assert(queued == 0 && ei_reply_queued() == 0, "the queue did not drain");
+  
+  close(fds[0]);
+  close(fds[1]);
+  return 0;
+}
+
+char *test_batch_is_decoded_op_by_op() {
+  ei_x_buff x;
+  process_t *process = NULL;
+  pm_arena_t *arena = pm_arena_new();
+  long transId = 0;
+  int index = 0, size;
+  
+  ei_x_new_with_version(&x);
+  ei_x_encode_tuple_header(&x, 2);
+  ei_x_encode_long(&x, 7);
+  ei_x_encode_tuple_header(&x, 2);
+  ei_x_encode_atom(&x, "batch");
+  ei_x_encode_list_header(&x, 4);
+  ei_x_encode_tuple_header(&x, 3);
+  ei_x_encode_atom(&x, "exec");
+  ei_x_encode_string(&x, "ls");
+  ei_x_encode_list_header(&x, 2);
+  ei_x_encode_tuple_header(&x, 2);
+  ei_x_encode_atom(&x, "cd");
+  ei_x_encode_string(&x, "/tmp");
+  ei_x_encode_tuple_header(&x, 2);
+  ei_x_encode_atom(&x, "env");
+  ei_x_encode_string(&x, "BOB=sally");
+  ei_x_encode_empty_list(&x);
+  ei_x_encode_tuple_header(&x, 2);
+  ei_x_encode_atom(&x, "status");
+  ei_x_encode_long(&x, 42);
+  ei_x_encode_tuple_header(&x, 2);
+  ei_x_encode_atom(&x, "kill");
+  ei_x_encode_long(&x, 43);
+  ei_x_encode_tuple_header(&x, 2);
+  ei_x_encode_atom(&x, "stats");
+  ei_x_encode_list_header(&x, 2);
+  ei_x_encode_long(&x, 44);
+  ei_x_encode_long(&x, 45);
+  ei_x_encode_empty_list(&x);
+  ei_x_encode_empty_list(&x);
+  
+  mu_assert(ei_decode_request_header(x.buff, &index, &transId) == 0, "the request header did not decode");
+  mu_assert(transId == 7, "the transId was lost");
+  mu_assert((size = ei_decode_batch_header(x.buff, &index)) == 4, "the batch was not recognized");
+  
+  // The options list of a run or exec is stepped over, tail and all
+  // and everything the batch decodes into comes out of its arena
+  mu_assert(ei_decode_action(x.buff, &index, transId, arena, &process) == BS_EXEC, "the exec op did not decode");
+  mu_assert(!strcmp(process->cd, "/tmp"), "the options of the exec op were lost");
+  mu_assert(process->env_c == 1 && !strcmp(process->env[0], "BOB=sally") && process->env[1] == NULL, "the env of the exec op was lost");
+  mu_assert(process->arena == arena, "the exec op was not decoded into the arena");
+  pm_free_process(process);
+  mu_assert(!strcmp(process->command, "ls"), "freeing a process took it out from under its arena");
+  mu_assert(ei_decode_action(x.buff, &index, transId, arena, &process) == BS_STATUS, "the first op did not decode");
+  mu_assert(process->pid == 42 && process->transId == 7, "the first op was mangled");
+  pm_free_process(process);
+  mu_assert(ei_decode_action(x.buff, &index, transId, arena, &process) == BS_KILL, "the second op did not decode");
+  mu_assert(process->pid == 43, "the second op was mangled");
+  pm_free_process(process);
+  mu_assert(ei_decode_action(x.buff, &index, transId, arena, &process) == BS_STATS, "the stats op did not decode");
+  mu_assert(process->pids_c == 2 && process->pids[0] == 44 && process->pids[1] == 45, "the pids of the stats op were mangled");
+  // Only the tail of the batch is left
+  mu_assert(index == x.index - 1, "the stats op was not decoded to its end");
+  pm_free_process(process);
+  pm_arena_free(arena);
+  
+  // A plain request is left for ei_decode_action
+  ei_x_free(&x);
+  ei_x_new_with_version(&x);
+  ei_x_encode_tuple_header(&x, 2);
+  ei_x_encode_long(&x, 8);
+  ei_x_encode_tuple_header(&x, 2);
+  ei_x_encode_atom(&x, "status");
+  ei_x_encode_long(&x, 44);
+  index = 0;
+  ei_decode_request_header(x.buff, &index, &transId);
+  size = index;
+  mu_assert(ei_decode_batch_header(x.buff, &index) == -1 && index == size, "a single request was taken for a batch");
+  mu_assert(ei_decode_action(x.buff, &index, transId, NULL, &process) == BS_STATUS, "the single op did not decode");
+  pm_free_process(process);
+  ei_x_free(&x);
+  return 0;
+}
+
+char *test_packet_4_lifts_the_frame_limit() {
+  ei_recv_buf_t rb;
+  ei_x_buff x;
+  unsigned char *packet, *big;
+  int fds[2], len = 200000, got = 0, n;
+  
+  // {packet, 2} can't describe a reply that big, the caller hears about it instead
+  mu_assert(pipe(fds) == 0, "could not open a pipe");
+  big = (unsigned char *) calloc(1, len + 16);
+  ei_reply_new(&x);
+  ei_x_encode_tuple_header(&x, 2);
+  ei_x_encode_long(&x, 9);
+  ei_x_encode_binary(&x, big, len);
+  mu_assert(write_cmd(fds[1], &x) > 0 && x.buff == NULL, "the oversized reply was not swapped for an error");
+  ei_reply_flush(fds[1]);
+  n = read(fds[0], big, len);
+  mu_assert(n > 2 && n < 200 && ((big[0] << 8) | big[1]) == n - 2, "the error reply was framed wrong");
+  
+  // With 4 byte headers it goes out whole
+  mu_assert(ei_set_packet(3) == -1, "a 3 byte header was taken");
+  mu_assert(ei_set_packet(4) == 0, "could not switch to {packet, 4}");
+  ei_reply_new(&x);
+  ei_x_encode_binary(&x, big, len);
+  mu_assert(write_cmd(fds[1], &x) > len, "the big reply was not queued");
+  fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+  memset(&rb, 0, sizeof(rb));
+  while (got == 0) {
+    ei_reply_flush(fds[1]);
+    mu_assert(ei_recv_fill(fds[0], &rb) > 0, "the big reply did not arrive");
+    got = ei_recv_next(&rb, &packet);
+  }
+  mu_assert(got == len + 6, "the big reply was cut short");
+  
+  // A length past EI_PACKET_MAX_SZ is refused instead of buffered
+  write(fds[1], "\177\377\377\377", 4);
+  mu_assert(ei_recv_fill(fds[0], &rb) > 0, "the header did not arrive");
+  mu_assert(ei_recv_next(&rb, &packet) == 0, "a bogus packet was handed out");
+  mu_assert(ei_recv_fill(fds[0], &rb) < 0 && errno == EMSGSIZE, "a bogus length was taken");
+  
+  ei_set_packet(2);
+  ei_recv_free(&rb);
+  free(big);
+  close(fds[0]);
+  close(fds[1]);
+  return 0;
+}
@@ -0,0 +1,32 @@
+#include <stdio.h>
+#include <string.h>
+#include "pm_arena.h"
+#include "minunit.h"
+#include "test_helper.h"
+
+char *test_arena_allocates_and_is_reused() {
+  pm_arena_t *arena = pm_arena_new(), *again;
+  char *small, *big, *str;
+  int i, pooled;
+
+  mu_assert(arena != NULL, "could not make an arena");
+  for (i = 0; i < 1000; i++) {
+    small = (char *) pm_arena_alloc(arena, 1 + i % 30);
+    mu_assert(((size_t)small % PM_ARENA_ALIGN) == 0, "an allocation was not aligned");
+    memset(small, 'x', 1 + i % 30);
+  }
+  // Bigger than a block, gets one of its own
+  big = (char *) pm_arena_calloc(arena, PM_ARENA_BLOCK_SZ * 4);
+  mu_assert(big != NULL && big[PM_ARENA_BLOCK_SZ * 4 - 1] == 0, "a big allocation was not zeroed");
+  str = pm_arena_strdup(arena, "BOB=sally");
+  mu_assert(!strcmp(str, "BOB=sally"), "strdup mangled the string");
+
+  pooled = pm_arena_pooled();
+  pm_arena_free(arena);
+  mu_assert(pm_arena_pooled() == pooled + 1, "a freed arena did not go back on the pool");
+  again = pm_arena_new();
+  mu_assert(again == arena, "the pooled arena was not reused");
+  mu_assert(again->blocks == NULL, "the pooled arena kept its extra blocks");
+  pm_arena_free(again);
+  return 0;
+}
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <string.h>
+#include "pm_cgroup.h"
+#include "process_manager.h"
+#include "minunit.h"
+#include "test_helper.h"
+
+#define CGROUP_TEST_ROOT "/tmp/bs_cgroup_test"
+
+static int cgroup_test_read(pid_t pid, const char *name, char *buf, size_t size)
+{
+  char path[256];
+  FILE *f;
+  size_t len;
+  snprintf(path, sizeof(path), CGROUP_TEST_ROOT "/" PM_CGROUP_LEAF_FMT "/%s", pid, name);
+  if ((f = fopen(path, "r")) == NULL) return -1;
+  len = fread(buf, 1, size - 1, f);
+  buf[len] = '\0';
+  fclose(f);
+  return 0;
+}
+
+// A plain directory stands in for the delegated root, the files written are all there is to see
+char *test_cgroup_limits_are_written() {
+  pm_cgroup_limits_t limits;
+  pm_cgroup_usage_t usage;
+  pm_stats_t stats;
+  char buf[128];
+  FILE *f;
+  pid_t pid;
+
+  system("rm -rf " CGROUP_TEST_ROOT " && mkdir " CGROUP_TEST_ROOT);
+  memset(&limits, 0, sizeof(limits));
+  mu_assert(!pm_cgroup_wanted(&limits) && !pm_cgroup_wanted(NULL), "no limits wanted a cgroup");
+  mu_assert(pm_cgroup_place(getpid(), &limits) == -1 && errno == ENOTSUP, "placed a pid without a root");
+  mu_assert(pm_cgroup_set_root(CGROUP_TEST_ROOT "/missing") == -1, "took a root that isn't there");
+  mu_assert(pm_cgroup_set_root(CGROUP_TEST_ROOT) == 0, "could not set the root");
+
+  limits.memory_max = 64 * 1024 * 1024;
+  limits.cpu_max = "50000 100000";
+  limits.pids_max = 16;
+  mu_assert(pm_cgroup_wanted(&limits), "limits didn't want a cgroup");
+  pid = pm_execute(0, "/bin/sleep 2", NULL, INT_MAX, &limits, NULL, NULL, NULL);
+  mu_assert(pid > 0, "the limited command didn't start");
+  mu_assert(cgroup_test_read(pid, "memory.max", buf, sizeof(buf)) == 0 && !strcmp(buf, "67108864"), "memory.max was not written");
+  mu_assert(cgroup_test_read(pid, "cpu.max", buf, sizeof(buf)) == 0 && !strcmp(buf, "50000 100000"), "cpu.max was not written");
+  mu_assert(cgroup_test_read(pid, "pids.max", buf, sizeof(buf)) == 0 && !strcmp(buf, "16"), "pids.max was not written");
+  mu_assert(cgroup_test_read(pid, "cpu.weight", buf, sizeof(buf)) == -1, "a limit that wasn't asked for was written");
+  mu_assert(cgroup_test_read(pid, "cgroup.procs", buf, sizeof(buf)) == 0 && atoi(buf) == pid, "the pid was not moved in");
+
+  // What the kernel would report back
+  snprintf(buf, sizeof(buf), CGROUP_TEST_ROOT "/" PM_CGROUP_LEAF_FMT "/cpu.stat", pid);
+  f = fopen(buf, "w");
+  fputs("usage_usec 1500\nuser_usec 1000\nsystem_usec 500\nnr_periods 0\n", f);
+  fclose(f);
+  mu_assert(pm_cgroup_usage(pid, &usage) == 0, "could not read the usage back");
+  mu_assert(usage.cpu_usage_usec == 1500 && usage.cpu_user_usec == 1000 && usage.cpu_system_usec == 500, "cpu.stat was misread");
+  mu_assert(usage.memory_current == 0, "made up a memory.current");
+  mu_assert(pm_cgroup_usage(pid + 1, &usage) == -1, "read the usage of a pid without a leaf");
+  mu_assert(pm_process_stats(pid, &stats) == 0 && stats.limited && stats.cgroup.cpu_usage_usec == 1500, "the usage of the leaf was not in the stats");
+  mu_assert(pm_process_stats(getpid(), &stats) == 0 && !stats.limited, "stats of a pid without a leaf had a leaf");
+
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+
+  // It's in its leaf before the command gets to run
+  pid = pm_execute(0, "cat " CGROUP_TEST_ROOT "/bs-$$/cgroup.procs > " CGROUP_TEST_ROOT "/seen", NULL, INT_MAX, &limits, NULL, NULL, NULL);
+  mu_assert(pid > 0, "the limited shell command didn't start");
+  waitpid(pid, NULL, 0);
+  f = fopen(CGROUP_TEST_ROOT "/seen", "r");
+  mu_assert(f && fgets(buf, sizeof(buf), f) && atoi(buf) == pid, "the command ran before it was in its leaf");
+  fclose(f);
+
+  // A leftover leaf something still lives in isn't reused
+  snprintf(buf, sizeof(buf), "mkdir " CGROUP_TEST_ROOT "/" PM_CGROUP_LEAF_FMT " && echo 1 > " CGROUP_TEST_ROOT "/" PM_CGROUP_LEAF_FMT "/cgroup.procs", getpid(), getpid());
+  system(buf);
+  mu_assert(pm_cgroup_place(getpid(), &limits) == -1, "a busy leftover leaf was reused");
+  mu_assert(cgroup_test_read(getpid(), "cgroup.procs", buf, sizeof(buf)) == 0 && atoi(buf) == 1, "a busy leftover leaf was written to");
+  pm_cgroup_set_root(NULL);
+  system("rm -rf " CGROUP_TEST_ROOT);
+  return 0;
+}
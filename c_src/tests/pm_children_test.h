@@ -0,0 +1,54 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pm_children.h"
+#include "minunit.h"
+#include "test_helper.h"
+
+char *test_child_table_finds_and_removes() {
+  pm_child_table_t t;
+  char *tracked = (char *) calloc(20000, 1);
+  int i, n = 0, pid, lost = 0, stale = 0;
+
+  pm_children_init(&t);
+  mu_assert(pm_children_find(&t, 42) == -1, "found a child in an empty table");
+  mu_assert(pm_children_add(&t, 42, 7) == 0, "could not add a child");
+  mu_assert(pm_children_add(&t, 42, 8) == 0 && pm_children_count(&t) == 1, "added the same pid twice");
+  mu_assert(t.transId[pm_children_find(&t, 42)] == 7, "the child was mangled");
+  mu_assert(pm_children_remove(&t, 42) == 0 && pm_children_count(&t) == 0, "could not remove the child");
+  mu_assert(pm_children_remove(&t, 42) == -1, "removed a child that was already gone");
+
+  // Children coming and going at random, checked against what we expect
+  srand(7);
+  for (i = 0; i < 100000; i++) {
+    pid = 1 + rand() % 20000;
+    if (tracked[pid - 1]) {
+      if (pm_children_remove(&t, pid)) lost++;
+      tracked[pid - 1] = 0;
+      n--;
+    } else {
+      if (pm_children_add(&t, pid, pid) < 0) lost++;
+      tracked[pid - 1] = 1;
+      n++;
+    }
+  }
+  mu_assert(lost == 0, "an add or a remove failed");
+  mu_assert(pm_children_count(&t) == n, "the table lost count");
+  for (pid = 1; pid <= 20000; pid++) {
+    i = pm_children_find(&t, pid);
+    if (tracked[pid - 1] ? (i < 0 || t.pid[i] != pid || t.transId[i] != pid) : i >= 0) stale++;
+  }
+  mu_assert(stale == 0, "a lookup disagreed with what was added and removed");
+
+  // Walking back to front while removing sees every child once
+  for (i = t.count - 1; i >= 0; i--) {
+    tracked[t.pid[i] - 1] = 0;
+    pm_children_remove_at(&t, i);
+  }
+  for (pid = 0; pid < 20000; pid++) if (tracked[pid]) stale++;
+  mu_assert(stale == 0 && pm_children_count(&t) == 0, "the walk missed a child");
+
+  pm_children_free(&t);
+  free(tracked);
+  return 0;
+}
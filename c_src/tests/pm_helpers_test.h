@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "pm_helpers.h"
 #include "minunit.h"
 #include "test_helper.h"
@@ -40,3 +41,61 @@ char *test_safe_quoting_string() {
   mu_assert(!strcmp(str_safe_quote("hello \"world\""), "hello \"world\""), "str_safe_quote failed?");
   return 0;
 }
+
+char *test_find_binary_cache() {
+  char dir[] = "/tmp/babysitter_path.XXXXXX";
+  char bin[BUFFER_SZ];
+  char *old_path = strdup(getenv("PATH"));
+  const char *found;
+  
+  mu_assert(mkdtemp(dir) != NULL, "could not make a temporary PATH directory");
+  snprintf(bin, BUFFER_SZ, "%s/bs_cached_binary", dir);
+  setenv("PATH", dir, 1);
+  
+  mu_assert(!strcmp(find_binary("bs_cached_binary"), "bs_cached_binary"), "bs_cached_binary was found before it existed");
+  
+  FILE *fp = fopen(bin, "w"); fclose(fp);
+  chmod(bin, 0755);
+  found = find_binary("bs_cached_binary");
+  mu_assert(!strcmp(found, bin), "a new binary on the PATH didn't invalidate the cache");
+  mu_assert(find_binary("bs_cached_binary") == found, "a repeated lookup was not served from the cache");
+  
+  unlink(bin);
+  mu_assert(!strcmp(find_binary("bs_cached_binary"), "bs_cached_binary"), "a removed binary didn't invalidate the cache");
+  
+  rmdir(dir);
+  setenv("PATH", old_path, 1);
+  free(old_path);
+  return 0;
+}
+
+char *test_needs_shell() {
+  mu_assert(pm_needs_shell("/bin/sleep 10") == 0, "a plain command needs a shell");
+  mu_assert(pm_needs_shell("  ruby app.rb --port=8080") == 0, "an option with an = needs a shell");
+  mu_assert(pm_needs_shell("echo 'hello world' > /tmp/file") == 1, "redirection does not need a shell");
+  mu_assert(pm_needs_shell("ls *.c") == 1, "globbing does not need a shell");
+  mu_assert(pm_needs_shell("echo $HOME") == 1, "variable expansion does not need a shell");
+  mu_assert(pm_needs_shell("a && b") == 1, "command lists do not need a shell");
+  mu_assert(pm_needs_shell("RAILS_ENV=production rackup") == 1, "a leading assignment does not need a shell");
+  mu_assert(pm_needs_shell("exec ruby app.rb") == 1, "exec does not need a shell");
+  mu_assert(pm_needs_shell("cd /srv") == 1, "cd does not need a shell");
+  mu_assert(pm_needs_shell("ulimit -n 4096") == 1, "ulimit does not need a shell");
+  mu_assert(pm_needs_shell(". env.sh") == 1, ". does not need a shell");
+  mu_assert(pm_needs_shell("source env.sh") == 1, "source does not need a shell");
+  mu_assert(pm_needs_shell("  export X") == 1, "export does not need a shell");
+  mu_assert(pm_needs_shell("exit") == 1, "exit does not need a shell");
+  mu_assert(pm_needs_shell("set -e") == 1, "set does not need a shell");
+  mu_assert(pm_needs_shell("umask 022") == 1, "umask does not need a shell");
+  mu_assert(pm_needs_shell("executor run") == 0, "a command named like a builtin needs a shell");
+  return 0;
+}
+
+char *test_argify() {
+  char **argv = NULL;
+  mu_assert(argify("  /bin/sleep   10 ", &argv) == 2, "argify miscounted the arguments");
+  mu_assert(!strcmp(argv[0], "/bin/sleep"), "argify got the wrong command");
+  mu_assert(!strcmp(argv[1], "10"), "argify got the wrong argument");
+  mu_assert(argv[2] == NULL, "argify did not NULL terminate argv");
+  free(argv[0]); free(argv[1]); free(argv);
+  return 0;
+}
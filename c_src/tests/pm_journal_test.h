@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "pm_journal.h"
+#include "process_manager.h"
+#include "pm_loop.h"
+#include "minunit.h"
+#include "test_helper.h"
+
+#define JOURNAL_TEST_FILE "/tmp/bs_journal_test"
+
+extern pm_child_table_t running_children;
+
+static pm_journal_entry_t* journal_test_find(pid_t pid)
+{
+  pm_journal_entry_t *e;
+  for (e = pm_journal_entries(); e != NULL; e = e->hh.next)
+    if (e->pid == pid) return e;
+  return NULL;
+}
+
+static int journal_test_adopted = 0;
+static process_struct journal_test_exit;
+static void journal_test_adopt(pid_t pid, const char *app) { if (!strcmp(app, "sleeper")) journal_test_adopted++; }
+static void journal_test_child(process_struct *ps) { journal_test_exit = *ps; }
+
+char *test_journal_survives_a_restart() {
+  pm_journal_entry_t *e;
+  unsigned long long start_time;
+  struct stat before, after;
+  FILE *f;
+  pid_t pid = 0;
+  int i, tries;
+
+  unlink(JOURNAL_TEST_FILE);
+  mu_assert(pm_journal_open(JOURNAL_TEST_FILE) == 0, "could not open the journal");
+  pm_journal_add(101, 5000, 1, "web");
+  pm_journal_add(102, 5001, 2, "a name much too long to fit in the journal as it is given");
+  pm_journal_add(103, 5002, 3, NULL);
+  pm_journal_remove(102);
+  pm_journal_close();
+  mu_assert(!pm_journal_enabled() && pm_journal_entries() == NULL, "the journal outlived its close");
+
+  // What was live is read back
+  mu_assert(pm_journal_open(JOURNAL_TEST_FILE) == 0, "could not open the journal again");
+  mu_assert(HASH_COUNT(pm_journal_entries()) == 2, "the journal was not read back");
+  e = journal_test_find(101);
+  mu_assert(e && e->start_time == 5000 && e->transId == 1 && !strcmp(e->app, "web"), "an entry was misread");
+  mu_assert(journal_test_find(102) == NULL, "a removed entry came back");
+
+  // Filling it up compacts it rather than growing it
+  stat(JOURNAL_TEST_FILE, &before);
+  for (i = 0; i < 4 * PM_JOURNAL_RECORDS; i++) {
+    pm_journal_add(1000 + i % 8, 1, 0, "churn");
+    pm_journal_remove(1000 + i % 8);
+  }
+  stat(JOURNAL_TEST_FILE, &after);
+  mu_assert(HASH_COUNT(pm_journal_entries()) == 2, "churn was left in the journal");
+  mu_assert(after.st_size == before.st_size, "the journal grew rather than being compacted");
+  mu_assert(access(JOURNAL_TEST_FILE ".tmp", F_OK) != 0, "the compacted journal was left beside the old one");
+  pm_journal_close();
+  mu_assert(pm_journal_open(JOURNAL_TEST_FILE) == 0 && HASH_COUNT(pm_journal_entries()) == 2, "the compacted journal was not read back");
+
+  // Orphaned to init, so it's nobody's child of ours, and journaled next to one whose pid was reused
+  system("/bin/sleep 30 > /dev/null & echo $! > " JOURNAL_TEST_FILE ".pid");
+  if ((f = fopen(JOURNAL_TEST_FILE ".pid", "r")) != NULL) {
+    if (fscanf(f, "%d", &pid) != 1) pid = 0;
+    fclose(f);
+  }
+  mu_assert(pid > 0 && pm_stats_start_time(pid, &start_time) == 0, "the orphan did not start");
+  pm_journal_add(pid, start_time, 7, "sleeper");
+  pm_journal_add(getpid(), start_time + 1, 8, "reused");
+  pm_journal_close();
+
+  pm_loop_init();
+  mu_assert(pm_journal_open(JOURNAL_TEST_FILE) == 0, "could not open the journal again");
+  journal_test_adopted = 0;
+  memset(&journal_test_exit, 0, sizeof(journal_test_exit));
+  mu_assert(pm_adopt_children(journal_test_adopt, journal_test_child) == 1 && journal_test_adopted == 1, "the orphan was not adopted");
+  mu_assert(journal_test_find(pid) && HASH_COUNT(pm_journal_entries()) == 1, "what wasn't adopted was left in the journal");
+  mu_assert(pm_children_find(&running_children, pid) >= 0, "the orphan is not a running child");
+
+  // Its exit comes in off of the loop
+  kill(pid, SIGKILL);
+  for (tries = 0; tries < 200 && journal_test_exit.pid == 0; tries++) {
+    pm_loop_run_once(10);
+    pm_timer_run_due();
+  }
+  mu_assert(journal_test_exit.pid == pid && journal_test_exit.status == ESRCH, "the exit of the orphan was not noticed");
+  mu_assert(pm_children_find(&running_children, pid) < 0 && pm_journal_entries() == NULL, "the orphan outlived its exit");
+
+  pm_journal_close();
+  pm_loop_close();
+  unlink(JOURNAL_TEST_FILE);
+  unlink(JOURNAL_TEST_FILE ".pid");
+  return 0;
+}
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "pm_loop.h"
+#include "minunit.h"
+#include "test_helper.h"
+
+static int loop_test_signo = 0;
+static int loop_test_reads = 0;
+
+static void loop_test_gotsignal(int signo) { loop_test_signo = signo; }
+static void loop_test_readable(int fd, int events, void *data)
+{
+  char c;
+  if (read(fd, &c, 1) == 1) loop_test_reads++;
+}
+
+char *test_loop_dispatches_readable_fds() {
+  int fds[2];
+  mu_assert(pipe(fds) == 0, "could not create a pipe");
+  mu_assert(pm_loop_init() == 0, "could not create the event loop");
+  mu_assert(pm_loop_add(fds[0], PM_LOOP_READ, loop_test_readable, NULL) == 0, "could not watch the pipe");
+  
+  mu_assert(pm_loop_run_once(0) == 0, "an empty pipe was reported as ready");
+  mu_assert(write(fds[1], "x", 1) == 1, "could not write to the pipe");
+  pm_loop_run_once(1000);
+  mu_assert(loop_test_reads == 1, "the readable callback was not called");
+  
+  pm_loop_remove(fds[0]);
+  mu_assert(write(fds[1], "x", 1) == 1, "could not write to the pipe");
+  pm_loop_run_once(0);
+  mu_assert(loop_test_reads == 1, "a removed fd was still dispatched");
+  
+  close(fds[0]); close(fds[1]);
+  pm_loop_close();
+  return 0;
+}
+
+char *test_loop_notices_child_exits() {
+  sigset_t sigset;
+  int tries = 0;
+  sigemptyset(&sigset);
+  sigaddset(&sigset, SIGCHLD);
+  
+  mu_assert(pm_loop_init() == 0, "could not create the event loop");
+  mu_assert(pm_loop_watch_signals(&sigset, loop_test_gotsignal) == 0, "could not watch for SIGCHLD");
+  
+  pid_t pid = fork();
+  if (pid == 0) _exit(0);
+  while (!loop_test_signo && tries++ < 50) pm_loop_run_once(100);
+  mu_assert(loop_test_signo == SIGCHLD, "the child exit never showed up on the loop");
+  
+  waitpid(pid, NULL, 0);
+  pm_loop_close();
+  sigprocmask(SIG_UNBLOCK, &sigset, NULL);
+  return 0;
+}
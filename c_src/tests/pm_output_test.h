@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "pm_output.h"
+#include "pm_loop.h"
+#include "process_manager.h"
+#include "minunit.h"
+#include "test_helper.h"
+
+char *test_output_parse() {
+  pm_output_t out;
+  
+  mu_assert(pm_output_parse(NULL, 1, &out) == 0 && out.mode == PM_OUTPUT_APPEND, "stdout should append to the output file by default");
+  mu_assert(pm_output_parse(NULL, 2, &out) == 0 && out.mode == PM_OUTPUT_STDOUT, "stderr should follow stdout by default");
+  mu_assert(pm_output_parse("null", 1, &out) == 0 && out.mode == PM_OUTPUT_NULL, "null was not parsed");
+  mu_assert(pm_output_parse("/tmp/out.log", 1, &out) == 0 && out.mode == PM_OUTPUT_FILE, "a bare path should be a file");
+  mu_assert(!strcmp(out.path, "/tmp/out.log"), "the path of a file target was mangled");
+  mu_assert(pm_output_parse("append:/tmp/out.log", 1, &out) == 0 && out.mode == PM_OUTPUT_APPEND, "append was not parsed");
+  mu_assert(pm_output_parse("pipe:/tmp/out.log", 2, &out) == 0 && out.mode == PM_OUTPUT_PIPE, "pipe was not parsed");
+  mu_assert(!strcmp(out.path, "/tmp/out.log"), "the path of a pipe target was mangled");
+  mu_assert(pm_output_parse("stdout", 1, &out) == -1, "stdout can't follow itself");
+  mu_assert(pm_output_parse("pipe:", 1, &out) == -1, "a pipe needs a path");
+  return 0;
+}
+
+char *test_output_pipe_rotates() {
+  const char *log = "/tmp/bs_output_test.log";
+  char rotated[64];
+  struct stat st;
+  off_t total;
+  pid_t pid;
+  int status, tries;
+  
+  snprintf(rotated, sizeof(rotated), "%s.1", log);
+  unlink(log);
+  unlink(rotated);
+  
+  pm_loop_init();
+  pm_output_set_rotation(4096, 1);
+  pid = pm_execute(0, "/bin/dd if=/dev/zero bs=1024 count=6", NULL, INT_MAX, NULL, NULL, "pipe:/tmp/bs_output_test.log", "null");
+  mu_assert(pid > 0, "could not start the process");
+  waitpid(pid, &status, 0);
+  
+  // The daemon does the writing, off of the loop, until the pipe closes
+  for (tries = 0; tries < 100 && stat(rotated, &st) != 0; tries++) pm_loop_run_once(10);
+  for (tries = 0; tries < 10; tries++) pm_loop_run_once(10);
+  
+  mu_assert(stat(rotated, &st) == 0, "the pipe target was never rotated");
+  mu_assert(st.st_size >= 4096, "the rotated file is short");
+  total = st.st_size;
+  mu_assert(stat(log, &st) == 0, "the pipe target was not reopened after rotating");
+  mu_assert(total + st.st_size == 6 * 1024, "output went missing across the rotation");
+  
+  pm_output_set_rotation(PM_OUTPUT_ROTATE_SIZE, PM_OUTPUT_ROTATE_COUNT);
+  unlink(log);
+  unlink(rotated);
+  return 0;
+}
+
+static char output_test_buf[256];
+static int output_test_len = 0;
+static int output_test_refuse = 0;
+static int output_test_forward(pid_t pid, int fd, const char *buf, int len)
+{
+  // Play a congested port for the first few chunks
+  if (output_test_refuse > 0) {
+    output_test_refuse--;
+    return -1;
+  }
+  if (output_test_len + len < (int)sizeof(output_test_buf)) {
+    memcpy(output_test_buf + output_test_len, buf, len);
+    output_test_len += len;
+  }
+  return 0;
+}
+
+char *test_output_forwards_to_erlang() {
+  pid_t pid;
+  int status, tries;
+  
+  pm_loop_init();
+  pm_output_set_forwarder(output_test_forward, 0);
+  output_test_len = 0;
+  output_test_refuse = 1;
+  pid = pm_execute(0, "/bin/echo forwarded", NULL, INT_MAX, NULL, NULL, "erlang", "null");
+  mu_assert(pid > 0, "could not start the process");
+  waitpid(pid, &status, 0);
+  
+  for (tries = 0; tries < 20 && output_test_refuse > 0; tries++) pm_loop_run_once(10);
+  mu_assert(output_test_refuse == 0, "the output was never offered");
+  mu_assert(output_test_len == 0, "output went out over a congested port");
+  
+  // Held back until the port drains
+  pm_output_resume_forwarding();
+  for (tries = 0; tries < 20 && output_test_len == 0; tries++) pm_loop_run_once(10);
+  mu_assert(output_test_len == 10 && !strncmp(output_test_buf, "forwarded\n", 10), "the output did not make it through");
+  
+  pm_output_set_forwarder(NULL, 0);
+  return 0;
+}
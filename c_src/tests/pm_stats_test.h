@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <string.h>
+#include "pm_stats.h"
+#include "process_manager.h"
+#include "minunit.h"
+#include "test_helper.h"
+
+char *test_stats_are_sampled_from_proc() {
+  pm_stats_t stats;
+  pid_t pid;
+
+  // Ourselves, opened and closed for the one sample
+  mu_assert(pm_stats_sample(getpid(), 0, &stats) == 0 && stats.err == 0, "could not sample ourselves");
+  mu_assert(stats.pid == getpid() && stats.rss > 0 && stats.threads >= 1, "the sample was empty");
+  mu_assert(stats.fds >= 3, "the fds were not counted");
+  mu_assert(pm_stats_cached() == 0, "kept a directory that wasn't asked for");
+  mu_assert(pm_stats_sample(0, 0, &stats) == -1 && stats.err == ESRCH, "sampled pid 0");
+
+  // A child keeps its directory until it's forgotten
+  pid = pm_execute(0, "/bin/sleep 5", NULL, INT_MAX, NULL, NULL, NULL, NULL);
+  mu_assert(pid > 0, "the child didn't start");
+  mu_assert(pm_stats_sample(pid, 1, &stats) == 0 && pm_stats_cached() == 1, "the directory of the child was not kept");
+  mu_assert(pm_stats_sample(pid, 1, &stats) == 0 && pm_stats_cached() == 1 && stats.threads == 1, "the kept directory was not reused");
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  // Never reads as whatever has that pid now
+  mu_assert(pm_stats_sample(pid, 1, &stats) == -1 && stats.err == ESRCH, "sampled a child that's gone");
+  pm_stats_forget(pid);
+  mu_assert(pm_stats_cached() == 0, "the directory outlived the child");
+  return 0;
+}
@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <string.h>
+#include "pm_timer.h"
+#include "minunit.h"
+#include "test_helper.h"
+
+static int timer_test_fired[8];
+static long timer_test_at[8];
+static long timer_test_now;
+
+static void timer_test_cb(void *data)
+{
+  int which = (int)(long)data;
+  timer_test_fired[which]++;
+  timer_test_at[which] = timer_test_now;
+}
+
+char *test_timer_wheel_fires_in_order() {
+  pm_timer_t timers[8];
+  // Due on the first wheel, a few ticks out on the second and third, and one that's cancelled
+  long after[] = {30, 250, 1000, 5000, 60000, 700000, 100, 2000};
+  long base = pm_timer_now_ms();
+  int i, late = 0, early = 0;
+
+  memset(timers, 0, sizeof(timers));
+  memset(timer_test_fired, 0, sizeof(timer_test_fired));
+  for (i = 0; i < 8; i++) pm_timer_add(&timers[i], after[i], timer_test_cb, (void *)(long)i);
+  mu_assert(pm_timer_count() == 8, "a timer went missing");
+  mu_assert(pm_timer_next_timeout() >= 0, "the wheel doesn't know it has timers");
+  pm_timer_cancel(&timers[6]);
+  mu_assert(!pm_timer_pending(&timers[6]) && pm_timer_count() == 7, "the timer was not cancelled");
+  // Moving a pending timer
+  pm_timer_add(&timers[7], 3000, timer_test_cb, (void *)(long)7);
+  mu_assert(pm_timer_count() == 7, "moving a timer counted it twice");
+
+  // Step through time a bit at a time, the way the loop does
+  for (timer_test_now = base; timer_test_now < base + 800000; timer_test_now += 7)
+    pm_timer_advance(timer_test_now);
+
+  for (i = 0; i < 8; i++) {
+    long want = i == 7 ? 3000 : after[i];
+    if (i == 6) continue;
+    mu_assert(timer_test_fired[i] == 1, "a timer did not fire exactly once");
+    // Within a tick of when it was due (plus the step)
+    if (timer_test_at[i] - base > want + 2 * PM_TIMER_TICK_MS + 7) late++;
+    if (timer_test_at[i] - base < want - PM_TIMER_TICK_MS) early++;
+  }
+  mu_assert(timer_test_fired[6] == 0, "a cancelled timer fired");
+  mu_assert(late == 0, "a timer fired late");
+  mu_assert(early == 0, "a timer fired early");
+  mu_assert(pm_timer_count() == 0 && pm_timer_next_timeout() == -1, "the wheel isn't empty");
+  return 0;
+}
@@ -2,9 +2,12 @@
 #include <string.h>
 #include <unistd.h>
 #include "process_manager.h"
+#include "pm_loop.h"
 #include "minunit.h"
 #include "test_helper.h"
 
+extern pm_child_table_t running_children;
+
 char *test_new_process() {
   process_t *test_process = NULL;
   pm_new_process(&test_process);
@@ -88,25 +91,33 @@ char *test_starting_a_process()
 char *test_running_a_process_as_a_script()
 {
   process_t *test_process = NULL;
+  struct stat buffer;
+  int mode, status;
   pm_new_process(&test_process);
   mu_assert(!pm_malloc_and_set_attribute(&test_process->command, "#!/bin/bash\ntouch /tmp/blah"), "copy command failed");
   
-  pm_run_process(test_process);
-  
-  struct stat buffer;
-  
-  int status = stat("/tmp/blah", &buffer);
-  mu_assert(status == 0, "command to run didn't work");
-  unlink("/tmp/blah");
+  // The script fd is close-on-exec, both ways of spawning have to hand it on
+  for (mode = PM_SPAWN_AUTO; mode <= PM_SPAWN_FORK; mode++) {
+    pm_set_spawn_mode(mode);
+    pm_run_process(test_process);
+    status = stat("/tmp/blah", &buffer);
+    mu_assert(status == 0, "command to run didn't work");
+    unlink("/tmp/blah");
+  }
+  pm_set_spawn_mode(PM_SPAWN_AUTO);
   
   pm_free_process(test_process); return 0;
 }
 
+static int kill_test_status = -1;
+static void kill_test_child(process_struct *ps) { kill_test_status = ps->status; }
+
 char *test_killing_a_process()
 {
   process_t *test_process = NULL;
   process_t *test_process2 = NULL;
   process_return_t *ret = NULL;
+  int tries;
   
   pm_new_process(&test_process);
   pm_new_process(&test_process2);
@@ -114,11 +125,423 @@ char *test_killing_a_process()
   mu_assert(!pm_malloc_and_set_attribute(&test_process->command, "/bin/sleep 102"), "copy command failed");
   ret = pm_run_and_spawn_process(test_process);
   test_process2->pid = ret->pid;
-  pm_kill_process(test_process2);
+  test_process2->signal = SIGTERM;
+  kill_test_status = -1;
+  mu_assert(pm_kill_process(test_process2) == 0, "the signal did not go out");
   
+  // Nothing waited on it, its exit turns up like any other
+  for (tries = 0; tries < 200 && kill_test_status == -1; tries++) {
+    usleep(10000);
+    pm_check_children(kill_test_child, 0);
+  }
+  mu_assert(WIFSIGNALED(kill_test_status) && WTERMSIG(kill_test_status) == SIGTERM, "the exit of the process was not reported");
   mu_assert(kill(ret->pid, 0) != 0, "process did not die");
+  mu_assert(pm_kill_process(test_process2) == -1 && errno == ESRCH, "killed a process that's gone");
   
-  kill(ret->pid, SIGKILL); // Kill it entirely
+  pm_free_process_return(ret);
   pm_free_process(test_process2);
   pm_free_process(test_process); return 0;
 }
+
+char *test_exec_without_a_shell()
+{
+  process_t *test_process = NULL;
+  process_return_t *ret = NULL;
+  pm_new_process(&test_process);
+  
+  mu_assert(!pm_malloc_and_set_attribute(&test_process->command, "sleep 103"), "copy command failed");
+  ret = pm_run_and_spawn_process(test_process);
+  mu_assert(kill(ret->pid, 0) == 0, "process did not start");
+#ifdef __linux__
+  char link[64], exe[PATH_MAX];
+  ssize_t n;
+  snprintf(link, sizeof(link), "/proc/%d/exe", ret->pid);
+  mu_assert((n = readlink(link, exe, sizeof(exe) - 1)) > 0, "could not read the exe of the process");
+  exe[n] = '\0';
+  mu_assert(strstr(exe, "sleep") != NULL, "the pid belongs to a shell instead of the command");
+#endif
+  
+  kill(ret->pid, SIGKILL);
+  waitpid(ret->pid, NULL, 0);
+  pm_free_process_return(ret);
+  pm_free_process(test_process);
+  
+  // Builtins have no binary to exec, they still go to the shell
+  pm_new_process(&test_process);
+  mu_assert(!pm_malloc_and_set_attribute(&test_process->command, "ulimit -n 256"), "copy command failed");
+  ret = pm_run_process(test_process);
+  mu_assert(ret->stage == PRS_OKAY && ret->exit_status == 0, "a builtin was not run by the shell");
+  pm_free_process_return(ret);
+  pm_free_process(test_process); return 0;
+}
+
+static process_return_t *pipeline_test_ret = NULL;
+static void pipeline_test_done(process_t *process, process_return_t *ret, void *data)
+{
+  pipeline_test_ret = ret;
+  pm_free_process(process);
+}
+static void pipeline_test_child(process_struct *ps) {}
+
+char *test_hooks_run_without_blocking()
+{
+  process_t *test_process = NULL;
+  int tries;
+  pm_new_process(&test_process);
+  
+  mu_assert(!pm_malloc_and_set_attribute(&test_process->before, "/bin/sleep 0.2"), "copy before failed");
+  mu_assert(!pm_malloc_and_set_attribute(&test_process->command, "/bin/mkdir /tmp/bs_pipeline_test"), "copy command failed");
+  mu_assert(!pm_malloc_and_set_attribute(&test_process->after, "/bin/rmdir /tmp/bs_pipeline_test"), "copy after failed");
+  
+  pipeline_test_ret = NULL;
+  mu_assert(pm_start_pipeline(test_process, 0, pipeline_test_done, NULL) > 0, "the before hook did not start");
+  mu_assert(pipeline_test_ret == NULL, "the pipeline waited on the before hook");
+  
+  // Every exit moves the pipeline along a stage
+  for (tries = 0; tries < 200 && pipeline_test_ret == NULL; tries++) {
+    usleep(10000);
+    pm_check_children(pipeline_test_child, 0);
+  }
+  mu_assert(pipeline_test_ret != NULL, "the pipeline never finished");
+  mu_assert(pipeline_test_ret->stage == PRS_OKAY, "the pipeline did not get through every stage");
+  mu_assert(access("/tmp/bs_pipeline_test", F_OK) != 0, "the after hook did not run");
+  pm_free_process_return(pipeline_test_ret);
+  
+  // A failing before hook stops the pipeline before the command runs
+  pm_new_process(&test_process);
+  mu_assert(!pm_malloc_and_set_attribute(&test_process->before, "/bin/false"), "copy before failed");
+  mu_assert(!pm_malloc_and_set_attribute(&test_process->command, "/bin/mkdir /tmp/bs_pipeline_test"), "copy command failed");
+  pipeline_test_ret = NULL;
+  pm_start_pipeline(test_process, 0, pipeline_test_done, NULL);
+  for (tries = 0; tries < 200 && pipeline_test_ret == NULL; tries++) {
+    usleep(10000);
+    pm_check_children(pipeline_test_child, 0);
+  }
+  mu_assert(pipeline_test_ret != NULL, "the pipeline never finished");
+  mu_assert(pipeline_test_ret->stage == PRS_BEFORE, "the failed hook was not reported");
+  mu_assert(pipeline_test_ret->exit_status == 1, "the exit status of the hook was lost");
+  mu_assert(access("/tmp/bs_pipeline_test", F_OK) != 0, "the command ran after a failed hook");
+  pm_free_process_return(pipeline_test_ret);
+  return 0;
+}
+
+static int spawn_test_exits = 0;
+static void spawn_test_child(process_struct *ps) { spawn_test_exits++; }
+
+char *test_spawn_workers_run_pipelines()
+{
+  process_t *test_process = NULL;
+  int tries;
+  
+  pm_loop_init();
+  mu_assert(pm_set_spawn_threads(2, spawn_test_child) == 0, "the spawn workers did not start");
+  
+  // The stage goes to a worker, nothing is running by the time we get control back
+  pm_new_process(&test_process);
+  mu_assert(!pm_malloc_and_set_attribute(&test_process->before, "/bin/true"), "copy before failed");
+  mu_assert(!pm_malloc_and_set_attribute(&test_process->command, "/bin/sh -c 'exit 3'"), "copy command failed");
+  pipeline_test_ret = NULL;
+  mu_assert(pm_start_pipeline(test_process, 0, pipeline_test_done, NULL) == 0, "the before hook was spawned on the loop");
+  for (tries = 0; tries < 200 && pipeline_test_ret == NULL; tries++) {
+    pm_loop_run_once(10);
+    pm_check_children(spawn_test_child, 0);
+  }
+  mu_assert(pipeline_test_ret != NULL, "the pipeline never finished");
+  mu_assert(pipeline_test_ret->stage == PRS_COMMAND && pipeline_test_ret->exit_status == 3, "the exit of the command was lost");
+  pm_free_process_return(pipeline_test_ret);
+  
+  // A run command that's gone before its spawn comes back still gets reported
+  pm_new_process(&test_process);
+  mu_assert(!pm_malloc_and_set_attribute(&test_process->command, "/bin/true"), "copy command failed");
+  pipeline_test_ret = NULL;
+  spawn_test_exits = 0;
+  pm_start_pipeline(test_process, 1, pipeline_test_done, NULL);
+  for (tries = 0; tries < 200 && (pipeline_test_ret == NULL || spawn_test_exits == 0); tries++) {
+    pm_loop_run_once(10);
+    pm_check_children(spawn_test_child, 0);
+  }
+  mu_assert(pipeline_test_ret != NULL && pipeline_test_ret->stage == PRS_OKAY, "the run did not go through");
+  mu_assert(spawn_test_exits == 1, "the exit of the run command was not reported");
+  pm_free_process_return(pipeline_test_ret);
+  
+  pm_spawner_stop();
+  pm_loop_close();
+  return 0;
+}
+
+static int stop_test_status = -1;
+static void stop_test_done(pid_t pid, int status, void *data) { stop_test_status = status; }
+
+static pid_t stop_test_start(const char *command)
+{
+  process_t *test_process = NULL;
+  pid_t pid;
+  pm_new_process(&test_process);
+  pm_malloc_and_set_attribute(&test_process->command, (char *)command);
+  pipeline_test_ret = NULL;
+  pm_start_pipeline(test_process, 1, pipeline_test_done, NULL);
+  if (pipeline_test_ret == NULL || pipeline_test_ret->stage != PRS_OKAY) return -1;
+  pid = pipeline_test_ret->pid;
+  pm_free_process_return(pipeline_test_ret);
+  return pid;
+}
+
+/* Has the shell got around to its trap yet? */
+static int stop_test_ignores_term(pid_t pid)
+{
+  char path[64], line[256];
+  unsigned long long ignored = 0;
+  FILE *f;
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  if ((f = fopen(path, "r")) == NULL) return 1;
+  while (fgets(line, sizeof(line), f))
+    if (sscanf(line, "SigIgn: %llx", &ignored) == 1) break;
+  fclose(f);
+  return (ignored >> (SIGTERM - 1)) & 1;
+}
+
+char *test_stop_escalates_to_kill()
+{
+  process_t *stop = NULL;
+  long started;
+  int tries;
+  pid_t pid;
+  
+  // Goes on SIGTERM
+  mu_assert((pid = stop_test_start("/bin/sleep 10")) > 0, "the child did not start");
+  pm_new_process(&stop);
+  stop->pid = pid;
+  stop_test_status = -1;
+  mu_assert(pm_stop_process(stop, stop_test_done, NULL) == 0, "the stop did not go out");
+  mu_assert(pm_stop_process(stop, stop_test_done, NULL) == -2, "the child was stopped twice");
+  for (tries = 0; tries < 200 && stop_test_status == -1; tries++) {
+    usleep(10000);
+    pm_timer_run_due();
+    pm_check_children(pipeline_test_child, 0);
+  }
+  mu_assert(WIFSIGNALED(stop_test_status) && WTERMSIG(stop_test_status) == SIGTERM, "the child did not go on a SIGTERM");
+  mu_assert(pm_timer_count() == 0, "the timer outlived the child");
+  mu_assert(pm_stop_process(stop, stop_test_done, NULL) == -1, "stopped a child that's gone");
+  pm_free_process(stop);
+  
+  // Shrugs SIGTERM off, killed once the timeout is up
+  mu_assert((pid = stop_test_start("/bin/sh -c \"trap '' TERM; sleep 10\"")) > 0, "the child did not start");
+  for (tries = 0; tries < 500 && !stop_test_ignores_term(pid); tries++) usleep(10000);
+  pm_new_process(&stop);
+  stop->pid = pid;
+  stop->timeout = 200;
+  stop_test_status = -1;
+  started = pm_timer_now_ms();
+  mu_assert(pm_stop_process(stop, stop_test_done, NULL) == 0, "the stop did not go out");
+  for (tries = 0; tries < 300 && stop_test_status == -1; tries++) {
+    usleep(10000);
+    pm_timer_run_due();
+    pm_check_children(pipeline_test_child, 0);
+  }
+  mu_assert(WIFSIGNALED(stop_test_status) && WTERMSIG(stop_test_status) == SIGKILL, "the child was not killed");
+  mu_assert(pm_timer_now_ms() - started >= 200, "the child was killed before the timeout");
+  pm_free_process(stop);
+  return 0;
+}
+
+static int restart_test_restarts = 0;
+static pid_t restart_test_pid = 0;
+static process_struct restart_test_exit;
+static void restart_test_restarted(pid_t old_pid, pid_t new_pid, int status)
+{
+  if (old_pid == restart_test_pid) restart_test_pid = new_pid;
+  restart_test_restarts++;
+}
+// Only the child under test, anything left over from earlier tests may be reaped alongside it
+static void restart_test_child(process_struct *ps) { if (ps->pid == restart_test_pid) restart_test_exit = *ps; }
+
+static pid_t restart_test_start(const char *command, enum RestartPolicyT policy)
+{
+  process_t *test_process = NULL;
+  pm_new_process(&test_process);
+  pm_malloc_and_set_attribute(&test_process->command, (char *)command);
+  test_process->restart.policy = policy;
+  test_process->restart.max_restarts = 2;
+  test_process->restart.backoff_ms = 20;
+  test_process->restart.max_backoff_ms = 40;
+  pipeline_test_ret = NULL;
+  restart_test_restarts = 0;
+  memset(&restart_test_exit, 0, sizeof(restart_test_exit));
+  pm_start_pipeline(test_process, 1, pipeline_test_done, NULL);
+  if (pipeline_test_ret == NULL || pipeline_test_ret->stage != PRS_OKAY) return -1;
+  restart_test_pid = pipeline_test_ret->pid;
+  pm_free_process_return(pipeline_test_ret);
+  return restart_test_pid;
+}
+
+static void restart_test_wait(int tries)
+{
+  while (tries-- > 0 && restart_test_exit.pid == 0) {
+    usleep(10000);
+    pm_timer_run_due();
+    pm_check_children(restart_test_child, 0);
+  }
+}
+
+char *test_restarts_back_off_and_give_up()
+{
+  process_t *kill_process = NULL, *test_process = NULL, *stop = NULL;
+  int tries;
+  pid_t pid;
+  
+  pm_set_restart_cb(restart_test_restarted);
+  
+  // Crashes every time, comes back max_restarts times and then stays down
+  mu_assert(restart_test_start("/bin/sh -c 'exit 2'", PM_RESTART_PERMANENT) > 0, "the child did not start");
+  mu_assert(pm_restarts_watched() == 1, "the child is not watched");
+  restart_test_wait(300);
+  mu_assert(restart_test_restarts == 2, "the child was not restarted max_restarts times");
+  mu_assert(restart_test_exit.pid == restart_test_pid, "the exit was not reported under the last pid");
+  mu_assert(WIFEXITED(restart_test_exit.status) && WEXITSTATUS(restart_test_exit.status) == 2, "the last exit status was lost");
+  mu_assert(pm_restarts_watched() == 0, "the child was still watched after giving up");
+  mu_assert(pm_timer_count() == 0, "a restart timer outlived the child");
+  
+  // A clean exit is left be when it's transient
+  mu_assert(restart_test_start("/bin/true", PM_RESTART_TRANSIENT) > 0, "the child did not start");
+  restart_test_wait(300);
+  mu_assert(restart_test_exit.pid > 0 && restart_test_restarts == 0, "a clean exit was restarted");
+  mu_assert(pm_restarts_watched() == 0, "the child was still watched after its exit");
+  
+  // Asked to go, it stays gone
+  mu_assert((pid = restart_test_start("/bin/sleep 10", PM_RESTART_PERMANENT)) > 0, "the child did not start");
+  pm_new_process(&kill_process);
+  kill_process->pid = pid;
+  kill_process->signal = SIGTERM;
+  mu_assert(pm_kill_process(kill_process) == 0, "the kill did not go out");
+  restart_test_wait(300);
+  mu_assert(restart_test_exit.pid == pid && restart_test_restarts == 0, "a killed child was restarted");
+  mu_assert(pm_restarts_watched() == 0, "the killed child was still watched");
+  pm_free_process(kill_process);
+  
+  // Stopped while its before hook runs on the way back up, it's stopped once it's up
+  unlink("/tmp/bs_restart_test");
+  pm_new_process(&test_process);
+  pm_malloc_and_set_attribute(&test_process->before, "/bin/sleep 0.2");
+  pm_malloc_and_set_attribute(&test_process->command, "/bin/sh -c 'test -e /tmp/bs_restart_test || { touch /tmp/bs_restart_test; exit 2; }; exec sleep 10'");
+  test_process->restart.policy = PM_RESTART_PERMANENT;
+  test_process->restart.backoff_ms = 20;
+  pipeline_test_ret = NULL;
+  restart_test_restarts = 0;
+  pm_start_pipeline(test_process, 1, pipeline_test_done, NULL);
+  for (tries = 0; tries < 300 && pipeline_test_ret == NULL; tries++) {
+    usleep(10000);
+    pm_check_children(restart_test_child, 0);
+  }
+  mu_assert(pipeline_test_ret != NULL, "the child did not start");
+  restart_test_pid = pid = pipeline_test_ret->pid;
+  pm_free_process_return(pipeline_test_ret);
+  // Down, and its backoff is through
+  for (tries = 0; tries < 300 && (pm_children_find(&running_children, pid) >= 0 || pm_timer_count() > 0); tries++) {
+    usleep(10000);
+    pm_timer_run_due();
+    pm_check_children(restart_test_child, 0);
+  }
+  mu_assert(pm_restarts_watched() == 1 && restart_test_restarts == 0, "the child was not on its way back up");
+  pm_new_process(&stop);
+  stop->pid = pid;
+  stop_test_status = -1;
+  mu_assert(pm_stop_process(stop, stop_test_done, NULL) == 0, "a child on its way back up could not be stopped");
+  for (tries = 0; tries < 300 && stop_test_status == -1; tries++) {
+    usleep(10000);
+    pm_timer_run_due();
+    pm_check_children(restart_test_child, 0);
+  }
+  mu_assert(restart_test_restarts == 1 && restart_test_pid != pid, "the child did not come back up");
+  mu_assert(WIFSIGNALED(stop_test_status) && WTERMSIG(stop_test_status) == SIGTERM, "the child that came back was not stopped");
+  mu_assert(pm_restarts_watched() == 0 && pm_children_find(&running_children, restart_test_pid) < 0, "the stopped child was kept");
+  pm_free_process(stop);
+  unlink("/tmp/bs_restart_test");
+  
+  pm_set_restart_cb(NULL);
+  return 0;
+}
+
+/* Processes in the group pid leads, other than pid */
+static int tree_test_descendants(pid_t pid)
+{
+  pm_stats_t stats;
+  if (pm_process_stats(pid, &stats) < 0 || pm_stats_count_descendants(&stats, 1) < 0) return -1;
+  return stats.descendants;
+}
+
+static int tree_test_wait(pid_t pid, int descendants)
+{
+  int tries;
+  for (tries = 0; tries < 300 && tree_test_descendants(pid) != descendants; tries++) usleep(10000);
+  return tree_test_descendants(pid) == descendants;
+}
+
+/* Until nothing is left in the group, whatever was orphaned is ours to reap */
+static int tree_test_gone(pid_t pid)
+{
+  int tries;
+  for (tries = 0; tries < 300 && kill(-pid, 0) == 0; tries++) {
+    usleep(10000);
+    pm_timer_run_due();
+    pm_check_children(pipeline_test_child, 0);
+  }
+  return kill(-pid, 0) < 0 && errno == ESRCH;
+}
+
+char *test_kill_takes_the_whole_tree()
+{
+  process_t *process = NULL;
+  pid_t pid, orphan = 0;
+  int tries;
+  FILE *f;
+  
+  mu_assert(pm_set_subreaper(1) == 0, "could not become a subreaper");
+  
+  // The shell is what we know about, the sleeps are what matter
+  mu_assert((pid = stop_test_start("/bin/sh -c 'sleep 30 & sleep 30 & wait'")) > 0, "the child did not start");
+  mu_assert(getpgid(pid) == pid, "the child does not lead a group of its own");
+  mu_assert(tree_test_wait(pid, 2), "the descendants were not counted");
+  pm_new_process(&process);
+  process->pid = pid;
+  process->signal = SIGTERM;
+  mu_assert(pm_kill_process(process) == 0, "the kill did not go out");
+  mu_assert(tree_test_gone(pid), "the kill left part of the tree running");
+  pm_free_process(process);
+  
+  // Gone on the SIGTERM, leaving behind one that ignores it
+  mu_assert((pid = stop_test_start("/bin/sh -c \"sh -c 'trap \\\"\\\" TERM; sleep 30; :' & wait\"")) > 0, "the child did not start");
+  mu_assert(tree_test_wait(pid, 2), "the descendants were not counted");
+  pm_new_process(&process);
+  process->pid = pid;
+  stop_test_status = -1;
+  mu_assert(pm_stop_process(process, stop_test_done, NULL) == 0, "the stop did not go out");
+  mu_assert(tree_test_gone(pid), "the stop left part of the tree running");
+  mu_assert(stop_test_status != -1, "the stop never finished");
+  pm_free_process(process);
+  
+  // An orphan is reaped on the first sweep, even behind a stage still to be waited on
+  pm_set_reap_mode(PM_REAP_SWEEP);
+  pm_new_process(&process);
+  pm_malloc_and_set_attribute(&process->before, "/bin/true");
+  pm_malloc_and_set_attribute(&process->command, "/bin/true");
+  pipeline_test_ret = NULL;
+  pm_start_pipeline(process, 0, pipeline_test_done, NULL);
+  system("/bin/sleep 0.1 > /dev/null & echo $! > /tmp/bs_orphan_test");
+  f = fopen("/tmp/bs_orphan_test", "r");
+  mu_assert(f && fscanf(f, "%d", &orphan) == 1, "the orphan did not start");
+  fclose(f);
+  unlink("/tmp/bs_orphan_test");
+  usleep(300000);
+  pm_check_children(pipeline_test_child, 0);
+  mu_assert(kill(orphan, 0) < 0 && errno == ESRCH, "the orphan was left a zombie");
+  for (tries = 0; tries < 300 && pipeline_test_ret == NULL; tries++) {
+    usleep(10000);
+    pm_check_children(pipeline_test_child, 0);
+  }
+  mu_assert(pipeline_test_ret != NULL, "the pipeline never finished");
+  pm_free_process_return(pipeline_test_ret);
+  pm_set_reap_mode(PM_REAP_DRAIN);
+  
+  pm_set_subreaper(0);
+  return 0;
+}
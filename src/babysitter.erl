@@ -13,15 +13,19 @@
   run/3,
   running/1,
   status/1,
-  list/0
+  list/0,
+  batch/1,
+  stop_process/1, stop_process/2,
+  stats/1,
+  port_stats/0
 ]).
 % PRIVATE
 % These are exported for testing reasons only
 -export ([
-  bs_spawn_run/2, bs_run/2, kill_pid/1
+  bs_spawn_run/2, bs_run/2, kill_pid/1, kill_pid/2
 ]).
 
--export([start_link/0, start_link/1, stop/0]).
+-export([start_link/0, start_link/1, start_link/2, stop/0]).
 
 %% gen_server callbacks
 -export([init/1, handle_call/3, handle_cast/2, handle_info/2,
@@ -33,6 +37,10 @@
 ]).
 
 -define(SERVER, ?MODULE).
+% {packet, 4} so that big env lists, scripts and lists of pids fit in one frame
+-define(DEFAULT_PACKET, 4).
+% An exec waits on its command, so transactions don't time out unless asked to
+-define(DEFAULT_TRANS_TIMEOUT, infinity).
 
 %%====================================================================
 %% API
@@ -51,14 +59,17 @@ run(AppType, Action, Opts) ->
     [] -> DefaultCommand;
     E -> E
   end,
-  Options = convert_config_to_runable_proplist([{do_before, 1}, {do_after, 3}], Config, Opts),
+  % Journaled under the app, so whoever adopts it knows what it is
+  Options = [{app, AppType}|convert_config_to_runable_proplist([{do_before, 1}, {do_after, 3}], Config, Opts)],
   
   case Command of
     [] -> {error, no_command};
     _ ->
+      % Everything an app does goes through the same port program
+      Shard = babysitter_pool:pick(AppType),
       case Action of
-        start -> bs_spawn_run(Command, Options);
-        _E -> bs_run(Command, Options)
+        start -> call(Shard, {run, Command, Options});
+        _E -> call(Shard, {exec, Command, Options})
       end
   end.
 
@@ -74,23 +85,96 @@ running(Pid) ->
 %% @end
 %% @{4:@private}
 %%-------------------------------------------------------------------
-bs_spawn_run(Command, Options) -> gen_server:call(?SERVER, {port, {run, Command, Options}}, infinity).
+bs_spawn_run(Command, Options) -> call(babysitter_pool:pick(Command), {run, Command, Options}).
 % Give a maximum of 100 seconds to preform an action
-bs_run(Command, Options) -> gen_server:call(?SERVER, {port, {exec, Command, Options}}, infinity).
-kill_pid(Pid) -> gen_server:call(?SERVER, {port, {kill, Pid}}, infinity).
-status(Pid) -> gen_server:call(?SERVER, {port, {status, Pid}}, infinity).
-list() -> gen_server:call(?SERVER, {port, {list}}, infinity).
+bs_run(Command, Options) -> call(babysitter_pool:pick(Command), {exec, Command, Options}).
+% Returns {ok, OsPid, Signal} as soon as the signal is sent, which says nothing about
+% whether OsPid is gone yet. Its exit comes later, the Erlang process watching it
+% exits with {exit_status, Status} once it has been reaped
+% Every OsPid leads a process group of its own, the signal goes to the whole group
+kill_pid(Pid) -> call(owner(Pid), {kill, Pid}).
+kill_pid(Pid, Signal) when is_integer(Signal) -> call(owner(Pid), {kill, Pid, Signal}).
+status(Pid) -> call(owner(Pid), {status, Pid}).
+list() ->
+  OsPids = [OsPids || {ok, OsPids} <- [call(Shard, {list}) || Shard <- all_shards()]],
+  {ok, lists:append(OsPids)}.
+%%-------------------------------------------------------------------
+%% @spec (Ops::list()) -> {ok, [Reply]}
+%% @doc Send a list of {run, Command, Options}, {exec, Command, Options},
+%%      {kill, OsPid}, {kill, OsPid, Signal}, {stop, OsPid, Options},
+%%      {status, OsPid}, {stats, [OsPid]} or {list} to the port program in
+%%      one message. They are run in order and answered together, with a
+%%      reply for every op in the order they were given
+%% @end
+%%-------------------------------------------------------------------
+batch(Ops) -> call(babysitter_pool:pick(Ops), {batch, Ops}).
+%%-------------------------------------------------------------------
+%% @spec (OsPid::integer(), Options::proplist()) ->
+%%          {exit_status, OsPid, Status} | {error, Reason}
+%% @doc Stop OsPid and wait for it to go. It gets a SIGTERM, or the stop
+%%      command given as {command, Cmd} ({app, AppType} uses the stop
+%%      command configured for the app), run with BABYSITTER_PID set to
+%%      OsPid. If it is still around {timeout, Ms} later it is killed
+%% @end
+%%-------------------------------------------------------------------
+stop_process(OsPid) -> stop_process(OsPid, []).
+stop_process(OsPid, Options) -> call(owner(OsPid), {stop, OsPid, build_stop_opts(Options, [])}).
+%%-------------------------------------------------------------------
+%% @spec (OsPids::[integer()]) -> {ok, [{OsPid, Stats} | {OsPid, {error, Reason}}]}
+%% @doc What each of OsPids is using right now, read out of /proc by the
+%%      port program that owns it. Stats is [{rss, Bytes}, {utime, Ms},
+%%      {stime, Ms}, {threads, N}, {fds, N}, {read_bytes, Bytes},
+%%      {write_bytes, Bytes}, {descendants, N}], in the order OsPids were
+%%      given. Descendants are the other processes in the OsPid's group.
+%%      An OsPid run with cgroup limits also gets what its leaf used:
+%%      {memory_current, Bytes}, {cpu_usage_usec, Us}, {cpu_user_usec, Us}
+%%      and {cpu_system_usec, Us}
+%% @end
+%%-------------------------------------------------------------------
+stats(OsPids) ->
+  ByShard = lists:foldl(fun(OsPid, D) -> dict:append(owner(OsPid), OsPid, D) end, dict:new(), OsPids),
+  Replies = lists:append([Stats || {ok, Stats} <- [call(Shard, {stats, Pids}) || {Shard, Pids} <- dict:to_list(ByShard)]]),
+  {ok, [stats_of(OsPid, Replies) || OsPid <- OsPids]}.
+
+stats_of(OsPid, Replies) ->
+  case lists:keyfind(OsPid, 1, Replies) of
+    false -> {OsPid, {error, "no reply"}};
+    Stats -> Stats
+  end.
+%%-------------------------------------------------------------------
+%% @spec () -> [{pending, integer()} | {orphaned_replies, integer()}]
+%% @doc Transactions waiting on the port and replies that showed up
+%%      for a transaction that had already timed out
+%% @end
+%%-------------------------------------------------------------------
+port_stats() ->
+  Stats = [gen_server:call(Shard, port_stats) || Shard <- all_shards()],
+  [{Key, lists:sum([proplists:get_value(Key, S) || S <- Stats])} || Key <- [pending, orphaned_replies]].
+
+call(Shard, Request) -> gen_server:call(Shard, {port, Request}, infinity).
+
+all_shards() -> [babysitter_pool:shard_name(N) || N <- lists:seq(1, babysitter_pool:shards())].
+
+owner(OsPid) ->
+  case babysitter_pool:owner(OsPid) of
+    undefined -> ?SERVER;
+    Shard -> Shard
+  end.
   
 %%--------------------------------------------------------------------
 %% Function: start_link() -> {ok,Pid} | ignore | {error,Error}
-%% Description: Starts the server
+%% Description: Starts the server, on its own or as shard N of the
+%% pool babysitter_sup starts
 %%--------------------------------------------------------------------
 start_link() -> start_link([]).
-start_link(Options) ->
-  gen_server:start_link({local, ?SERVER}, ?SERVER, [Options], []).
+start_link(Options) -> start_link(1, Options).
+start_link(Shard, Options) ->
+  gen_server:start_link({local, babysitter_pool:shard_name(Shard)}, ?SERVER, [Shard, Options], []).
 
+%% Stops every shard along with its port program. Shards babysitter_sup
+%% started are permanent and get restarted, stop the supervisor instead
 stop() ->
-  gen_server:call(?SERVER, stop).
+  lists:foreach(fun(Shard) -> gen_server:call(Shard, stop) end, all_shards()).
 %%====================================================================
 %% gen_server callbacks
 %%====================================================================
@@ -102,10 +186,13 @@ stop() ->
 %%                         {stop, Reason}
 %% Description: Initiates the server
 %%--------------------------------------------------------------------
-init([Options]) ->
+init([Shard, Options]) ->
   process_flag(trap_exit, true),  
-  Exe   = build_port_command(Options),
+  babysitter_pool:init_tables(),
+  Exe   = build_port_command([{shard, Shard}|Options]),
   Debug = proplists:get_value(verbose, Options, default(verbose)),
+  Packet = proplists:get_value(packet, Options, ?DEFAULT_PACKET),
+  TransTimeout = proplists:get_value(trans_timeout, Options, ?DEFAULT_TRANS_TIMEOUT),
   % Config = proplists:get_value(config_dir, Options, default(config_dir)),
   try
     babysitter_config:init()
@@ -115,8 +202,8 @@ init([Options]) ->
   end,
   try
     debug(Debug, "exec: port program: ~s\n", [Exe]),
-    Port = erlang:open_port({spawn, Exe}, [binary, exit_status, {packet, 2}, nouse_stdio, hide]),
-    {ok, #state{port=Port, debug=Debug}}
+    Port = erlang:open_port({spawn, Exe}, [binary, exit_status, {packet, Packet}, nouse_stdio, hide]),
+    {ok, #state{port=Port, shard=Shard, debug=Debug, trans_timeout=TransTimeout}}
   catch _:Reason ->
     {stop, {error, {port_could_not_start, Exe, Reason}}}
   end.
@@ -135,8 +222,17 @@ handle_call({port, {run, Command, Options}}, From, #state{last_trans=_Last} = St
 handle_call({port, {exec, Command, Options}}, From, #state{last_trans=_Last} = State) -> 
   handle_port_call({exec, Command, build_exec_opts(Options, [])}, From, State);
 handle_call({port, {kill, OsPid}}, From, #state{last_trans=_Last} = State) -> handle_port_call({kill, OsPid}, From, State);
+handle_call({port, {kill, OsPid, Signal}}, From, #state{last_trans=_Last} = State) -> handle_port_call({kill, OsPid, Signal}, From, State);
+handle_call({port, {stop, OsPid, Options}}, From, #state{last_trans=_Last} = State) -> handle_port_call({stop, OsPid, Options}, From, State);
 handle_call({port, {status, OsPid}}, From, #state{last_trans=_Last} = State) -> handle_port_call({status, OsPid}, From, State);
 handle_call({port, {list}}, From, #state{last_trans=_Last} = State) -> handle_port_call({list}, From, State);
+handle_call({port, {stats, OsPids}}, From, #state{last_trans=_Last} = State) -> handle_port_call({stats, OsPids}, From, State);
+handle_call({port, {batch, Ops}}, From, #state{last_trans=_Last} = State) ->
+  handle_port_call({batch, [build_batch_op(Op) || Op <- Ops]}, From, State);
+handle_call(port_stats, _From, #state{trans = Trans, orphaned = Orphaned} = State) ->
+  {reply, [{pending, dict:size(Trans)}, {orphaned_replies, Orphaned}], State};
+handle_call(stop, _From, State) ->
+  {stop, normal, ok, State};
 handle_call(_Request, _From, State) ->
   Reply = ok,
   {reply, Reply, State}.
@@ -156,30 +252,72 @@ handle_cast(_Msg, State) ->
 %%                                       {stop, Reason, State}
 %% Description: Handling all non call/cast messages
 %%--------------------------------------------------------------------
-handle_info({Port, {data, Bin}}, #state{port=Port, debug=Debug, trans = Trans} = State) ->
+handle_info({Port, {data, Bin}}, #state{port=Port, debug=Debug, trans = Trans, orphaned = Orphaned} = State) ->
   Term = erlang:binary_to_term(Bin),
   case Term of
     {0, {exit_status, OsPid, Status}} ->
         debug(Debug, "Pid ~w exited with status: {~w,~w}\n", [OsPid, (Status band 16#FF00 bsr 8), Status band 127]),
         os_process:notify_ospid_owner(OsPid, Status),
+        babysitter_pool:release(OsPid),
+        {noreply, State};
+    {0, {restarted, OldOsPid, NewOsPid, Status}} ->
+        % Exited and brought back by the port program, see the restart option
+        debug(Debug, "Pid ~w restarted as ~w after status: {~w,~w}\n", [OldOsPid, NewOsPid, (Status band 16#FF00 bsr 8), Status band 127]),
+        os_process:notify_restarted(OldOsPid, NewOsPid, Status),
+        babysitter_pool:release(OldOsPid),
+        babysitter_pool:claim(NewOsPid, State#state.shard),
+        {noreply, State};
+    {0, {adopted, OsPid, App}} ->
+        % Left running by the port program before this one (see journal_dir), watched from here on
+        debug(Debug, "Adopted pid ~w (~s)\n", [OsPid, App]),
+        add_monitor({ok, OsPid, 0}, true, self(), State),
+        {noreply, State};
+    {0, {Stream, OsPid, Output}} when Stream =:= stdout; Stream =:= stderr ->
+        % Output of a process started with {stdout, "erlang"} or {stderr, "erlang"}
+        os_process:deliver_output(OsPid, Stream, Output),
         {noreply, State};
     {N, Reply} when N =/= 0 ->
-      case get_transaction(Trans, N) of
-        {true, {Pid,_} = From, Q, Link} ->
+      case dict:find(N, Trans) of
+        {ok, {{Pid,_} = From, Link, TRef}} ->
+          cancel_trans_timer(TRef),
           case Reply of
             {error,_Stage,_OsPid,_ExitStatus,_StrError} = ErrorReply ->
               gen_server:reply(From, ErrorReply);
+            {ok, Replies} when is_list(Link) ->
+              % A batch, every op gets its own monitor
+              NewReplies = lists:zipwith(fun(R, L) -> add_monitor(R, L, Pid, State) end, Replies, Link),
+              gen_server:reply(From, {ok, NewReplies});
             _ ->
-              NewReply = add_monitor(Reply, Link, Pid, Debug),
+              NewReply = add_monitor(Reply, Link, Pid, State),
               gen_server:reply(From, NewReply)
-          end;
-        {false, Q} ->
-          ok
-      end,
-      {noreply, State#state{trans=Q}};
+          end,
+          {noreply, set_trans(dict:erase(N, Trans), State)}};
+        error ->
+          case dict:find(N, State#state.late) of
+            {ok, kill} ->
+              {noreply, State#state{late = dict:erase(N, State#state.late)}};
+            {ok, Link} ->
+              % The caller was already told it timed out, nobody would watch what it started
+              debug(Debug, "Orphaned reply for transaction ~w: ~p\n", [N, Reply]),
+              NewState = kill_orphans(Reply, Link, State#state{late = dict:erase(N, State#state.late)}),
+              {noreply, NewState#state{orphaned = Orphaned + 1}};
+            error ->
+              debug(Debug, "Orphaned reply for transaction ~w: ~p\n", [N, Reply]),
+              {noreply, State#state{orphaned = Orphaned + 1}}
+          end
+      end;
     _Else ->
       {noreply, State}
   end;
+handle_info({trans_timeout, N}, #state{trans = Trans} = State) ->
+  case dict:find(N, Trans) of
+    {ok, {From, Link, _TRef}} ->
+      gen_server:reply(From, {error, timeout}),
+      Late = dict:store(N, Link, State#state.late),
+      {noreply, set_trans(dict:erase(N, Trans), State#state{late = Late})};
+    error ->
+      {noreply, State}
+  end;
 handle_info({Port, {exit_status, 0}}, #state{port=Port} = State) ->
   {stop, normal, State};
 handle_info({Port, {exit_status, Status}}, #state{port=Port} = State) ->
@@ -214,41 +352,62 @@ code_change(_OldVsn, State, _Extra) ->
 %%--------------------------------------------------------------------
 %%% Internal functions
 %%--------------------------------------------------------------------
-handle_port_call(T, From, #state{last_trans = LastTrans, trans = OldTransQ} = State) ->
+handle_port_call(T, From, #state{last_trans = LastTrans, trans = Trans, trans_timeout = Timeout} = State) ->
   try
     TransId = next_trans(LastTrans),
     erlang:port_command(State#state.port, term_to_binary({TransId, T})),
-    Link = case element(1, T) of
-      run -> true;
-      _ -> false
+    Link = case T of
+      {batch, Ops} -> [element(1, Op) =:= run || Op <- Ops];
+      _ -> element(1, T) =:= run
     end,
-    {noreply, State#state{trans = queue:in({TransId, From, Link}, OldTransQ)}}
+    TRef = start_trans_timer(Timeout, TransId),
+    {noreply, set_trans(dict:store(TransId, {From, Link, TRef}, Trans), State#state{last_trans = TransId})}
   catch _:{error, Why} ->
     {reply, {error, Why}, State}
   end.
   
 %% Add a link for Pid to OsPid if requested.
-add_monitor({ok, OsPid, _Status}, true, Pid, Debug) when is_integer(OsPid) ->
+add_monitor({ok, OsPid, _Status}, true, Pid, #state{shard = Shard, debug = Debug}) when is_integer(OsPid) ->
   % This is a reply to a run/run_link command. The port program indicates
   % of creating a new OsPid process.
   % Spawn a light-weight process responsible for monitoring this OsPid
   Self = self(),
   Process = spawn_link(fun() -> os_process:start(Pid, OsPid, Self, Debug) end),
   ets:insert(?PID_MONITOR_TABLE, [{OsPid, Process}, {Process, OsPid}]),
+  babysitter_pool:claim(OsPid, Shard),
   {ok, Process, OsPid};
-add_monitor(Reply, false, _Pid, _Debug) ->
+add_monitor(Reply, _Link, _Pid, _State) ->
   Reply.
 
-get_transaction(Q, I) -> get_transaction(Q, I, Q).
-get_transaction(Q, I, OldQ) ->
-  case queue:out(Q) of
-    {{value, {I, From, Link}}, Q2} ->
-      {true, From, Q2, Link};
-    {empty, _} ->
-      {false, OldQ};
-    {_E, Q2} ->
-      get_transaction(Q2, I, OldQ)
-    end.
+%% Kill what a run the caller gave up on started, nothing else would
+%% ever stop it. The kill's own reply is dropped.
+kill_orphans({ok, Replies}, Link, State) when is_list(Link) ->
+  lists:foldl(fun({R, L}, S) -> kill_orphans(R, L, S) end, State, lists:zip(Replies, Link));
+kill_orphans({ok, OsPid, _Status}, true, #state{last_trans = LastTrans, late = Late, debug = Debug} = State) when is_integer(OsPid) ->
+  debug(Debug, "Killing orphaned pid ~w\n", [OsPid]),
+  TransId = next_trans(LastTrans),
+  erlang:port_command(State#state.port, term_to_binary({TransId, {kill, OsPid}})),
+  State#state{last_trans = TransId, late = dict:store(TransId, kill, Late)};
+kill_orphans(_Reply, _Link, State) ->
+  State.
+
+% Only the options of runs and execs need to be cleaned up
+build_batch_op({run, Command, Options}) -> {run, Command, build_exec_opts(Options, [])};
+build_batch_op({exec, Command, Options}) -> {exec, Command, build_exec_opts(Options, [])};
+build_batch_op({stop, OsPid, Options}) -> {stop, OsPid, build_stop_opts(Options, [])};
+build_batch_op(Op) -> Op.
+
+% Let the pool know how busy we are whenever a transaction comes or goes
+set_trans(Trans, #state{shard = Shard} = State) ->
+  babysitter_pool:set_load(Shard, dict:size(Trans)),
+  State#state{trans = Trans}.
+
+% Give up on a transaction the port hasn't answered in Timeout ms
+start_trans_timer(infinity, _TransId) -> undefined;
+start_trans_timer(Timeout, TransId) -> erlang:send_after(Timeout, self(), {trans_timeout, TransId}).
+
+cancel_trans_timer(undefined) -> ok;
+cancel_trans_timer(TRef) -> erlang:cancel_timer(TRef).
 
 
 %%-------------------------------------------------------------------------
@@ -292,18 +451,36 @@ search_for_application_value_from_environment(Param) ->
 
 % Build the port process command
 build_port_command(Opts) ->
-  Args = build_port_command1(Opts, []),
+  % The port program has to frame its packets the way the port is opened
+  Packet = proplists:get_value(packet, Opts, ?DEFAULT_PACKET),
+  % Every shard journals its running children to a file of its own under journal_dir
+  Journal = case proplists:get_value(journal_dir, Opts) of
+    undefined -> [];
+    Dir -> [{journal, filename:join(Dir, io_lib:format("babysitter.~w.journal", [proplists:get_value(shard, Opts, 1)]))}]
+  end,
+  Args = build_port_command1([{packet, Packet}|Journal ++ Opts], []),
   proplists:get_value(port_program, Opts, default(port_program)) ++ lists:flatten([" -n"|Args]).
 
 % Fold down the option list and collect the options for the port program
 build_port_command1([], Acc) -> Acc;
 build_port_command1([{verbose, _V} = T | Rest], Acc) -> build_port_command1(Rest, [port_command_option(T) | Acc]);
 build_port_command1([{debug, X} = T|Rest], Acc) when is_integer(X) -> build_port_command1(Rest, [port_command_option(T) | Acc]);
+build_port_command1([{packet, N} = T|Rest], Acc) when N =:= 2; N =:= 4 -> build_port_command1(Rest, [port_command_option(T) | Acc]);
+% A delegated cgroup v2 directory, needed for the memory_max, cpu_weight, cpu_max and pids_max options
+build_port_command1([{cgroup_root, _Dir} = T|Rest], Acc) -> build_port_command1(Rest, [port_command_option(T) | Acc]);
+% Orphans of the commands are reparented to (and reaped by) the port program rather than init
+build_port_command1([{subreaper, true} = T|Rest], Acc) -> build_port_command1(Rest, [port_command_option(T) | Acc]);
+% A port program started again adopts whatever the one before it left running
+build_port_command1([{journal, _File} = T|Rest], Acc) -> build_port_command1(Rest, [port_command_option(T) | Acc]);
 build_port_command1([_H|Rest], Acc) -> build_port_command1(Rest, Acc).
 
 % Purely to clean this up
 port_command_option({debug, X}) when is_integer(X) -> io:fwrite(" --debug ~w", [X]);
 port_command_option({debug, _Else}) -> " --debug 4";
+port_command_option({packet, N}) -> " --packet " ++ integer_to_list(N);
+port_command_option({cgroup_root, Dir}) -> " --cgroup_root " ++ Dir;
+port_command_option({subreaper, true}) -> " --subreaper";
+port_command_option({journal, File}) -> " --journal " ++ lists:flatten(File);
 port_command_option(_) -> "".
 
 % Accept only know execution options
@@ -314,11 +491,52 @@ build_exec_opts([{env, _V}=T|Rest], Acc) -> build_exec_opts(Rest, [T|Acc]);
 build_exec_opts([{nice, _V}=T|Rest], Acc) -> build_exec_opts(Rest, [T|Acc]);
 build_exec_opts([{do_before, _V}=T|Rest], Acc) -> build_exec_opts(Rest, [T|Acc]);
 build_exec_opts([{do_after, _V}=T|Rest], Acc) -> build_exec_opts(Rest, [T|Acc]);
-% Get these back in? 
-% build_exec_opts([{stdout, _V}=T|Rest], Acc) -> build_exec_opts(Rest, [T|Acc]);
-% build_exec_opts([{stderr, _V}=T|Rest], Acc) -> build_exec_opts(Rest, [T|Acc]);
+% "/path" | "append:/path" | "null" | "pipe:/path" (rotated by the port program)
+% "erlang" (sent to the owner as {stdout|stderr, OsPid, Binary}) and, for stderr only, "stdout"
+build_exec_opts([{stdout, _V}=T|Rest], Acc) -> build_exec_opts(Rest, [T|Acc]);
+build_exec_opts([{stderr, _V}=T|Rest], Acc) -> build_exec_opts(Rest, [T|Acc]);
+% cgroup v2 limits, the command runs in a cgroup of its own under cgroup_root
+% memory_max (bytes), cpu_weight (1-10000), cpu_max ("Quota Period" in usecs) and pids_max
+build_exec_opts([{memory_max, V}=T|Rest], Acc) when is_integer(V) -> build_exec_opts(Rest, [T|Acc]);
+build_exec_opts([{cpu_weight, V}=T|Rest], Acc) when is_integer(V) -> build_exec_opts(Rest, [T|Acc]);
+build_exec_opts([{cpu_max, _V}=T|Rest], Acc) -> build_exec_opts(Rest, [T|Acc]);
+build_exec_opts([{pids_max, V}=T|Rest], Acc) when is_integer(V) -> build_exec_opts(Rest, [T|Acc]);
+% Brought back by the port program when it exits, the owner gets {restarted, OldOsPid, NewOsPid, Status}
+% restart is temporary (the default, never), transient (unless it exits 0) or permanent (always)
+% At most max_restarts (3) in restart_window (5000 ms), backoff (100 ms) doubles up to max_backoff (30000 ms)
+build_exec_opts([{restart, V}=T|Rest], Acc) when V =:= temporary; V =:= transient; V =:= permanent -> build_exec_opts(Rest, [T|Acc]);
+build_exec_opts([{max_restarts, V}=T|Rest], Acc) when is_integer(V) -> build_exec_opts(Rest, [T|Acc]);
+build_exec_opts([{restart_window, V}=T|Rest], Acc) when is_integer(V) -> build_exec_opts(Rest, [T|Acc]);
+build_exec_opts([{backoff, V}=T|Rest], Acc) when is_integer(V) -> build_exec_opts(Rest, [T|Acc]);
+build_exec_opts([{max_backoff, V}=T|Rest], Acc) when is_integer(V) -> build_exec_opts(Rest, [T|Acc]);
+% What the command is journaled as, handed back in {adopted, OsPid, App} by the port program after this one
+build_exec_opts([{app, V}|Rest], Acc) when is_atom(V) -> build_exec_opts(Rest, [{app, atom_to_list(V)}|Acc]);
+build_exec_opts([{app, _V}=T|Rest], Acc) -> build_exec_opts(Rest, [T|Acc]);
 build_exec_opts([_Else|Rest], Acc) -> build_exec_opts(Rest, Acc).
 
+build_stop_opts([], Acc) -> Acc;
+build_stop_opts([{app, AppType}|Rest], Acc) ->
+  case configured_command(AppType, stop) of
+    undefined -> build_stop_opts(Rest, Acc);
+    Command -> build_stop_opts(Rest, [{command, Command}|Acc])
+  end;
+build_stop_opts([{command, _V}=T|Rest], Acc) -> build_stop_opts(Rest, [T|Acc]);
+build_stop_opts([{timeout, V}=T|Rest], Acc) when is_integer(V) -> build_stop_opts(Rest, [T|Acc]);
+build_stop_opts([{cd, _V}=T|Rest], Acc) -> build_stop_opts(Rest, [T|Acc]);
+build_stop_opts([{env, _V}=T|Rest], Acc) -> build_stop_opts(Rest, [T|Acc]);
+build_stop_opts([_Else|Rest], Acc) -> build_stop_opts(Rest, Acc).
+
+% The command an app has configured for Action, if it has one of its own
+configured_command(AppType, Action) ->
+  case babysitter_config:get(AppType, Action) of
+    {ok, Config} ->
+      case element(2, Config) of
+        [] -> undefined;
+        Command -> Command
+      end;
+    _ -> undefined
+  end.
+
 % PRIVATE
 debug(false, _, _) ->     ok;
 debug(true, Fmt, Args) -> io:format(Fmt, Args).
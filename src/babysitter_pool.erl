@@ -0,0 +1,123 @@
+%%% babysitter_pool
+%% @author Ari Lerner <arilerner@mac.com>
+%% @copyright 2010 Ari Lerner <arilerner@mac.com>
+%% @doc A pool of babysitter shards, each one a gen_server with a port
+%%      program of its own. Requests are routed to a shard either by a
+%%      hash of the app name (so an app always lands on the same port
+%%      program) or to the shard with the fewest transactions in flight
+-module (babysitter_pool).
+-include ("babysitter.hrl").
+
+-export ([
+  init/1,
+  init_tables/0,
+  shards/0,
+  shard_name/1,
+  pick/1,
+  owner/1,
+  claim/2,
+  release/1,
+  set_load/2
+]).
+
+%%-------------------------------------------------------------------
+%% @spec (Options::proplist()) -> ok
+%% @doc Set up the pool: {shards, N} port programs, routed with
+%%      {routing, hash | least_loaded}
+%% @end
+%%-------------------------------------------------------------------
+init(Options) ->
+  init_tables(),
+  Shards = option(shards, Options, ?DEFAULT_SHARDS),
+  Routing = option(routing, Options, ?DEFAULT_ROUTING),
+  ets:insert(?BABYSITTER_POOL_TABLE, [{shards, Shards}, {routing, Routing}]),
+  lists:foreach(fun(N) -> set_load(N, 0) end, lists:seq(1, Shards)),
+  ok.
+
+%%-------------------------------------------------------------------
+%% @spec () -> ok
+%% @doc The tables every shard shares, created by whoever gets there first
+%% @end
+%%-------------------------------------------------------------------
+init_tables() ->
+  case catch ets:info(?BABYSITTER_POOL_TABLE) of
+    undefined ->
+      ets:new(?BABYSITTER_POOL_TABLE, [set, named_table, public]),
+      ets:insert(?BABYSITTER_POOL_TABLE, [{shards, 1}, {routing, ?DEFAULT_ROUTING}]);
+    _ -> ok
+  end,
+  case catch ets:info(?PID_MONITOR_TABLE) of
+    undefined -> ets:new(?PID_MONITOR_TABLE, [set, named_table, public]);
+    _ -> ok
+  end,
+  ok.
+
+shards() ->
+  case catch ets:lookup(?BABYSITTER_POOL_TABLE, shards) of
+    [{shards, N}] -> N;
+    _ -> 1
+  end.
+
+% The first shard keeps the name a lone babysitter always had
+shard_name(1) -> babysitter;
+shard_name(N) -> list_to_atom("babysitter_" ++ integer_to_list(N)).
+
+%%-------------------------------------------------------------------
+%% @spec (Key) -> Shard::atom()
+%% @doc The shard a request goes to. Key is the app name (or the
+%%      command, when there is no app) for hash routing
+%% @end
+%%-------------------------------------------------------------------
+pick(Key) ->
+  case shards() of
+    1 -> shard_name(1);
+    N ->
+      case ets:lookup(?BABYSITTER_POOL_TABLE, routing) of
+        [{routing, hash}] -> shard_name(erlang:phash2(Key, N) + 1);
+        _ -> shard_name(least_loaded(N))
+      end
+  end.
+
+least_loaded(N) ->
+  Loads = [{load(S), S} || S <- lists:seq(1, N)],
+  {_Load, Shard} = lists:min(Loads),
+  Shard.
+
+load(Shard) ->
+  case ets:lookup(?BABYSITTER_POOL_TABLE, {load, Shard}) of
+    [{_, Load}] -> Load;
+    [] -> 0
+  end.
+
+%%-------------------------------------------------------------------
+%% @spec (Shard::integer(), Load::integer()) -> true
+%% @doc Published by every shard as its transactions come and go
+%% @end
+%%-------------------------------------------------------------------
+set_load(Shard, Load) ->
+  ets:insert(?BABYSITTER_POOL_TABLE, {{load, Shard}, Load}).
+
+%%-------------------------------------------------------------------
+%% @spec (OsPid::integer()) -> Shard::atom() | undefined
+%% @doc The shard whose port program started OsPid
+%% @end
+%%-------------------------------------------------------------------
+owner(OsPid) ->
+  case ets:lookup(?BABYSITTER_POOL_TABLE, {ospid, OsPid}) of
+    [{_, Shard}] -> shard_name(Shard);
+    [] -> undefined
+  end.
+
+% Options given to the supervisor win over the application environment
+option(Key, Options, Default) ->
+  case proplists:get_value(Key, Options) of
+    undefined ->
+      case application:get_env(babysitter, Key) of
+        {ok, V} -> V;
+        undefined -> Default
+      end;
+    V -> V
+  end.
+
+claim(OsPid, Shard) -> ets:insert(?BABYSITTER_POOL_TABLE, {{ospid, OsPid}, Shard}).
+release(OsPid) -> ets:delete(?BABYSITTER_POOL_TABLE, {ospid, OsPid}).
@@ -45,14 +45,18 @@ start_link(Opts) ->
 %% to find out about restart strategy, maximum restart frequency and child
 %% specifications.
 %%--------------------------------------------------------------------
+init([]) -> init([[]]);
 init([Opts]) ->
-  AppSrv = {the_babysitter_srv,{babysitter, start_link, [Opts]}, permanent,2000,worker,dynamic},
+  % One babysitter (and port program) per shard, {shards, N} of them
+  babysitter_pool:init(Opts),
+  Shards = [{{the_babysitter_srv, N},{babysitter, start_link, [N, Opts]}, permanent,2000,worker,dynamic} ||
+    N <- lists:seq(1, babysitter_pool:shards())],
   % ChildrenSpecs = {
   %   babysitter_process_sup, 
   %   {supervisor, start_link, [{local, babysitter_process_sup}, babysitter_process_sup, []]},
   %   permanent, infinity, supervisor, []
   % },
-  {ok,{{one_for_one,5,10}, [AppSrv]}}.
+  {ok,{{one_for_one,5,10}, Shards}}.
 
 %%====================================================================
 %% Internal functions
@@ -8,6 +8,8 @@
 -export ([
   start/4,
   notify_ospid_owner/2,
+  notify_restarted/3,
+  deliver_output/3,
   process_owner_died/3
 ]).
 
@@ -35,6 +37,13 @@ ospid_loop({Pid, OsPid, Parent, Debug} = State) ->
       ospid_loop(State);
     {stop} ->
       process_owner_died(Pid, normal, State);
+    {output, Stream, Output} ->
+      Pid ! {Stream, OsPid, Output},
+      ospid_loop(State);
+    {restarted, NewOsPid, Status} ->
+      ?DBG(Debug, "~w ~w restarted as ~w (~w)\n", [self(), OsPid, NewOsPid, status(Status)]),
+      Pid ! {restarted, OsPid, NewOsPid, Status},
+      ospid_loop({Pid, NewOsPid, Parent, Debug});
     {'DOWN', OsPid, {exit_status, Status}} ->
       ?DBG(Debug, "~w ~w got down message (~w)\n", [self(), OsPid, status(Status)]),
       % OS process died
@@ -78,6 +87,42 @@ notify_ospid_owner(OsPid, Status) ->
       ok
   end.
 
+%%-------------------------------------------------------------------
+%% @spec (OldOsPid::int(), NewOsPid::int(), Status::integer()) ->    ok
+%% @doc The port program restarted OldOsPid after it exited with Status,
+%%      the same Erlang process watches it under NewOsPid from now on
+%%      and the owner gets {restarted, OldOsPid, NewOsPid, Status}
+%% @private
+%% @end
+%%-------------------------------------------------------------------
+notify_restarted(OldOsPid, NewOsPid, Status) ->
+  case ets:lookup(?PID_MONITOR_TABLE, OldOsPid) of
+    [{_OsPid, Pid}] ->
+      ets:delete(?PID_MONITOR_TABLE, OldOsPid),
+      ets:insert(?PID_MONITOR_TABLE, [{NewOsPid, Pid}, {Pid, NewOsPid}]),
+      Pid ! {restarted, NewOsPid, Status},
+      ok;
+    [] ->
+      ok
+  end.
+
+%%-------------------------------------------------------------------
+%% @spec (OsPid::int(), Stream, Output::binary()) ->    ok
+%%        Stream = stdout | stderr
+%% @doc Hand a chunk of output of the OsPid to its owner, who gets it
+%%      as {Stream, OsPid, Output}
+%% @private
+%% @end
+%%-------------------------------------------------------------------
+deliver_output(OsPid, Stream, Output) ->
+  case ets:lookup(?PID_MONITOR_TABLE, OsPid) of
+    [{_OsPid, Pid}] ->
+      Pid ! {output, Stream, Output},
+      ok;
+    [] ->
+      ok
+  end.
+
 %%-------------------------------------------------------------------
 %% @spec (Pid::int(), Reason::string(), State) ->    ok
 %% @doc Notify the parent that the parent process died
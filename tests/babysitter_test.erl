@@ -30,6 +30,24 @@ starting_test_() ->
     }
   }.
 
+timing_out_test_() ->
+  {spawn,
+    {setup,
+      fun() -> babysitter:start_link([{trans_timeout, 500}]), ok end,
+      fun teardown/1,
+      [
+        fun test_timed_out_run_is_not_leaked/0
+      ]
+    }
+  }.
+
+test_timed_out_run_is_not_leaked() ->
+  % The before hook outlasts the transaction, the run is only answered once it's over
+  {error, timeout} = babysitter:bs_spawn_run("/bin/sleep 201.4", [{do_before, "sleep 1"}]),
+  timer:sleep(2000),
+  ?assertEqual(1, proplists:get_value(orphaned_replies, babysitter:port_stats())),
+  ?assertCmdOutput("0\n", "ps aux | grep -v grep | grep 'sleep 201.4' | wc -l | tr -d ' '").
+
 test_starting_one_process() ->
   {ok, _ErlProcess, Pid} = babysitter:bs_spawn_run("/bin/sleep 2.1", [{env, "HELLO=world"}]),
   CommandArgString = lists:flatten(io_lib:format("ps aux | grep ~p | grep -v grep |awk '{print $2}'", [Pid])),
@@ -52,10 +70,16 @@ test_starting_many_processes() ->
   ?assertEqual(Int, 50).
 
 test_killing_a_process() ->
-  {ok, _ErlProcess, Pid} = babysitter:bs_spawn_run("/bin/sleep 2.6", [{env, "NAME=ari"}]),
-  {exit_status, Pid, _Status} = babysitter:kill_pid(Pid),
+  {ok, ErlProcess, Pid} = babysitter:bs_spawn_run("/bin/sleep 2.6", [{env, "NAME=ari"}]),
+  Trap = process_flag(trap_exit, true),
+  % The reply only says the signal went out, the exit comes once the child is reaped
+  {ok, Pid, 9} = babysitter:kill_pid(Pid),
+  receive
+    {'EXIT', ErlProcess, {exit_status, Status}} -> ?assertEqual(9, Status band 127)
+  after 5000 -> erlang:error(no_exit_after_the_kill)
+  end,
+  process_flag(trap_exit, Trap),
   CommandArgString = lists:flatten(io_lib:format("ps aux | grep ~p | grep -v grep | wc -l | tr -d ' '", [Pid])),
-  timer:sleep(500),
   O = ?cmd(CommandArgString),
   {Int, _} = string:to_integer(O),
   ?assertEqual(0, Int).